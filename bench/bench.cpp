@@ -0,0 +1,192 @@
+#include "pch.hpp"
+
+#include <boost/program_options.hpp>
+#include <future>
+#include <iostream>
+#include <random>
+
+#include "../librft/client.hpp"
+#include "../librft/logger.hpp"
+#include "../librft/server.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace options = boost::program_options;
+namespace ip = boost::asio::ip;
+
+namespace {
+
+// User + kernel time of the whole process in seconds
+double ProcessCpuSeconds() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    const auto toSeconds = [](const FILETIME& time) { return static_cast<double>((static_cast<U64>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; };
+    return toSeconds(kernel) + toSeconds(user);
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    const auto toSeconds = [](const timeval& time) { return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) / 1e6; };
+    return toSeconds(usage.ru_utime) + toSeconds(usage.ru_stime);
+#endif
+}
+
+void GenerateFile(const std::filesystem::path& path, U64 size, U64 seed) {
+    std::mt19937_64 generator(seed);
+    std::vector<U64> block(128 * 1024);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    for (U64 written = 0; written < size;) {
+        std::ranges::generate(block, std::ref(generator));
+
+        const auto length = std::min<U64>(size - written, block.size() * sizeof(U64));
+        file.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(length));
+        written += length;
+    }
+
+    if (!file) {
+        throw std::runtime_error{std::format("Could not write test file {}.", path.string())};
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "Print help message")
+        ("file-size", options::value<U64>()->default_value(1024 * 1024), "Size of every test file in bytes")
+        ("files", options::value<unsigned>()->default_value(1), "Number of test files, every client downloads all of them one after another")
+        ("clients", options::value<unsigned>()->default_value(1), "Number of concurrent clients")
+        ("threads", options::value<unsigned>(), "Number of I/O threads (default: 2 * clients + 2)")
+        ("port", options::value<unsigned short>()->default_value(5051), "Server port on the loopback interface")
+        ("directory", options::value<std::string>(), "Working directory for test and downloaded files (default: a temporary directory)")
+        ("seed", options::value<U64>()->default_value(1), "Seed for the test file contents")
+        ("label", options::value<std::string>()->default_value(""), "Free-form label copied to the output, e.g. a commit hash")
+        ("timeout", options::value<unsigned>()->default_value(300), "Give up on clients that haven't finished after this many seconds")
+        ("log-level", options::value<std::string>()->default_value("warning"), "Minimum log level (trace, debug, info, warning, error, fatal)")
+        ("keep-files", "Don't delete the working directory afterwards");
+
+    options::variables_map map;
+    options::store(options::parse_command_line(argc, argv, desc), map);
+    options::notify(map);
+
+    if (map.count("help") > 0) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    const auto severity = rft::log::ParseSeverity(map["log-level"].as<std::string>());
+    if (!severity) {
+        std::cout << "Unknown log level " << map["log-level"].as<std::string>() << "\n";
+        return 1;
+    }
+    rft::log::StartAsyncLogging({.minimumSeverity = *severity});
+
+    const auto fileSize = map["file-size"].as<U64>();
+    const auto fileCount = map["files"].as<unsigned>();
+    const auto clientCount = map["clients"].as<unsigned>();
+    const auto threadCount = map.count("threads") > 0 ? map["threads"].as<unsigned>() : 2 * clientCount + 2;
+    const auto port = map["port"].as<unsigned short>();
+
+    const std::filesystem::path workingDirectory =
+        map.count("directory") > 0 ? std::filesystem::path{map["directory"].as<std::string>()} : std::filesystem::temp_directory_path() / "rft_bench";
+    const auto serveDirectory = workingDirectory / "serve";
+    const auto downloadDirectory = workingDirectory / "download";
+    std::filesystem::create_directories(serveDirectory);
+
+    std::vector<std::string> fileNames;
+    for (unsigned i = 0; i < fileCount; ++i) {
+        fileNames.push_back(std::format("bench_{}.bin", i));
+        GenerateFile(serveDirectory / fileNames.back(), fileSize, map["seed"].as<U64>() + i);
+    }
+
+    boost::asio::thread_pool ioContext(threadCount);
+    // All clients share one source address, so the per-source hello rate limit must not get in the way. The cookie round trip stays on, it's part of
+    // the handshake latency we want to see.
+    rft::HandshakeOptions handshakeOptions;
+    handshakeOptions.hellosPerSecond = 1e6;
+    handshakeOptions.helloBurst = 1e6;
+    rft::Server server(ioContext.get_executor(), static_cast<short>(port), serveDirectory, {}, handshakeOptions);
+    boost::asio::co_spawn(ioContext, server.Run(), boost::asio::detached);
+
+    const ip::udp::endpoint serverEndpoint{ip::make_address("127.0.0.1"), port};
+    std::vector<std::unique_ptr<rft::Client>> clients;
+    for (unsigned i = 0; i < clientCount; ++i) {
+        const auto clientDirectory = downloadDirectory / std::format("client_{}", i);
+        std::filesystem::create_directories(clientDirectory);
+        clients.push_back(std::make_unique<rft::Client>(ioContext.get_executor(), serverEndpoint, clientDirectory));
+    }
+
+    std::promise<void> finished;
+    std::atomic<unsigned> runningClients = clientCount;
+
+    const auto cpuStart = ProcessCpuSeconds();
+    const auto wallStart = std::chrono::steady_clock::now();
+
+    for (auto& client : clients) {
+        boost::asio::co_spawn(
+            ioContext,
+            [&client, &fileNames]() -> boost::asio::awaitable<void> {
+                for (const auto& fileName : fileNames) {
+                    co_await client->Run(fileName);
+                }
+            },
+            [&finished, &runningClients](std::exception_ptr) {
+                if (--runningClients == 0) {
+                    finished.set_value();
+                }
+            });
+    }
+
+    // A stuck client must not keep us from reporting, the output says that the run timed out
+    const auto timeout = std::chrono::seconds{map["timeout"].as<unsigned>()};
+    const bool timedOut = finished.get_future().wait_for(timeout) == std::future_status::timeout;
+    const auto finishedClients = clientCount - runningClients.load();
+
+    const auto wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const auto cpuSeconds = ProcessCpuSeconds() - cpuStart;
+
+    ioContext.stop();
+    ioContext.join();
+
+    unsigned verified = 0;
+    for (unsigned i = 0; i < clientCount; ++i) {
+        for (const auto& fileName : fileNames) {
+            const auto path = downloadDirectory / std::format("client_{}", i) / fileName;
+            std::error_code error;
+            if (std::filesystem::file_size(path, error) == fileSize && !error) {
+                ++verified;
+            }
+        }
+    }
+
+    U64 datagrams = server.Metrics().Endpoint().datagramsSent.Load() + server.Metrics().Endpoint().datagramsReceived.Load();
+    U64 handshakes = 0;
+    U64 handshakeMicroseconds = 0;
+    for (const auto& client : clients) {
+        handshakes += client->Metrics().Endpoint().handshakesCompleted.Load();
+        handshakeMicroseconds += client->Metrics().Endpoint().handshakeMicroseconds.Load();
+    }
+
+    const auto bytes = static_cast<double>(fileSize) * fileCount * clientCount;
+    std::cout << std::format(
+        R"({{"label":"{}","fileSize":{},"files":{},"clients":{},"threads":{},"downloads":{},"verified":{},"timedOut":{},"finishedClients":{},)"
+        R"("wallSeconds":{:.6f},"goodputMBps":{:.3f},"packetsPerSecond":{:.1f},"cpuSecondsPerGB":{:.3f},"handshakeMeanUs":{}}})",
+        map["label"].as<std::string>(), fileSize, fileCount, clientCount, threadCount, fileCount * clientCount, verified, timedOut, finishedClients, wallSeconds,
+        bytes / wallSeconds / 1e6, static_cast<double>(datagrams) / wallSeconds, bytes > 0 ? cpuSeconds / (bytes / 1e9) : 0.0,
+        handshakes == 0 ? 0 : handshakeMicroseconds / handshakes)
+              << "\n";
+
+    rft::log::StopAsyncLogging();
+
+    if (map.count("keep-files") == 0) {
+        std::filesystem::remove_all(workingDirectory);
+    }
+
+    return !timedOut && verified == fileCount * clientCount ? 0 : 2;
+}
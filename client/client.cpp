@@ -1,5 +1,6 @@
 #include "pch.hpp"
 
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <boost/program_options.hpp>
@@ -8,6 +9,7 @@
 
 #include "../librft/client.hpp"
 #include "../librft/logger.hpp"
+#include "../librft/multicast.hpp"
 
 namespace options = boost::program_options;
 
@@ -18,7 +20,21 @@ int main(int argc, char** argv) {
     options::options_description desc("Allowed options");
     desc.add_options()
         ("help", "Print help message")
-        ("version", "Print version");
+        ("version", "Print version")
+        ("log-file", options::value<std::string>(), "Write the log to this file instead of the console")
+        ("log-level", options::value<std::string>()->default_value("info"), "Minimum log level (trace, debug, info, warning, error, fatal)")
+        ("sync-log", "Log synchronously on the calling thread instead of using the background logging thread")
+        ("metrics", "Print a JSON metrics snapshot once the download is finished")
+        ("trace-file", options::value<std::string>(), "Record per-stage latencies and write a sampled Chrome trace to this file on exit (needs RFT_ENABLE_TRACING)")
+        ("trace-sample", options::value<unsigned>()->default_value(64), "Keep every n-th stage as a trace event")
+        ("ack-every", options::value<unsigned>()->default_value(static_cast<unsigned>(rft::DEFAULT_ACK_FREQUENCY.ackEvery)), "Propose to ACK every n chunks, 1 ACKs every chunk")
+        ("ack-delay-us", options::value<U32>()->default_value(static_cast<U32>(rft::DEFAULT_ACK_FREQUENCY.maxDelayMicroseconds)), "Propose to hold back ACKs for at most this long")
+        ("encrypt", "Ask the server to encrypt the chunks, fail if it doesn't")
+        ("psk-file", options::value<std::string>(), "Mix the contents of this file into the key of encrypted streams, the server needs the same")
+        ("capture-file", options::value<std::string>(), "Write every datagram received and sent to this file")
+        ("multicast-group", options::value<std::string>(), "Receive the file from this multicast group instead of downloading it from the server")
+        ("multicast-port", options::value<unsigned short>()->default_value(5052), "Multicast group port")
+        ("multicast-interface", options::value<std::string>(), "Address of the interface to join the multicast group on");
 
     options::variables_map map;
     options::store(options::parse_command_line(argc, argv, desc), map);
@@ -29,8 +45,43 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    const auto severity = rft::log::ParseSeverity(map["log-level"].as<std::string>());
+    if (!severity) {
+        std::cout << "Unknown log level " << map["log-level"].as<std::string>() << "\n";
+        return 1;
+    }
+    rft::log::SetMinimumSeverity(*severity);
+
+    if (map.count("sync-log") == 0) {
+        rft::log::AsyncLoggingOptions logOptions;
+        if (map.count("log-file") > 0) {
+            logOptions.file = map["log-file"].as<std::string>();
+        }
+        logOptions.minimumSeverity = *severity;
+
+        rft::log::StartAsyncLogging(logOptions);
+    }
+
+    if (map.count("trace-file") > 0) {
+        if (!rft::tracing::COMPILED_IN) {
+            std::cout << "Tracing is not available, rebuild with -DRFT_ENABLE_TRACING=ON.\n";
+            return 1;
+        }
+        rft::tracing::Enable({.sampleEvery = map["trace-sample"].as<unsigned>()});
+    }
+
     boost::asio::thread_pool ioContext;
-    rft::Client s(ioContext.get_executor());
+    const rft::AckFrequency ackFrequency{static_cast<U8>(std::clamp(map["ack-every"].as<unsigned>(), 1u, 255u)), map["ack-delay-us"].as<U32>()};
+    std::string preSharedKey;
+    if (map.count("psk-file") > 0) {
+        std::ifstream pskFile(map["psk-file"].as<std::string>(), std::ios::binary);
+        preSharedKey.assign(std::istreambuf_iterator<char>(pskFile), {});
+    }
+    rft::Client s(ioContext.get_executor(), rft::Client::DefaultServerEndpoint(), rft::Client::DefaultDownloadDirectory(), ackFrequency,
+                  map.count("encrypt") > 0, std::move(preSharedKey));
+    if (map.count("capture-file") > 0) {
+        s.StartCapture(map["capture-file"].as<std::string>());
+    }
 
     std::cout << "________________________________\n"
         << "\\______   \\_   _____/\\__    ___/\n"
@@ -47,8 +98,38 @@ int main(int argc, char** argv) {
     std::getline(std::cin, fileName);
     LOG_INFO("Starting client!");
 
-    boost::asio::co_spawn(ioContext, s.Run(fileName), boost::asio::detached);
+    std::unique_ptr<rft::MulticastReceiver> multicastReceiver;
+    if (map.count("multicast-group") > 0) {
+        rft::MulticastOptions multicastOptions;
+        multicastOptions.group = {boost::asio::ip::make_address(map["multicast-group"].as<std::string>()), map["multicast-port"].as<unsigned short>()};
+        if (map.count("multicast-interface") > 0) {
+            multicastOptions.interfaceAddress = boost::asio::ip::make_address(map["multicast-interface"].as<std::string>());
+        }
+        multicastReceiver = std::make_unique<rft::MulticastReceiver>(ioContext.get_executor(), rft::Client::DefaultDownloadDirectory(), multicastOptions);
+
+        // An empty file name takes whatever the group announces first
+        boost::asio::co_spawn(ioContext, [&multicastReceiver, &fileName]() -> boost::asio::awaitable<void> {
+            try {
+                co_await multicastReceiver->Run(fileName);
+            } catch (const std::exception& e) {
+                LOG_ERROR("Multicast download failed: {}", e.what());
+            }
+        }, boost::asio::detached);
+    } else {
+        boost::asio::co_spawn(ioContext, s.Run(fileName), boost::asio::detached);
+    }
     ioContext.join();
 
+    if (map.count("metrics") > 0) {
+        std::cout << (multicastReceiver ? multicastReceiver->Metrics() : s.Metrics()).Snapshot() << "\n";
+    }
+
+    if (map.count("trace-file") > 0) {
+        rft::tracing::Disable();
+        rft::tracing::WriteChromeTrace(map["trace-file"].as<std::string>());
+        std::cout << rft::tracing::HistogramReport() << "\n";
+    }
+
     LOG_INFO("Goodbye from client.");
+    rft::log::StopAsyncLogging();
 }
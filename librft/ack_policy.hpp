@@ -0,0 +1,76 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <chrono>
+
+#include "messages.hpp"
+
+// Decides when the receiver of data sends an ACK. ACKs are cumulative, so one ACK for several in-order datagrams tells the sender just as much as one ACK
+// per datagram, with a fraction of the packets on the reverse path. Anything the sender has to react to (a gap, a duplicate, the first datagram after a
+// gap) is still ACKed right away.
+
+namespace rft {
+
+// What a peer does that doesn't negotiate: ACK every datagram
+constexpr static AckFrequency IMMEDIATE_ACKS{1, 0};
+
+// What the client proposes by default
+constexpr static AckFrequency DEFAULT_ACK_FREQUENCY{2, 5000};
+
+// The server accepts at most what it is willing to wait for: it needs ACKs to clock out data and to notice losses
+constexpr AckFrequency NegotiateAckFrequency(const AckFrequency& proposal, const AckFrequency& limit) noexcept {
+    return AckFrequency{
+        std::clamp<U8>(proposal.ackEvery, 1, std::max<U8>(limit.ackEvery, 1)),
+        std::min<U32>(proposal.maxDelayMicroseconds, limit.maxDelayMicroseconds)
+    };
+}
+
+class AckPolicy {
+public:
+    explicit AckPolicy(AckFrequency frequency = IMMEDIATE_ACKS) noexcept {
+        SetFrequency(frequency);
+    }
+
+    void SetFrequency(AckFrequency frequency) noexcept {
+        frequency.ackEvery = std::max<U8>(frequency.ackEvery, 1);
+        frequency_ = frequency;
+    }
+
+    const AckFrequency& Frequency() const noexcept {
+        return frequency_;
+    }
+
+    // How long an ACK may be held back. Whoever owns the receiver has to call FlushAck() on it at least this often.
+    std::chrono::microseconds MaxDelay() const noexcept {
+        return std::chrono::microseconds{frequency_.maxDelayMicroseconds};
+    }
+
+    // An in-order data datagram arrived. Returns true if the ACK has to go out now, otherwise it is pending.
+    bool OnInOrder() noexcept {
+        ++pending_;
+        return std::exchange(afterGap_, false) || pending_ >= frequency_.ackEvery || frequency_.maxDelayMicroseconds == 0;
+    }
+
+    // A gap or a duplicate: the ACK has to go out now, and so does the one for the datagram that fills the gap
+    bool OnOutOfOrder() noexcept {
+        afterGap_ = true;
+        return true;
+    }
+
+    bool HasPending() const noexcept {
+        return pending_ > 0;
+    }
+
+    // Returns how many datagrams the ACK covered
+    unsigned OnAckSent() noexcept {
+        return std::exchange(pending_, 0u);
+    }
+
+private:
+    AckFrequency frequency_{};
+    unsigned pending_ = 0;
+    bool afterGap_ = false;
+};
+
+} // namespace rft
@@ -0,0 +1,199 @@
+#include "pch.hpp"
+#include "logger.hpp"
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+
+namespace rft::log {
+
+namespace detail {
+std::atomic<bool> gAsyncEnabled{false};
+std::atomic<int> gMinimumSeverity{kTrace};
+}
+
+namespace {
+
+constexpr size_t RING_CAPACITY = 1024;
+
+// Every producing thread owns exactly one of these. Only that thread pushes, only the logging thread pops.
+struct ThreadRing {
+    boost::lockfree::spsc_queue<LogRecord, boost::lockfree::capacity<RING_CAPACITY>> records;
+    std::atomic<U64> dropped{0};
+    U32 threadIndex = 0;
+};
+
+// The rings outlive the backend, so that logging can be stopped and started again without invalidating the thread_local references.
+struct RingRegistry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadRing>> rings;
+    U32 nextThreadIndex = 0;
+};
+
+RingRegistry& Registry() {
+    static RingRegistry registry;
+    return registry;
+}
+
+ThreadRing& LocalRing() {
+    thread_local std::shared_ptr<ThreadRing> ring = [] {
+        auto& registry = Registry();
+        auto result = std::make_shared<ThreadRing>();
+
+        std::scoped_lock lock(registry.mutex);
+        result->threadIndex = registry.nextThreadIndex++;
+        registry.rings.push_back(result);
+        return result;
+    }();
+
+    return *ring;
+}
+
+class AsyncBackend {
+public:
+    explicit AsyncBackend(AsyncLoggingOptions options)
+        : options_(std::move(options)),
+          colored_(options_.file.empty()) {
+        if (!options_.file.empty()) {
+            file_.open(options_.file, std::ios::out | std::ios::app);
+            if (!file_) {
+                throw std::runtime_error{std::format("Could not open log file {}.", options_.file.string())};
+            }
+        }
+
+        thread_ = std::jthread([this](std::stop_token token) { Run(token); });
+    }
+
+    ~AsyncBackend() {
+        thread_.request_stop();
+        wakeup_.notify_all();
+        thread_.join();
+    }
+
+private:
+    struct PendingRecord {
+        LogRecord record;
+        U32 threadIndex;
+    };
+
+    void Run(std::stop_token token) {
+        std::vector<PendingRecord> batch;
+        batch.reserve(RING_CAPACITY);
+
+        while (!token.stop_requested()) {
+            if (Drain(batch) == 0) {
+                std::unique_lock lock(wakeupMutex_);
+                wakeup_.wait_for(lock, token, options_.flushInterval, [] { return false; });
+            }
+        }
+
+        // Whatever is still in the rings when we're asked to stop is written out as well
+        Drain(batch);
+    }
+
+    size_t Drain(std::vector<PendingRecord>& batch) {
+        batch.clear();
+        U64 dropped = 0;
+
+        {
+            auto& registry = Registry();
+            std::scoped_lock lock(registry.mutex);
+
+            for (const auto& ring : registry.rings) {
+                ring->records.consume_all([&batch, &ring](const LogRecord& record) { batch.push_back({record, ring->threadIndex}); });
+                dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+            }
+
+            // Threads that exited only hold their ring in the registry. Once these are empty, we can get rid of them.
+            std::erase_if(registry.rings, [](const auto& ring) { return ring.use_count() == 1 && ring->records.empty(); });
+        }
+
+        if (batch.empty() && dropped == 0) {
+            return 0;
+        }
+
+        // Each ring is ordered, but records of different threads are interleaved
+        std::ranges::stable_sort(batch, {}, [](const PendingRecord& pending) { return pending.record.timestamp; });
+
+        buffer_.clear();
+        for (const auto& pending : batch) {
+            Format(pending);
+        }
+
+        if (dropped != 0) {
+            std::format_to(std::back_inserter(buffer_), "{} log records were dropped, because the logging thread couldn't keep up.\n", dropped);
+        }
+
+        auto& stream = options_.file.empty() ? std::cout : file_;
+        stream.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        stream.flush();
+
+        return batch.size();
+    }
+
+    void Format(const PendingRecord& pending) {
+        constexpr static auto FAINT = "\033[2;90m";
+        constexpr static auto GREEN = "\033[32m";
+        constexpr static auto YELLOW = "\033[33m";
+        constexpr static auto RED = "\033[31m";
+        constexpr static auto RESET = "\033[0;10m";
+
+        const auto& record = pending.record;
+        const auto severityColor = record.severity < kWarning ? GREEN : (record.severity < kError ? YELLOW : RED);
+        const auto* severity = (record.severity >= 0 && record.severity < SEVERITY_LEVEL_STR.size()) ? SEVERITY_LEVEL_STR[record.severity] : "?????";
+        const std::string_view message{record.message.data(), record.length};
+        const auto timestamp = std::chrono::floor<std::chrono::microseconds>(record.timestamp);
+        auto out = std::back_inserter(buffer_);
+
+        if (colored_) {
+            std::format_to(out, "{}{:%Y-%m-%d %H:%M:%S}{}  {}{}{} {}--- [{}] : {}{}\n", FAINT, timestamp, RESET, severityColor, severity, RESET, FAINT, pending.threadIndex,
+                           RESET, message);
+        } else {
+            std::format_to(out, "{:%Y-%m-%d %H:%M:%S}  {} --- [{}] : {}\n", timestamp, severity, pending.threadIndex, message);
+        }
+    }
+
+    AsyncLoggingOptions options_;
+    bool colored_;
+    std::ofstream file_;
+    std::string buffer_;
+
+    std::mutex wakeupMutex_;
+    std::condition_variable_any wakeup_;
+
+    std::jthread thread_;
+};
+
+std::mutex gBackendMutex;
+std::unique_ptr<AsyncBackend> gBackend;
+
+} // namespace
+
+void detail::Submit(const LogRecord& record) noexcept {
+    auto& ring = LocalRing();
+    if (!ring.records.push(record)) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void StartAsyncLogging(AsyncLoggingOptions options) {
+    std::scoped_lock lock(gBackendMutex);
+
+    detail::gAsyncEnabled.store(false, std::memory_order_relaxed);
+    gBackend.reset();
+
+    detail::gMinimumSeverity.store(options.minimumSeverity, std::memory_order_relaxed);
+    gBackend = std::make_unique<AsyncBackend>(std::move(options));
+    detail::gAsyncEnabled.store(true, std::memory_order_release);
+}
+
+void StopAsyncLogging() {
+    std::scoped_lock lock(gBackendMutex);
+
+    detail::gAsyncEnabled.store(false, std::memory_order_release);
+    gBackend.reset();
+}
+
+} // namespace rft::log
@@ -0,0 +1,149 @@
+#include "pch.hpp"
+#include "capture.hpp"
+
+#include <cstring>
+
+#include "framing.hpp"
+#include "logger.hpp"
+
+namespace rft {
+
+namespace {
+
+constexpr std::array<char, 8> MAGIC{'R', 'F', 'T', 'C', 'A', 'P', '0', '1'};
+
+// Everything of a record before the address and everything between the address and the datagram
+constexpr size_t RECORD_PREFIX_SIZE = sizeof(U64) + sizeof(U8) + sizeof(U16) + sizeof(U8);
+constexpr size_t RECORD_SUFFIX_SIZE = sizeof(U16) + sizeof(U16);
+constexpr size_t MAX_ADDRESS_SIZE = 16;
+
+} // namespace
+
+CaptureWriter::CaptureWriter(const std::filesystem::path& path, size_t bufferSize)
+    : bufferSize_(bufferSize),
+      file_(path, std::ios::binary | std::ios::trunc) {
+    if (!file_) {
+        throw std::runtime_error{std::format("Could not create the capture file {}.", path.string())};
+    }
+
+    file_.write(MAGIC.data(), MAGIC.size());
+    buffer_.reserve(bufferSize_ + RECORD_PREFIX_SIZE + MAX_ADDRESS_SIZE + RECORD_SUFFIX_SIZE + MAX_DATAGRAM_SIZE);
+}
+
+CaptureWriter::~CaptureWriter() {
+    Flush();
+}
+
+void CaptureWriter::Record(CaptureDirection direction, const boost::asio::ip::udp::endpoint& peer, std::span<const char> datagram) {
+    const auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+    const auto header = framing::ParseHeader(datagram);
+    const U16 streamId = header ? U16{header->streamId} : U16{0};
+
+    std::array<char, MAX_ADDRESS_SIZE> address{};
+    const auto copyAddress = [&address](const auto& bytes) {
+        std::memcpy(address.data(), bytes.data(), bytes.size());
+        return bytes.size();
+    };
+    const auto addressSize = peer.address().is_v4() ? copyAddress(peer.address().to_v4().to_bytes()) : copyAddress(peer.address().to_v6().to_bytes());
+
+    const auto size = std::min(datagram.size(), size_t{std::numeric_limits<U16>::max()});
+
+    std::scoped_lock lock(mutex_);
+
+    const auto offset = buffer_.size();
+    buffer_.resize(offset + RECORD_PREFIX_SIZE + addressSize + RECORD_SUFFIX_SIZE + size);
+
+    framing::Writer writer({buffer_.data() + offset, buffer_.size() - offset});
+    writer.Put(static_cast<U64>(timestamp)).Put(static_cast<U8>(direction)).Put(streamId).Put(static_cast<U8>(addressSize));
+    writer.PutBytes({address.data(), addressSize});
+    writer.Put(peer.port()).Put(static_cast<U16>(size));
+    writer.PutBytes(datagram.first(size));
+
+    records_.fetch_add(1, std::memory_order_relaxed);
+    if (buffer_.size() >= bufferSize_) {
+        FlushLocked();
+    }
+}
+
+void CaptureWriter::Flush() {
+    std::scoped_lock lock(mutex_);
+    FlushLocked();
+    file_.flush();
+}
+
+void CaptureWriter::FlushLocked() {
+    file_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    if (!file_) {
+        LOG_ERROR("Writing the capture failed, {} bytes of records were lost.", buffer_.size());
+        file_.clear();
+    }
+    buffer_.clear();
+}
+
+CaptureReader::CaptureReader(const std::filesystem::path& path)
+    : file_(path, std::ios::binary) {
+    std::array<char, MAGIC.size()> magic{};
+    if (!file_ || !file_.read(magic.data(), magic.size()) || magic != MAGIC) {
+        throw std::runtime_error{std::format("{} is not a capture.", path.string())};
+    }
+}
+
+std::optional<CapturedDatagram> CaptureReader::Next() {
+    std::array<char, RECORD_PREFIX_SIZE> prefix{};
+    if (!file_.read(prefix.data(), prefix.size())) {
+        if (file_.gcount() != 0) {
+            LOG_WARNING("The capture ends with an incomplete record.");
+        }
+        return std::nullopt;
+    }
+
+    CapturedDatagram captured;
+    framing::Reader prefixReader(prefix);
+    captured.timestamp = std::chrono::nanoseconds{prefixReader.Get<U64>()};
+    captured.direction = static_cast<CaptureDirection>(prefixReader.Get<U8>());
+    captured.streamId = prefixReader.Get<U16>();
+    const auto addressSize = prefixReader.Get<U8>();
+    if (addressSize != 4 && addressSize != 16) {
+        LOG_WARNING("The capture has a record with an address of {} bytes, it is probably corrupt.", addressSize);
+        return std::nullopt;
+    }
+
+    std::array<char, MAX_ADDRESS_SIZE + RECORD_SUFFIX_SIZE> rest{};
+    if (!file_.read(rest.data(), static_cast<std::streamsize>(addressSize + RECORD_SUFFIX_SIZE))) {
+        LOG_WARNING("The capture ends with an incomplete record.");
+        return std::nullopt;
+    }
+
+    framing::Reader restReader({rest.data(), addressSize + RECORD_SUFFIX_SIZE});
+    const auto address = restReader.Bytes(addressSize);
+    boost::asio::ip::address peerAddress;
+    if (addressSize == 4) {
+        boost::asio::ip::address_v4::bytes_type bytes{};
+        std::ranges::copy(address, reinterpret_cast<char*>(bytes.data()));
+        peerAddress = boost::asio::ip::address_v4{bytes};
+    } else {
+        boost::asio::ip::address_v6::bytes_type bytes{};
+        std::ranges::copy(address, reinterpret_cast<char*>(bytes.data()));
+        peerAddress = boost::asio::ip::address_v6{bytes};
+    }
+    const auto port = restReader.Get<U16>();
+    captured.peer = {peerAddress, port};
+
+    captured.datagram.resize(restReader.Get<U16>());
+    if (!file_.read(captured.datagram.data(), static_cast<std::streamsize>(captured.datagram.size()))) {
+        LOG_WARNING("The capture ends with an incomplete record.");
+        return std::nullopt;
+    }
+
+    return captured;
+}
+
+std::vector<CapturedDatagram> CaptureReader::ReadAll() {
+    std::vector<CapturedDatagram> datagrams;
+    while (auto datagram = Next()) {
+        datagrams.push_back(std::move(*datagram));
+    }
+    return datagrams;
+}
+
+} // namespace rft
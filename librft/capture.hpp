@@ -0,0 +1,83 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <span>
+
+#include <boost/asio.hpp>
+
+#include "messages.hpp"
+
+// Captures of the datagrams an endpoint sent and received, so that a transfer that went wrong can be looked at and replayed offline (see replay/). A
+// capture is a small file header followed by one record per datagram, all integers little-endian:
+//
+//   U64 nanoseconds since the capture started, U8 direction, U16 stream ID, U8 address size (4 or 16), the address, U16 port, U16 datagram size, the datagram
+//
+// Records are collected in memory and written out in large pieces, so capturing costs a copy and a short critical section per datagram.
+
+namespace rft {
+
+enum class CaptureDirection : U8 {
+    kInbound = 0,
+    kOutbound = 1
+};
+
+struct CapturedDatagram {
+    std::chrono::nanoseconds timestamp{0};
+    CaptureDirection direction = CaptureDirection::kInbound;
+    U16 streamId = 0;
+    // Who sent an inbound datagram, who an outbound one was sent to
+    boost::asio::ip::udp::endpoint peer;
+    std::vector<char> datagram;
+};
+
+class CaptureWriter {
+public:
+    // Throws if the file can't be created
+    explicit CaptureWriter(const std::filesystem::path& path, size_t bufferSize = 1024 * 1024);
+    ~CaptureWriter();
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    // Thread-safe
+    void Record(CaptureDirection direction, const boost::asio::ip::udp::endpoint& peer, std::span<const char> datagram);
+
+    void Flush();
+
+    U64 Records() const noexcept {
+        return records_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void FlushLocked();
+
+    const std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    const size_t bufferSize_;
+
+    std::mutex mutex_;
+    std::ofstream file_;
+    std::vector<char> buffer_;
+    std::atomic<U64> records_{0};
+};
+
+class CaptureReader {
+public:
+    // Throws if the file can't be opened or isn't a capture
+    explicit CaptureReader(const std::filesystem::path& path);
+
+    // Returns nothing at the end of the capture. A record that was cut off (because the capturing process died) ends the capture as well.
+    std::optional<CapturedDatagram> Next();
+
+    // Everything that is left
+    std::vector<CapturedDatagram> ReadAll();
+
+private:
+    std::ifstream file_;
+};
+
+} // namespace rft
@@ -0,0 +1,153 @@
+#include "pch.hpp"
+#include "chunk_cipher.hpp"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+#include "framing.hpp"
+
+namespace rft {
+
+namespace {
+
+constexpr size_t NONCE_SIZE = 12;
+constexpr size_t TAG_SIZE = sizeof(ChunkMessage::checksum);
+constexpr std::string_view KEY_LABEL = "rft chunk key v1";
+
+std::runtime_error CryptoError(std::string_view what) {
+    return std::runtime_error{std::format("{} failed.", what)};
+}
+
+// The chunk index, little-endian, in the last 8 bytes
+std::array<U8, NONCE_SIZE> MakeNonce(U64 index) noexcept {
+    std::array<U8, NONCE_SIZE> nonce{};
+    for (size_t i = 0; i < sizeof(index); ++i) {
+        nonce[NONCE_SIZE - sizeof(index) + i] = static_cast<U8>(index >> (8 * i));
+    }
+    return nonce;
+}
+
+struct PkeyContextDeleter {
+    void operator()(EVP_PKEY_CTX* context) const noexcept {
+        EVP_PKEY_CTX_free(context);
+    }
+};
+using PkeyContext = std::unique_ptr<EVP_PKEY_CTX, PkeyContextDeleter>;
+
+} // namespace
+
+void KeyExchange::KeyDeleter::operator()(evp_pkey_st* key) const noexcept {
+    EVP_PKEY_free(key);
+}
+
+KeyExchange::KeyExchange() {
+    PkeyContext context{EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr)};
+    EVP_PKEY* key = nullptr;
+    if (!context || EVP_PKEY_keygen_init(context.get()) <= 0 || EVP_PKEY_keygen(context.get(), &key) <= 0) {
+        throw CryptoError("Generating an X25519 key");
+    }
+    key_.reset(key);
+
+    std::array<U8, 32> publicKey{};
+    size_t size = publicKey.size();
+    if (EVP_PKEY_get_raw_public_key(key_.get(), publicKey.data(), &size) <= 0 || size != publicKey.size()) {
+        throw CryptoError("Exporting the X25519 public key");
+    }
+    share_.publicKey = publicKey;
+}
+
+KeyExchange::~KeyExchange() = default;
+
+ChunkKey KeyExchange::DeriveKey(const KeyShare& peer, Role role, std::string_view preSharedKey) const {
+    const std::array<U8, 32> peerKey = peer.publicKey;
+    std::unique_ptr<EVP_PKEY, KeyDeleter> peerPublic{EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peerKey.data(), peerKey.size())};
+    if (!peerPublic) {
+        throw CryptoError("Importing the peer's X25519 public key");
+    }
+
+    // Fails for the low order points, which would make the shared secret all zeros
+    std::array<U8, 32> shared{};
+    size_t sharedSize = shared.size();
+    PkeyContext exchange{EVP_PKEY_CTX_new(key_.get(), nullptr)};
+    if (!exchange || EVP_PKEY_derive_init(exchange.get()) <= 0 || EVP_PKEY_derive_set_peer(exchange.get(), peerPublic.get()) <= 0 ||
+        EVP_PKEY_derive(exchange.get(), shared.data(), &sharedSize) <= 0 || sharedSize != shared.size()) {
+        throw CryptoError("The X25519 key exchange");
+    }
+
+    // Binds the key to both shares, in the same order on both sides
+    const std::array<U8, 32> ownKey = share_.publicKey;
+    const auto& clientKey = role == Role::kClient ? ownKey : peerKey;
+    const auto& serverKey = role == Role::kClient ? peerKey : ownKey;
+    std::vector<U8> info(KEY_LABEL.begin(), KEY_LABEL.end());
+    info.insert(info.end(), clientKey.begin(), clientKey.end());
+    info.insert(info.end(), serverKey.begin(), serverKey.end());
+
+    ChunkKey key{};
+    size_t keySize = key.size();
+    PkeyContext hkdf{EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr)};
+    const bool derived = hkdf && EVP_PKEY_derive_init(hkdf.get()) > 0 && EVP_PKEY_CTX_set_hkdf_md(hkdf.get(), EVP_sha256()) > 0 &&
+                         (preSharedKey.empty() || EVP_PKEY_CTX_set1_hkdf_salt(hkdf.get(), reinterpret_cast<const unsigned char*>(preSharedKey.data()),
+                                                                              static_cast<int>(preSharedKey.size())) > 0) &&
+                         EVP_PKEY_CTX_set1_hkdf_key(hkdf.get(), shared.data(), static_cast<int>(shared.size())) > 0 &&
+                         EVP_PKEY_CTX_add1_hkdf_info(hkdf.get(), info.data(), static_cast<int>(info.size())) > 0 &&
+                         EVP_PKEY_derive(hkdf.get(), key.data(), &keySize) > 0 && keySize == key.size();
+    OPENSSL_cleanse(shared.data(), shared.size());
+    if (!derived) {
+        throw CryptoError("Deriving the chunk key");
+    }
+
+    return key;
+}
+
+void ChunkCipher::ContextDeleter::operator()(evp_cipher_ctx_st* context) const noexcept {
+    EVP_CIPHER_CTX_free(context);
+}
+
+ChunkCipher::ChunkCipher(const ChunkKey& key)
+    : seal_(EVP_CIPHER_CTX_new()),
+      open_(EVP_CIPHER_CTX_new()) {
+    // The key schedule is computed once here, every chunk only sets a new nonce
+    if (!seal_ || !open_ || EVP_EncryptInit_ex(seal_.get(), EVP_aes_256_gcm(), nullptr, key.data(), nullptr) <= 0 ||
+        EVP_DecryptInit_ex(open_.get(), EVP_aes_256_gcm(), nullptr, key.data(), nullptr) <= 0) {
+        throw CryptoError("Setting up AES-256-GCM");
+    }
+}
+
+ChunkCipher::~ChunkCipher() = default;
+
+void ChunkCipher::SealBatch(std::span<std::vector<char>> chunks, U64 firstIndex) {
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        auto payload = framing::ChunkPayload(chunks[i]);
+        auto* data = reinterpret_cast<unsigned char*>(payload.data());
+        const auto nonce = MakeNonce(firstIndex + i);
+
+        int size = 0;
+        std::array<unsigned char, 16> tag{};
+        if (EVP_EncryptInit_ex(seal_.get(), nullptr, nullptr, nullptr, nonce.data()) <= 0 ||
+            EVP_EncryptUpdate(seal_.get(), data, &size, data, static_cast<int>(payload.size())) <= 0 ||
+            EVP_EncryptFinal_ex(seal_.get(), data + size, &size) <= 0 ||
+            EVP_CIPHER_CTX_ctrl(seal_.get(), EVP_CTRL_GCM_GET_TAG, static_cast<int>(tag.size()), tag.data()) <= 0) {
+            throw CryptoError("Sealing a chunk");
+        }
+
+        std::copy_n(tag.begin(), TAG_SIZE, reinterpret_cast<unsigned char*>(framing::ChunkChecksum(chunks[i]).data()));
+    }
+}
+
+bool ChunkCipher::Open(std::span<char> chunk, U64 index) {
+    auto payload = framing::ChunkPayload(chunk);
+    auto* data = reinterpret_cast<unsigned char*>(payload.data());
+    const auto nonce = MakeNonce(index);
+
+    std::array<unsigned char, TAG_SIZE> tag{};
+    std::ranges::copy(framing::ChunkChecksum(chunk), reinterpret_cast<char*>(tag.data()));
+
+    int size = 0;
+    return EVP_DecryptInit_ex(open_.get(), nullptr, nullptr, nullptr, nonce.data()) > 0 &&
+           EVP_CIPHER_CTX_ctrl(open_.get(), EVP_CTRL_GCM_SET_TAG, static_cast<int>(tag.size()), tag.data()) > 0 &&
+           EVP_DecryptUpdate(open_.get(), data, &size, data, static_cast<int>(payload.size())) > 0 &&
+           EVP_DecryptFinal_ex(open_.get(), data + size, &size) > 0;
+}
+
+} // namespace rft
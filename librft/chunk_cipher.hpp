@@ -0,0 +1,90 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <memory>
+#include <span>
+#include <string_view>
+
+#include "messages.hpp"
+
+// Opt-in encryption of chunk payloads. The client sends an ephemeral X25519 key share in its ClientHello, the server answers with its own in the
+// ServerHello, and both derive the stream's key from the shared secret with HKDF-SHA256. The server then seals every chunk payload in place with
+// AES-256-GCM (hardware accelerated by OpenSSL wherever the CPU has AES-NI and carry-less multiplication), and the chunk's 8 byte checksum field
+// carries the GCM tag, truncated to 64 bits as NIST SP 800-38D allows for messages this short. The nonce is the chunk's index in the file, so a chunk
+// that is replayed or moved to another position doesn't open either.
+//
+// Without a pre-shared key the exchange isn't authenticated: it keeps passive eavesdroppers out, but not someone who can rewrite the hellos. Servers and
+// clients that share a key mix it into the derivation, which a man in the middle can't. Only the payloads are encrypted, the file name in the ClientHello
+// and the digest of the file are not.
+
+struct evp_pkey_st;
+struct evp_cipher_ctx_st;
+
+namespace rft {
+
+using ChunkKey = std::array<U8, 32>;
+
+// One side of the key exchange, good for one stream
+class KeyExchange {
+public:
+    enum class Role {
+        kClient,
+        kServer
+    };
+
+    KeyExchange();
+    ~KeyExchange();
+
+    KeyExchange(const KeyExchange&) = delete;
+    KeyExchange& operator=(const KeyExchange&) = delete;
+
+    const KeyShare& Share() const noexcept {
+        return share_;
+    }
+
+    // Throws if the peer's share is not a valid public key
+    ChunkKey DeriveKey(const KeyShare& peer, Role role, std::string_view preSharedKey = {}) const;
+
+private:
+    struct KeyDeleter {
+        void operator()(evp_pkey_st* key) const noexcept;
+    };
+
+    std::unique_ptr<evp_pkey_st, KeyDeleter> key_;
+    KeyShare share_{};
+};
+
+// What a server stream needs to encrypt its chunks
+struct StreamEncryption {
+    // Goes back to the client in the ServerHello
+    KeyShare share;
+    ChunkKey key;
+};
+
+// Seals and opens the payloads of serialized chunks, in place. Every direction of a stream has its own instance, they are not thread-safe.
+class ChunkCipher {
+public:
+    explicit ChunkCipher(const ChunkKey& key);
+    ~ChunkCipher();
+
+    ChunkCipher(const ChunkCipher&) = delete;
+    ChunkCipher& operator=(const ChunkCipher&) = delete;
+
+    // chunks[i] is the chunk with the index firstIndex + i. The key schedule and the GHASH tables are set up once for all of them, only the nonce changes
+    // from chunk to chunk.
+    void SealBatch(std::span<std::vector<char>> chunks, U64 firstIndex);
+
+    // Returns false (and leaves the payload in an undefined state) if the chunk isn't the one with this index or was tampered with
+    bool Open(std::span<char> chunk, U64 index);
+
+private:
+    struct ContextDeleter {
+        void operator()(evp_cipher_ctx_st* context) const noexcept;
+    };
+
+    std::unique_ptr<evp_cipher_ctx_st, ContextDeleter> seal_;
+    std::unique_ptr<evp_cipher_ctx_st, ContextDeleter> open_;
+};
+
+} // namespace rft
@@ -5,50 +5,87 @@ namespace ip = boost::asio::ip;
 
 namespace rft {
 
-Client::Client(boost::asio::any_io_executor executor)
+Client::Client(boost::asio::any_io_executor executor, boost::asio::ip::udp::endpoint server, std::filesystem::path downloadDirectory, AckFrequency ackFrequency,
+               bool encrypt, std::string preSharedKey)
     : socket_(executor, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0)),
-      executor_(executor) {
+      executor_(executor),
+      server_(std::move(server)),
+      downloadDirectory_(std::move(downloadDirectory)),
+      ackFrequency_(ackFrequency),
+      encrypt_(encrypt),
+      preSharedKey_(std::move(preSharedKey)) {
 
 }
 
+boost::asio::ip::udp::endpoint Client::DefaultServerEndpoint() {
+    return {ip::make_address("127.0.0.2"), 5051};
+}
+
+std::filesystem::path Client::DefaultDownloadDirectory() {
+    const auto* userProfile = getenv("USERPROFILE");
+    return std::filesystem::path{userProfile != nullptr ? userProfile : "."} / "Desktop";
+}
+
+void Client::StartCapture(const std::filesystem::path& path) {
+    capture_ = std::make_unique<CaptureWriter>(path);
+    LOG_INFO("Capturing all datagrams to {}.", path.string());
+}
+
 boost::asio::awaitable<void> Client::Run(std::string fileName) {
     using namespace boost::asio::experimental::awaitable_operators;
 
-    CongestionControl::output_channel outputChannel(executor_);
-
-    ClientStream<RenolikeCongestionControl> clientStream(executor_,  outputChannel);
+    CongestionControl::output_queue outputQueue;
 
-    auto sender = [&outputChannel, this]() -> boost::asio::awaitable<void> {
-        while (outputChannel.is_open()) {
-            try {
-                const auto message = co_await outputChannel.async_receive(boost::asio::use_awaitable);
+    auto streamMetrics = metrics_.RegisterStream(0, "client");
+    ClientStream<RenolikeCongestionControl> clientStream(executor_,  outputQueue, downloadDirectory_, streamMetrics, ackFrequency_, encrypt_, preSharedKey_);
+    metrics_.Endpoint().streamsOpened.Add();
+    metrics_.Endpoint().activeStreams.Add();
 
-                const auto size = co_await socket_.async_send_to(boost::asio::buffer(message), ip::udp::endpoint(ip::address::from_string("127.0.0.2"), 5051),
-                                                                 boost::asio::use_awaitable);
-                LOG_TRACE("Sent {} bytes.", size);
+    auto sender = [&outputQueue, &streamMetrics, this]() -> boost::asio::awaitable<void> {
+        constexpr size_t BATCH_SIZE = 32;
+        std::vector<std::vector<char>> batch;
+        batch.reserve(BATCH_SIZE);
 
-                if (size != message.size()) {
-                    LOG_ERROR("Fewer bytes than the message size were sent out. Expected size: {}, actual size: {}.", message.size(), size);
-                    co_return;
+        try {
+            for (;;) {
+                // The ring records how long each datagram waited in it
+                if (co_await outputQueue.PopBatch(batch, BATCH_SIZE) == 0) {
+                    LOG_INFO("The output queue was closed, cleaning up...");
+                    break;
                 }
-            } catch (const boost::system::system_error& e) {
-                if (e.code() == boost::asio::experimental::error::channel_closed) {
-                    LOG_INFO("co_awaited a closed channel, cleaning up...");
-                } else {
-                    LOG_ERROR("We encountered an error while trying to send using the output channel: {}", e.what());
+
+                for (const auto& message : batch) {
+                    size_t size = 0;
+                    {
+                        RFT_TRACE_STAGE(kSocketSend, streamMetrics->streamId.load(std::memory_order_relaxed));
+                        size = co_await socket_.async_send_to(boost::asio::buffer(message), server_, boost::asio::use_awaitable);
+                    }
+                    LOG_TRACE("Sent {} bytes.", size);
+                    if (capture_) {
+                        capture_->Record(CaptureDirection::kOutbound, server_, message);
+                    }
+
+                    streamMetrics->datagramsSent.Add();
+                    streamMetrics->bytesSent.Add(size);
+                    metrics_.Endpoint().datagramsSent.Add();
+                    metrics_.Endpoint().bytesSent.Add(size);
+
+                    if (size != message.size()) {
+                        throw std::runtime_error{std::format("Fewer bytes than the message size were sent out. Expected size: {}, actual size: {}.",
+                                                             message.size(), size)};
+                    }
                 }
 
-                break;
-            } catch (const std::exception& e) {
-                LOG_ERROR("We encountered an error while trying to send using the output channel: {}", e.what());
-                break;
+                batch.clear();
             }
+        } catch (const std::exception& e) {
+            LOG_ERROR("We encountered an error while trying to send using the output queue: {}", e.what());
+            // Nobody drains the queue anymore, so the stream must not wait for room in it
+            outputQueue.Close();
         }
-
-        co_return;
     };
 
-    auto receiver = [&clientStream, this]() -> boost::asio::awaitable<void> {
+    auto receiver = [&clientStream, &streamMetrics, this]() -> boost::asio::awaitable<void> {
         try {
             for(;;) {
                 std::vector<char> data(MAX_LENGTH);
@@ -57,9 +94,22 @@ boost::asio::awaitable<void> Client::Run(std::string fileName) {
 
                 auto size = co_await socket_.async_receive_from(boost::asio::buffer(data), endpoint, boost::asio::use_awaitable);
                 data.resize(size);
+                if (capture_) {
+                    capture_->Record(CaptureDirection::kInbound, endpoint, data);
+                }
 
                 LOG_TRACE("Received {} ({}) bytes from {}.", size, data.size(), endpoint.address().to_string());
 
+                streamMetrics->datagramsReceived.Add();
+                streamMetrics->bytesReceived.Add(size);
+                metrics_.Endpoint().datagramsReceived.Add();
+                metrics_.Endpoint().bytesReceived.Add(size);
+
+                if (const auto retry = framing::Parse<HelloRetry>(data)) {
+                    co_await clientStream.AnswerHelloRetry(*retry);
+                    continue;
+                }
+
                 clientStream.PushMessage(std::move(data));
             }
         } catch (const std::exception& e) {
@@ -67,8 +117,45 @@ boost::asio::awaitable<void> Client::Run(std::string fileName) {
         }
     };
 
-    // If one of the coroutines end, the others are cancelled as well
-    co_await (receiver() || sender() || clientStream.Run(fileName));
+    // Sends the ACKs the stream held back for too long
+    auto delayedAcks = [&clientStream, this]() -> boost::asio::awaitable<void> {
+        using namespace std::chrono_literals;
+
+        boost::asio::steady_timer timer(executor_);
+        for (;;) {
+            // Until the ServerHello arrived, every datagram is ACKed right away, so there is nothing to flush yet
+            const auto delay = clientStream.AckDelay();
+            timer.expires_after(delay.count() > 0 ? std::chrono::steady_clock::duration{delay} : std::chrono::steady_clock::duration{10ms});
+            co_await timer.async_wait(boost::asio::use_awaitable);
+            clientStream.FlushAck();
+        }
+    };
+
+    // Waiting for room in the output queue can't be cancelled, so the sender runs until the queue is closed, which happens once the stream is done
+    auto run = [&clientStream, &outputQueue, &fileName]() -> boost::asio::awaitable<void> {
+        try {
+            co_await clientStream.Run(fileName);
+        } catch (...) {
+            outputQueue.Close();
+            throw;
+        }
+
+        // The ACK for the last chunks might still be held back
+        clientStream.FlushAck();
+        outputQueue.Close();
+    };
+
+    // If the receiver or the stream end, the others are cancelled as well
+    co_await ((receiver() || delayedAcks() || run()) && sender());
+
+    metrics_.Endpoint().handshakesCompleted.Add(streamMetrics->handshakeMicroseconds.Load() > 0 ? 1 : 0);
+    metrics_.Endpoint().handshakeMicroseconds.Add(streamMetrics->handshakeMicroseconds.Load());
+    metrics_.Endpoint().streamsClosed.Add();
+    metrics_.Endpoint().activeStreams.Sub();
+
+    if (capture_) {
+        capture_->Flush();
+    }
 
     LOG_INFO("Exiting Client::Run()");
     co_return;
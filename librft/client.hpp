@@ -1,7 +1,6 @@
 #pragma once
 
 #include <boost/asio.hpp>
-#include <boost/asio/experimental/channel.hpp>
 #include <boost/asio/experimental/awaitable_operators.hpp>
 #include <boost/circular_buffer.hpp>
 #include <boost/algorithm/string.hpp>
@@ -11,8 +10,13 @@
 #include <hash-library/sha256.h>
 
 #include "logger.hpp"
+#include "capture.hpp"
 #include "messages.hpp"
+#include "framing.hpp"
+#include "chunk_cipher.hpp"
 #include "congestion_control.hpp"
+#include "digest.hpp"
+#include "metrics.hpp"
 
 namespace rft {
 
@@ -25,16 +29,43 @@ class Client {
     friend class ClientStream;
 
 public:
-    explicit Client(boost::asio::any_io_executor executor);
+    explicit Client(boost::asio::any_io_executor executor,
+                    boost::asio::ip::udp::endpoint server = DefaultServerEndpoint(),
+                    std::filesystem::path downloadDirectory = DefaultDownloadDirectory(),
+                    AckFrequency ackFrequency = DEFAULT_ACK_FREQUENCY,
+                    bool encrypt = false,
+                    std::string preSharedKey = {});
+
+    // 127.0.0.2:5051
+    static boost::asio::ip::udp::endpoint DefaultServerEndpoint();
+
+    // %USERPROFILE%\Desktop
+    static std::filesystem::path DefaultDownloadDirectory();
 
     boost::asio::awaitable<void> Run(std::string filePath);
 
+    // Writes every datagram the client receives and sends to a capture file. Has to be called before Run().
+    void StartCapture(const std::filesystem::path& path);
+
+    metrics::MetricsRegistry& Metrics() noexcept {
+        return metrics_;
+    }
+
 private:
     //TODO: This should be moved out of class scope!
-    constexpr static auto MAX_LENGTH = 1024 - 8;
+    constexpr static auto MAX_LENGTH = MAX_DATAGRAM_SIZE;
 
     boost::asio::ip::udp::socket socket_;
     boost::asio::any_io_executor executor_;
+    boost::asio::ip::udp::endpoint server_;
+    std::filesystem::path downloadDirectory_;
+    // What we propose to the server
+    AckFrequency ackFrequency_;
+    bool encrypt_;
+    std::string preSharedKey_;
+    std::unique_ptr<CaptureWriter> capture_;
+
+    metrics::MetricsRegistry metrics_{"client"};
 };
 
 
@@ -43,9 +74,21 @@ class ClientStream : private CongestionControlMixin {
 public:
     ClientStream(
         boost::asio::any_io_executor executor,
-        CongestionControl::output_channel& outputChannel)
-        : CongestionControlMixin(outputChannel),
-          executor_(executor) {
+        CongestionControl::output_queue& outputQueue,
+        std::filesystem::path downloadDirectory,
+        std::shared_ptr<metrics::StreamMetrics> streamMetrics,
+        AckFrequency ackFrequency = DEFAULT_ACK_FREQUENCY,
+        bool encrypt = false,
+        std::string preSharedKey = {})
+        : CongestionControlMixin(outputQueue),
+          ackFrequency_(ackFrequency),
+          preSharedKey_(std::move(preSharedKey)),
+          executor_(executor),
+          downloadDirectory_(std::move(downloadDirectory)) {
+        CongestionControlMixin::AttachMetrics(std::move(streamMetrics));
+        if (encrypt) {
+            keyExchange_ = std::make_unique<KeyExchange>();
+        }
     }
 
     ~ClientStream() {
@@ -54,87 +97,186 @@ public:
 
     boost::asio::awaitable<void> SendClientHello(std::string fileName) {
         LOG_INFO("Sending client hello...");
-        auto* clientHello = new ClientHello{0, MessageType::kClientHello, 0, 0x1, 0, 0, 10, 0, ""};
-        strcpy(clientHello->fileName, &fileName[0]);
+        hello_ = ClientHello{0, MessageType::kClientHello, 0, 0x1, 0, 0, 10, 0, ""};
+        // Leave room for the cookie, in case the server wants one, for our ACK frequency and for our key share. Zero ranges are only a flag.
+        constexpr auto NEXT_HEADER_SIZE = sizeof(Cookie) + sizeof(AckFrequency) + sizeof(KeyShare);
+        if (fileName.size() + NEXT_HEADER_SIZE >= sizeof(hello_.fileName)) {
+            throw std::invalid_argument{std::format("The file name {} is longer than {} bytes.", fileName, sizeof(hello_.fileName) - NEXT_HEADER_SIZE - 1)};
+        }
+        std::ranges::copy(fileName, hello_.fileName);
 
-        std::vector<char> buffer(sizeof(ClientHello));
+        co_await SendUnsequenced(framing::Serialize(hello_, std::nullopt, ackFrequency_, KeyShareToSend(), true));
+    }
 
-        //new (buffer.data()) ClientHello{0, MessageType::kClientHello, 0, 0x1, 0, 0, 10, 0, ""};
+    std::optional<KeyShare> KeyShareToSend() const {
+        return keyExchange_ ? std::optional{keyExchange_->Share()} : std::nullopt;
+    }
 
-        new (buffer.data()) ClientHello{*clientHello};
+    // The server wants us to prove that we can receive before it sets up the stream. The server doesn't keep any state for hellos, so neither the HelloRetry
+    // nor our answer take sequence numbers of the stream.
+    boost::asio::awaitable<void> AnswerHelloRetry(const HelloRetry& retry) {
+        if (id_ != 0 || helloRetries_ >= MAX_HELLO_RETRIES) {
+            LOG_WARNING("Ignoring an unexpected hello retry.");
+            co_return;
+        }
 
-        co_await Send(std::move(buffer));
+        ++helloRetries_;
+        LOG_INFO("Server asked for a cookie, sending client hello again...");
+        co_await SendUnsequenced(framing::Serialize(hello_, retry.cookie, ackFrequency_, KeyShareToSend(), true));
     }
 
     boost::asio::awaitable<size_t> ExpectServerHello() {
         using namespace std::chrono_literals;
-        using namespace boost::asio::experimental::awaitable_operators;
-
-        boost::asio::steady_timer t(executor_);
-        t.expires_after(5s);
-        const auto result = co_await (Receive() || t.async_wait(boost::asio::use_awaitable));
 
-        if (result.index() == 1) {
+        const auto result = co_await Receive(5s);
+        if (!result) {
             LOG_INFO("5 seconds expired and we got no ServerHello. Destroying stream.");
             throw std::runtime_error{"5 seconds expired and we got no ServerHello. Destroying stream."};
         }
 
-        if (const auto* message = reinterpret_cast<const MessageBase*>(std::get<0>(result).data()); message->messageType != MessageType::kServerHello) {
+        const auto& buffer = *result;
+        if (const auto error = framing::ParseError(buffer)) {
+            throw std::runtime_error{std::format("The server turned the request down: {}", error->message)};
+        }
+
+        const auto serverHello = framing::Parse<ServerHello>(buffer);
+        if (!serverHello) {
             LOG_ERROR("Got an unexpected message or an error. Terminating stream.");
             throw std::runtime_error{"Got an unexpected message or an error. Terminating stream."};
         }
 
-        const auto* serverHello = reinterpret_cast<const ServerHello*>(std::get<0>(result).data());
-        if (serverHello->nextHeaderOffset != 0 || serverHello->nextHeaderType != 0) {
-            LOG_ERROR("Server is trying to use the nextHeader feature.");
-            throw std::runtime_error{"Server is trying to use the nextHeader feature."};
+        // Servers that don't answer with an ACK frequency expect an ACK for every datagram
+        if (const auto ackFrequency = framing::ParseAckFrequency(buffer)) {
+            CongestionControlMixin::SetAckFrequency(*ackFrequency);
+        }
+
+        // We don't fall back to clear text if we asked for encryption
+        if (keyExchange_) {
+            const auto serverKeyShare = framing::ParseKeyShare(buffer);
+            if (!serverKeyShare) {
+                throw std::runtime_error{"We asked for encryption, but the server doesn't encrypt."};
+            }
+            cipher_ = std::make_unique<ChunkCipher>(keyExchange_->DeriveKey(*serverKeyShare, KeyExchange::Role::kClient, preSharedKey_));
+            LOG_INFO("Chunks are encrypted.");
+        }
+
+        zeroRanges_ = framing::HasZeroRanges(buffer);
+
+        // All zeros means that the server sends the digest with its FinMessage
+        const Digest checksum = serverHello->checksum;
+        if (checksum != Digest{}) {
+            expectedDigest_ = checksum;
         }
 
         id_ = serverHello->streamId;
         CongestionControlMixin::SetStreamId(id_);
+        Metrics().streamId.store(id_, std::memory_order_relaxed);
         co_return serverHello->fileSizeInBytes;
     }
 
+    // Compares what we received with the digest from the ServerHello or, if the server hashed the file on the way, from its FinMessage
+    boost::asio::awaitable<void> VerifyDigest(const Digest& received) {
+        using namespace std::chrono_literals;
+
+        if (!expectedDigest_) {
+            const auto result = co_await Receive(5s);
+            if (!result) {
+                throw std::runtime_error{"5 seconds expired and we got no FinMessage."};
+            }
+
+            const auto fin = framing::Parse<FinMessage>(*result);
+            if (!fin) {
+                throw std::runtime_error{"Expected a FinMessage, but got something else."};
+            }
+
+            const Digest checksum = fin->checksum;
+            if (checksum == Digest{}) {
+                LOG_WARNING("Stream {}: The server didn't send a digest, the file can't be verified.", id_);
+                co_return;
+            }
+            expectedDigest_ = checksum;
+        }
+
+        if (received != *expectedDigest_) {
+            throw std::runtime_error{std::format("The file is corrupt, its digest is {}, but the server's is {}.", ToHex(received), ToHex(*expectedDigest_))};
+        }
+
+        LOG_INFO("Stream {}: Verified the digest {}.", id_, ToHex(received));
+    }
+
     boost::asio::awaitable<void> Run(std::string fileName) {
         try {
+            const auto handshakeStart = std::chrono::steady_clock::now();
             co_await SendClientHello(fileName);
             auto fileSize = co_await ExpectServerHello();
+            Metrics().handshakeMicroseconds.Set(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - handshakeStart).count());
 
-            std::string savePath = getenv("USERPROFILE");
-            savePath += "\\Desktop\\";
-            savePath += fileName;
-            boost::asio::basic_stream_file<> file(executor_, &savePath[0],
+            const auto savePath = (downloadDirectory_ / fileName).string();
+            boost::asio::basic_stream_file<> file(executor_, savePath,
                                                   boost::asio::file_base::create | boost::asio::file_base::write_only | boost::asio::file_base::truncate);
 
             constexpr auto MAX_PAYLOAD_SIZE = sizeof(ChunkMessage::payload);
 
-            const auto numChunks = static_cast<size_t>(std::ceil(fileSize / static_cast<float>(MAX_PAYLOAD_SIZE)));
+            const size_t numChunks = (fileSize + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
 
             LOG_INFO("Filesize is {}. That makes {} chunks. The last chunk has {} bytes.", fileSize, numChunks, fileSize % MAX_PAYLOAD_SIZE);
 
-            for (int i = 0; i < numChunks; ++i) {
-
-                auto messageBuffer = co_await Receive();
-                //auto* message = reinterpret_cast<MessageBase*>(messageBuffer.get());
-
-                //auto messageBuffer = co_await Receive();
-                auto* message = reinterpret_cast<MessageBase*>(messageBuffer.data());
-
-                //TODO: Check if message is chunk
-                auto* chunk = reinterpret_cast<ChunkMessage*>(message);
-
-                const size_t payloadSize = (i != numChunks) ? MAX_PAYLOAD_SIZE : fileSize % MAX_PAYLOAD_SIZE; //TODO: The last expression can be 0, which is incorrect
-                std::span payload{chunk->payload.data(), payloadSize};
+            DigestBuilder digest;
+
+            for (size_t i = 0; i < numChunks;) {
+                auto received = co_await Receive(RECEIVE_TIMEOUT);
+                if (!received) {
+                    throw std::runtime_error{std::format("The server was quiet for {}s, {} of {} chunks are missing.", RECEIVE_TIMEOUT.count(), numChunks - i,
+                                                         numChunks)};
+                }
+                auto& messageBuffer = *received;
+
+                // Zero ranges aren't written, moving the file position past them leaves a hole (on file systems that support sparse files)
+                if (const auto zeros = framing::Parse<ZeroRangeMessage>(messageBuffer)) {
+                    if (!zeroRanges_ || zeros->firstChunk != i || zeros->chunkCount == 0 || zeros->chunkCount > numChunks - i) {
+                        throw std::runtime_error{std::format("Expected chunk {}, but got a zero range of {} chunks at {}.", i, U64{zeros->chunkCount},
+                                                             U64{zeros->firstChunk})};
+                    }
+
+                    const U64 size = std::min<U64>(zeros->chunkCount * MAX_PAYLOAD_SIZE, fileSize - i * MAX_PAYLOAD_SIZE);
+                    digest.AddZeros(size);
+                    file.seek(static_cast<I64>(size), boost::asio::file_base::seek_cur);
+                    Metrics().zeroChunksReceived.Add(zeros->chunkCount);
+                    LOG_TRACE("Chunks {} to {}: Skipped {} zero bytes.", i, i + zeros->chunkCount - 1, size);
+                    i += zeros->chunkCount;
+                    continue;
+                }
+
+                const auto chunk = framing::ParseChunk(messageBuffer);
+                if (!chunk) {
+                    throw std::runtime_error{std::format("Expected chunk {}, but got something else.", i)};
+                }
+
+                const size_t payloadSize = std::min<size_t>(MAX_PAYLOAD_SIZE, fileSize - i * MAX_PAYLOAD_SIZE);
+                if (chunk->payload.size() != payloadSize) {
+                    throw std::runtime_error{std::format("Chunk {} has {} bytes, but we expected {} bytes.", i, chunk->payload.size(), payloadSize)};
+                }
+
+                // Decrypts the payload in place, so the chunk view sees the plain text afterwards
+                if (cipher_ && !cipher_->Open(messageBuffer, i)) {
+                    throw std::runtime_error{std::format("Chunk {} failed authentication. Either it was tampered with or the pre-shared keys don't match.", i)};
+                }
 
                 // At this point we normally would have to verify the chunk message with it's sha-3 checksum. For whatever reason, the spec doesn't actually require
                 // doing this, and since it would make our state handling extremely messing (since we basically need to tell our lower layer that the message is invalid)
                 // we exploit this and just don't verify the chunk message here.
 
-                co_await boost::asio::async_write(file, boost::asio::buffer(payload), boost::asio::use_awaitable);
-                LOG_INFO("Chunk {}: Wrote {} bytes to file.", i, payloadSize);
+                digest.Add(chunk->payload);
+                co_await boost::asio::async_write(file, boost::asio::buffer(chunk->payload.data(), payloadSize), boost::asio::use_awaitable);
+                Metrics().chunksReceived.Add();
+                LOG_TRACE("Chunk {}: Wrote {} bytes to file.", i, payloadSize);
+                ++i;
             }
 
+            // A zero range at the end only moved the file position, the file isn't that long yet
+            file.resize(fileSize);
             file.sync_all();
+            co_await VerifyDigest(digest.Finish());
         } catch (const std::exception& e) {
             LOG_ERROR("Stream {}: There was an exception {}.", id_, e.what());
         }
@@ -144,15 +286,32 @@ public:
     }
 
     using CongestionControlMixin::PushMessage;
+    using CongestionControlMixin::Metrics;
+    using CongestionControlMixin::AckDelay;
+    using CongestionControlMixin::FlushAck;
 
 private:
-    using CongestionControlMixin::Send;
+    using CongestionControlMixin::SendUnsequenced;
     using CongestionControlMixin::Receive;
 
     //static constexpr const size_t MAX_BUFFER_SIZE = 15;
+    static constexpr const unsigned MAX_HELLO_RETRIES = 3;
+    // The server sends at least a ZeroRangeMessage this often while a stream runs, and gives up on quiet clients after as long
+    static constexpr const std::chrono::seconds RECEIVE_TIMEOUT{15};
 
     decltype(MessageBase::streamId) id_ = 0;
+    ClientHello hello_{};
+    unsigned helloRetries_ = 0;
+    const AckFrequency ackFrequency_;
+    std::optional<Digest> expectedDigest_;
+    // Whether the server sends ZeroRangeMessages, we always offer them
+    bool zeroRanges_ = false;
+    // Only set if we ask for encryption
+    std::unique_ptr<KeyExchange> keyExchange_;
+    std::string preSharedKey_;
+    std::unique_ptr<ChunkCipher> cipher_;
     boost::asio::any_io_executor executor_;
+    std::filesystem::path downloadDirectory_;
 };
 
 }
@@ -1,42 +1,63 @@
 #pragma once
 
 #include <boost/circular_buffer.hpp>
+#include <mutex>
 #include <unordered_map>
 
+#include "ack_policy.hpp"
+#include "framing.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+#include "transmit_ring.hpp"
+#include "wait_queue.hpp"
 
 namespace rft {
 
 namespace CongestionControl {
 
 //using input_channel = boost::asio::experimental::channel<void(boost::system::error_code, std::unique_ptr<char[]>)>;
-using output_channel = boost::asio::experimental::channel<void(boost::system::error_code, std::vector<char>)>;
+using output_queue = TransmitRing;
 
 }
 
 template <typename T>
-concept congestion_control_algorithm = requires(T algorithm) {
-    true;
-} && std::constructible_from<T, CongestionControl::output_channel&>;
+concept congestion_control_algorithm = requires(T algorithm, std::shared_ptr<metrics::StreamMetrics> metrics) {
+    algorithm.AttachMetrics(metrics);
+    { algorithm.TryReceive() } -> std::same_as<std::optional<std::vector<char>>>;
+    { algorithm.Metrics() } -> std::same_as<metrics::StreamMetrics&>;
+    algorithm.SetAckFrequency(AckFrequency{});
+    { algorithm.AckDelay() } -> std::same_as<std::chrono::microseconds>;
+    { algorithm.FlushAck() } -> std::same_as<bool>;
+} && std::constructible_from<T, CongestionControl::output_queue&>;
 
 class RenolikeCongestionControl {
 public:
-    RenolikeCongestionControl(CongestionControl::output_channel& output) noexcept
+    RenolikeCongestionControl(CongestionControl::output_queue& output) noexcept
         : output_(output) {
     }
 
     ~RenolikeCongestionControl() {
-        output_.close();
+        output_.Close();
     }
 
     boost::asio::awaitable<void> Send(std::vector<char>&& message) {
-        auto* messageBase = reinterpret_cast<MessageBase*>(message.data());
-        messageBase->sequenceNumber = lastSentSequenceNumber;
-        messageBase->streamId = streamId_;
+        {
+            std::scoped_lock lock(mutex_);
+            framing::PatchHeader(message, streamId_, lastSentSequenceNumber);
 
-        lastSentSequenceNumber += message.size();
+            lastSentSequenceNumber += message.size();
+            ackLatency_.OnSend(lastSentSequenceNumber);
+        }
+
+        RFT_TRACE_STAGE(kCongestionControlEnqueue, streamId_);
+        co_await output_.Push(std::move(message));
+    }
 
-        co_await output_.async_send(boost::system::error_code(), message, boost::asio::use_awaitable);
+    // For messages that don't belong to the stream yet, like ClientHellos. They keep the header they were serialized with and take no sequence numbers, so
+    // the first message of the stream proper is still 0 and the other side's ACK number doesn't have to account for them.
+    boost::asio::awaitable<void> SendUnsequenced(std::vector<char>&& message) {
+        co_await output_.Push(std::move(message));
     }
 
     void SetStreamId(U16 streamId) {
@@ -44,73 +65,154 @@ public:
         streamId_ = streamId;
     }
 
+    void AttachMetrics(std::shared_ptr<metrics::StreamMetrics> metrics) {
+        metrics_ = std::move(metrics);
+        metrics_->congestionWindow.Set(static_cast<I64>(congestionWindow_));
+        metrics_->slowStartThreshold.Set(static_cast<I64>(slowStartThreshold));
+    }
+
+    metrics::StreamMetrics& Metrics() noexcept {
+        return *metrics_;
+    }
+
+    // Applies to the data we receive from now on. If ACKs may be delayed, FlushAck() has to be called at least every AckDelay().
+    void SetAckFrequency(const AckFrequency& frequency) {
+        std::scoped_lock lock(mutex_);
+        LOG_INFO("Stream {}: ACKing every {} datagrams, at most {}us late.", streamId_, frequency.ackEvery, frequency.maxDelayMicroseconds);
+        ackPolicy_.SetFrequency(frequency);
+    }
+
+    std::chrono::microseconds AckDelay() {
+        std::scoped_lock lock(mutex_);
+        return ackPolicy_.MaxDelay();
+    }
+
+    // Sends the pending ACK, if there is one. Returns true if there was.
+    bool FlushAck() {
+        std::scoped_lock lock(mutex_);
+        if (!ackPolicy_.HasPending()) {
+            return false;
+        }
+
+        SendAck();
+        metrics_->delayedAcksFlushed.Add();
+        return true;
+    }
+
     void PushMessage(std::vector<char> messageBuffer) {
-        const auto* const message = reinterpret_cast<MessageBase*>(messageBuffer.data());
+        const auto message = framing::ParseHeader(messageBuffer);
+        if (!message) {
+            LOG_WARNING("Dropping a malformed message of {} bytes.", messageBuffer.size());
+            return;
+        }
+
+        std::scoped_lock lock(mutex_);
 
         if (message->sequenceNumber != ackNumber_) {
+            metrics_->outOfOrderReceived.Add();
             LOG_WARNING("We received a message with sequence number {}, however we expected sequence number {}. Dropping the message and sending duplicate ACK.",
                         message->sequenceNumber, ackNumber_);
 
-            std::vector<char> ackBuffer(sizeof(AckMessage));
-            auto* ack = new(ackBuffer.data()) AckMessage{
-                streamId_,
-                MessageType::kAck,
-                lastSentSequenceNumber,
-                static_cast<U16>(receivedMessages_.capacity()),
-                ackNumber_
-            };
-
-            output_.try_send(boost::system::error_code(), std::move(ackBuffer));
-
-            lastSentSequenceNumber += sizeof(AckMessage);
+            ackPolicy_.OnOutOfOrder();
+            SendAck();
+            metrics_->duplicateAcksSent.Add();
             return;
         }
 
         if (message->messageType == MessageType::kAck) {
             LOG_TRACE("Acknowledged sequence number {}.", message->sequenceNumber);
+            metrics_->acksReceived.Add();
+            if (const auto ack = framing::Parse<AckMessage>(messageBuffer)) {
+                ackLatency_.OnAck(streamId_, ack->ackNumber);
+            }
             ackNumber_ += messageBuffer.size();
             return;
         }
 
         if (receivedMessages_.full()) {
             LOG_WARNING("Dropping a received message, since the buffer is full!");
+            metrics_->receiveBufferDrops.Add();
             return;
         }
 
-        //receivedMessages_.push_back()
         ackNumber_ += messageBuffer.size();
+        receivedMessages_.push_back(std::move(messageBuffer));
+        received_.NotifyAll();
 
-        std::vector<char> ackBuffer(sizeof(AckMessage));
-        auto* ack = new(ackBuffer.data()) AckMessage{
-            streamId_,
-            MessageType::kAck,
-            lastSentSequenceNumber,
-            static_cast<U16>(receivedMessages_.capacity()),
-            ackNumber_
-        };
+        // Only file data is worth delaying the ACK for, everything else ends or changes the stream
+        if (ackPolicy_.OnInOrder() || (message->messageType != MessageType::kChunk && message->messageType != MessageType::kZeroRange)) {
+            SendAck();
+        }
+    }
+
+    // Parks until PushMessage() delivers something, without holding on to a thread
+    boost::asio::awaitable<std::vector<char>> Receive() {
+        for (;;) {
+            if (auto message = TryReceive()) {
+                co_return std::move(*message);
+            }
 
-        output_.try_send(boost::system::error_code(), std::move(ackBuffer));
+            co_await received_.Wait(mutex_, [this] { return !receivedMessages_.empty(); });
+        }
+    }
 
-        lastSentSequenceNumber += sizeof(AckMessage);
+    // Like Receive(), but gives up after timeout. Use this instead of racing Receive() against a timer, a parked Receive() doesn't notice cancellation.
+    boost::asio::awaitable<std::optional<std::vector<char>>> Receive(std::chrono::steady_clock::duration timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (;;) {
+            if (auto message = TryReceive()) {
+                co_return message;
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                co_return std::nullopt;
+            }
+            co_await received_.WaitFor(mutex_, [this] { return !receivedMessages_.empty(); }, deadline - now);
+        }
     }
 
-    boost::asio::awaitable<std::vector<char>> Receive() {
-        while (receivedMessages_.empty()) {
-            // Yes, busy waiting is bad. Sue me. 
-            std::this_thread::yield();
+    // PushMessage() may run on another thread at the same time, so the receive buffer is only touched under the lock
+    std::optional<std::vector<char>> TryReceive() {
+        std::scoped_lock lock(mutex_);
+        if (receivedMessages_.empty()) {
+            return std::nullopt;
         }
 
-        auto&& message = receivedMessages_.front();
+        auto message = std::move(receivedMessages_.front());
         receivedMessages_.pop_front();
-
-        co_return message;
+        return message;
     }
 
 private:
+    // Called with mutex_ held
+    void SendAck() {
+        auto ackBuffer = framing::Serialize(AckMessage{
+            streamId_,
+            MessageType::kAck,
+            lastSentSequenceNumber,
+            static_cast<U16>(receivedMessages_.capacity()),
+            ackNumber_
+        });
+        lastSentSequenceNumber += ackBuffer.size();
+
+        // ACKs never wait behind data and are never dropped
+        output_.PushUrgent(std::move(ackBuffer));
+        metrics_->acksSent.Add();
+
+        if (const auto covered = ackPolicy_.OnAckSent(); covered > 1) {
+            metrics_->acksCoalesced.Add(covered - 1);
+        }
+    }
+
     using sequence_number = decltype(AckMessage::ackNumber);
 
     decltype(MessageBase::streamId) streamId_ = 0;
-    CongestionControl::output_channel& output_;
+    CongestionControl::output_queue& output_;
+
+    // The receiving side and the sending side (and the ACK timer) may run on different threads, and both write sequence numbers
+    std::mutex mutex_;
+    AckPolicy ackPolicy_;
 
     enum class State {
         kSlowStart,
@@ -132,6 +234,12 @@ private:
     constexpr static size_t RECEIVE_WINDOW = 64;
 
     boost::circular_buffer<std::vector<char>> receivedMessages_{RECEIVE_WINDOW};
+    // Receive() parks here until PushMessage() adds to receivedMessages_
+    WaitQueue received_;
+
+    // Streams that don't care about metrics still get a private instance, so that we never have to check for null on the hot path
+    std::shared_ptr<metrics::StreamMetrics> metrics_ = std::make_shared<metrics::StreamMetrics>();
+    tracing::AckLatencyTracker ackLatency_;
 };
 
 static_assert(congestion_control_algorithm<RenolikeCongestionControl>);
@@ -0,0 +1,40 @@
+#include "pch.hpp"
+#include "digest.hpp"
+
+#include <charconv>
+
+namespace rft {
+
+void DigestBuilder::AddZeros(U64 count) {
+    static const std::array<char, 64 * 1024> ZEROS{};
+    while (count > 0) {
+        const auto size = static_cast<size_t>(std::min<U64>(count, ZEROS.size()));
+        sha3_.add(ZEROS.data(), size);
+        count -= size;
+    }
+}
+
+Digest DigestBuilder::Finish() {
+    // The library only hands out the digest as a hex string
+    const auto hex = sha3_.getHash();
+
+    Digest digest{};
+    for (size_t i = 0; i < sizeof(Digest) && 2 * i + 1 < hex.size(); ++i) {
+        U8 byte = 0;
+        std::from_chars(hex.data() + 2 * i, hex.data() + 2 * i + 2, byte, 16);
+        digest[i / sizeof(U64)] |= static_cast<U64>(byte) << (8 * (i % sizeof(U64)));
+    }
+
+    return digest;
+}
+
+std::string ToHex(const Digest& digest) {
+    std::string hex;
+    hex.reserve(2 * sizeof(Digest));
+    for (size_t i = 0; i < sizeof(Digest); ++i) {
+        std::format_to(std::back_inserter(hex), "{:02x}", static_cast<U8>(digest[i / sizeof(U64)] >> (8 * (i % sizeof(U64)))));
+    }
+    return hex;
+}
+
+} // namespace rft
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <span>
+
+#include <hash-library/sha3.h>
+
+namespace rft {
+
+// The SHA3-256 digest of a file, in the layout of ServerHello::checksum: the 32 bytes of the digest in order, packed into little-endian U64s
+using Digest = std::array<U64, 4>;
+
+class DigestBuilder {
+public:
+    void Add(std::span<const char> bytes) {
+        sha3_.add(bytes.data(), bytes.size());
+    }
+
+    // For the parts of a file that were never read or written because they are known to be zero
+    void AddZeros(U64 count);
+
+    // Can only be called once
+    Digest Finish();
+
+private:
+    SHA3 sha3_;
+};
+
+std::string ToHex(const Digest& digest);
+
+} // namespace rft
@@ -0,0 +1,327 @@
+#include "pch.hpp"
+#include "file_cache.hpp"
+
+#include <cstring>
+
+#ifdef __unix__
+#include <unistd.h>
+#endif
+
+#include "logger.hpp"
+
+namespace rft {
+
+namespace {
+
+// Heavily fragmented files could have millions of extents. Past this many, the rest of the file counts as data, which is always correct.
+constexpr size_t MAX_EXTENTS = 64 * 1024;
+
+std::vector<FileExtent> FindDataExtents([[maybe_unused]] boost::asio::random_access_file& file, U64 size) {
+    if (size == 0) {
+        return {};
+    }
+
+#ifdef SEEK_HOLE
+    // The descriptor's file pointer is free to use, reads through random_access_file are positional
+    const int fd = file.native_handle();
+    std::vector<FileExtent> extents;
+    off_t offset = 0;
+    while (static_cast<U64>(offset) < size) {
+        const auto data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: only a hole is left. Anything else: the file system can't tell, so whatever is left counts as data.
+            if (errno != ENXIO) {
+                extents.push_back({static_cast<U64>(offset), size - static_cast<U64>(offset)});
+            }
+            break;
+        }
+
+        auto hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || static_cast<U64>(hole) > size || extents.size() + 1 == MAX_EXTENTS) {
+            hole = static_cast<off_t>(size);
+        }
+        extents.push_back({static_cast<U64>(data), static_cast<U64>(hole - data)});
+        offset = hole;
+    }
+    return extents;
+#else
+    return {{0, size}};
+#endif
+}
+
+} // namespace
+
+bool IsAllZero(std::span<const char> bytes) noexcept {
+    constexpr size_t BLOCK_SIZE = 64;
+
+    const char* data = bytes.data();
+    size_t size = bytes.size();
+    for (; size >= BLOCK_SIZE; data += BLOCK_SIZE, size -= BLOCK_SIZE) {
+        std::array<U64, BLOCK_SIZE / sizeof(U64)> words;
+        std::memcpy(words.data(), data, BLOCK_SIZE);
+
+        U64 any = 0;
+        for (const auto word : words) {
+            any |= word;
+        }
+        if (any != 0) {
+            return false;
+        }
+    }
+
+    return std::all_of(data, data + size, [](char byte) { return byte == 0; });
+}
+
+CachedFile::CachedFile(FileCache& cache, U64 id, std::filesystem::path path, boost::asio::random_access_file file, U64 size, I64 lastModified,
+                       std::vector<FileExtent> dataExtents)
+    : cache_(cache),
+      id_(id),
+      path_(std::move(path)),
+      file_(std::move(file)),
+      size_(size),
+      lastModified_(lastModified),
+      dataExtents_(std::move(dataExtents)) {
+    cache_.Metrics().openFiles.Add();
+}
+
+CachedFile::~CachedFile() {
+    cache_.Forget(path_);
+    cache_.Metrics().openFiles.Sub();
+}
+
+boost::asio::awaitable<size_t> CachedFile::ReadAt(U64 offset, std::span<char> out) {
+    const auto blockSize = cache_.Options().blockSize;
+    size_t copied = 0;
+
+    while (copied < out.size() && offset < size_) {
+        const auto block = co_await cache_.GetBlock(*this, offset / blockSize);
+        const auto offsetInBlock = static_cast<size_t>(offset % blockSize);
+        if (offsetInBlock >= block->data.size()) {
+            break;
+        }
+
+        const auto count = std::min(out.size() - copied, block->data.size() - offsetInBlock);
+        std::copy_n(block->data.begin() + static_cast<std::ptrdiff_t>(offsetInBlock), count, out.begin() + static_cast<std::ptrdiff_t>(copied));
+
+        copied += count;
+        offset += count;
+    }
+
+    co_return copied;
+}
+
+bool CachedFile::IsSmall() const noexcept {
+    return size_ <= cache_.Options().smallFileThreshold;
+}
+
+bool CachedFile::IsHole(U64 offset, U64 size) const noexcept {
+    // The first extent that ends after offset is the only one that can overlap the range
+    const auto extent = std::ranges::upper_bound(dataExtents_, offset, {}, [](const FileExtent& extent) { return extent.offset + extent.size; });
+    return extent == dataExtents_.end() || extent->offset >= offset + size;
+}
+
+U64 CachedFile::NextData(U64 offset) const noexcept {
+    const auto extent = std::ranges::upper_bound(dataExtents_, offset, {}, [](const FileExtent& extent) { return extent.offset + extent.size; });
+    return extent == dataExtents_.end() ? size_ : std::max(offset, extent->offset);
+}
+
+boost::asio::awaitable<SmallFileContents> CachedFile::ReadSmall() {
+    if (!IsSmall()) {
+        throw std::logic_error{std::format("{} is too large to be read in one piece.", path_.string())};
+    }
+
+    // A small file always fits into its first block
+    auto& metrics = cache_.Metrics();
+    const auto block = co_await cache_.GetBlock(*this, 0);
+    auto& shard = cache_.ShardFor({id_, 0});
+    metrics.smallFileReads.Add();
+
+    std::shared_ptr<const std::vector<char>> data(block, &block->data);
+    {
+        std::scoped_lock lock(shard.mutex);
+        if (block->digest) {
+            metrics.smallFileDigestHits.Add();
+            co_return SmallFileContents{std::move(data), *block->digest};
+        }
+    }
+
+    // Two streams might both end up hashing the file, which is harmless
+    DigestBuilder digest;
+    digest.Add(*data);
+    SmallFileContents contents{std::move(data), digest.Finish()};
+    {
+        std::scoped_lock lock(shard.mutex);
+        block->digest = contents.digest;
+    }
+
+    co_return contents;
+}
+
+FileCache::FileCache(boost::asio::any_io_executor executor, FileCacheOptions options)
+    : executor_(std::move(executor)),
+      options_(options) {
+    if (options_.blockSize == 0 || options_.shards == 0) {
+        throw std::invalid_argument{"The block size and the number of shards of the file cache must not be 0."};
+    }
+
+    options_.smallFileThreshold = std::min(options_.smallFileThreshold, options_.blockSize);
+    shardBudget_ = options_.memoryBudgetBytes / options_.shards;
+    for (size_t i = 0; i < options_.shards; ++i) {
+        shards_.push_back(std::make_unique<Shard>());
+    }
+
+    LOG_INFO("File cache with {} MiB in {} shards and {} KiB blocks.", options_.memoryBudgetBytes / (1024 * 1024), options_.shards, options_.blockSize / 1024);
+}
+
+std::shared_ptr<CachedFile> FileCache::Open(const std::filesystem::path& path) {
+    metrics_.fileOpens.Add();
+    if (auto file = FindOpen(path)) {
+        return file;
+    }
+
+    // Opening, stat'ing and scanning for holes can take long for a slow or heavily fragmented file. None of it happens under filesMutex_, so it only holds
+    // up this request and not everybody else who opens a file.
+    boost::asio::random_access_file file(executor_);
+    file.open(path.string(), boost::asio::file_base::read_only);
+    const auto size = file.size();
+    const auto lastWriteTime = std::filesystem::last_write_time(path);
+    const auto lastModified = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::file_clock::to_sys(lastWriteTime).time_since_epoch()).count();
+    auto dataExtents = FindDataExtents(file, size);
+    if (dataExtents.size() != 1 || dataExtents.front().size != size) {
+        LOG_DEBUG("File cache: {} is sparse, {} data extents.", path.string(), dataExtents.size());
+    }
+
+    std::scoped_lock lock(filesMutex_);
+
+    // Somebody else may have opened the same file in the meantime, all streams of a file have to share one CachedFile
+    if (auto it = files_.find(path); it != files_.end()) {
+        if (auto existing = it->second.lock()) {
+            metrics_.sharedOpens.Add();
+            return existing;
+        }
+    }
+
+    // A modified file gets a new ID, so that we never serve stale blocks
+    const auto lastWrite = static_cast<I64>(lastWriteTime.time_since_epoch().count());
+    auto& version = fileIds_[path];
+    if (version.id == 0 || version.lastWrite != lastWrite || version.size != size) {
+        version = {lastWrite, size, nextFileId_++};
+        LOG_DEBUG("File cache: {} has ID {}.", path.string(), version.id);
+    }
+
+    auto cachedFile = std::make_shared<CachedFile>(*this, version.id, path, std::move(file), size, static_cast<I64>(lastModified), std::move(dataExtents));
+    files_[path] = cachedFile;
+    return cachedFile;
+}
+
+std::shared_ptr<CachedFile> FileCache::FindOpen(const std::filesystem::path& path) {
+    std::scoped_lock lock(filesMutex_);
+
+    if (auto it = files_.find(path); it != files_.end()) {
+        if (auto file = it->second.lock()) {
+            metrics_.sharedOpens.Add();
+            return file;
+        }
+    }
+    return nullptr;
+}
+
+void FileCache::Forget(const std::filesystem::path& path) {
+    // Nobody can open a deleted file again, so its ID is of no use anymore. Its blocks age out of the LRU. Checked before we take the lock, like all I/O.
+    std::error_code error;
+    const bool deleted = !std::filesystem::exists(path, error) && !error;
+
+    std::scoped_lock lock(filesMutex_);
+
+    // Somebody might have opened the file again in the meantime
+    if (auto it = files_.find(path); it != files_.end() && it->second.expired()) {
+        files_.erase(it);
+        if (deleted) {
+            fileIds_.erase(path);
+        }
+    }
+}
+
+boost::asio::awaitable<std::shared_ptr<const FileCache::Block>> FileCache::GetBlock(CachedFile& file, U64 index) {
+    const BlockKey key{file.id_, index};
+    auto& shard = ShardFor(key);
+
+    std::shared_ptr<Block> block;
+    bool load = false;
+    {
+        std::scoped_lock lock(shard.mutex);
+
+        if (auto it = shard.blocks.find(key); it != shard.blocks.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.second);
+            block = it->second.first;
+            (block->ready ? metrics_.blockHits : metrics_.coalescedReads).Add();
+        } else {
+            metrics_.blockMisses.Add();
+            block = std::make_shared<Block>();
+            shard.lru.push_front(key);
+            shard.blocks.emplace(key, std::make_pair(block, shard.lru.begin()));
+            load = true;
+        }
+    }
+
+    if (load) {
+        try {
+            const auto offset = index * options_.blockSize;
+            block->data.resize(static_cast<size_t>(std::min<U64>(options_.blockSize, file.size_ - std::min(offset, file.size_))));
+            co_await boost::asio::async_read_at(file.file_, offset, boost::asio::buffer(block->data), boost::asio::use_awaitable);
+            metrics_.bytesReadFromDisk.Add(block->data.size());
+        } catch (const std::exception& e) {
+            LOG_ERROR("File cache: Reading block {} of {} failed: {}", index, file.path_.string(), e.what());
+            block->error = std::current_exception();
+        }
+
+        {
+            std::scoped_lock lock(shard.mutex);
+            block->ready = true;
+            block->waiters.NotifyAll();
+
+            if (auto it = shard.blocks.find(key); it != shard.blocks.end() && it->second.first == block) {
+                if (block->error) {
+                    // The next stream should try again
+                    shard.lru.erase(it->second.second);
+                    shard.blocks.erase(it);
+                } else {
+                    shard.residentBytes += block->data.size();
+                    metrics_.residentBlocks.Add();
+                    metrics_.residentBytes.Add(static_cast<I64>(block->data.size()));
+                    EvictLocked(shard);
+                }
+            }
+        }
+    } else {
+        // Park until the stream that reads the block is done. ready only ever goes from false to true, so one wake up is enough.
+        co_await block->waiters.Wait(shard.mutex, [&block] { return block->ready; });
+    }
+
+    if (block->error) {
+        std::rethrow_exception(block->error);
+    }
+
+    co_return block;
+}
+
+void FileCache::EvictLocked(Shard& shard) {
+    for (auto it = shard.lru.rbegin(); shard.residentBytes > shardBudget_ && it != shard.lru.rend();) {
+        const auto entry = shard.blocks.find(*it);
+        const auto& block = entry->second.first;
+        if (!block->ready) {
+            ++it;
+            continue;
+        }
+
+        shard.residentBytes -= block->data.size();
+        metrics_.evictions.Add();
+        metrics_.residentBlocks.Sub();
+        metrics_.residentBytes.Sub(static_cast<I64>(block->data.size()));
+
+        shard.blocks.erase(entry);
+        it = std::make_reverse_iterator(shard.lru.erase(std::next(it).base()));
+    }
+}
+
+} // namespace rft
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <mutex>
+#include <span>
+#include <unordered_map>
+
+#include <boost/asio.hpp>
+
+#include "digest.hpp"
+#include "metrics.hpp"
+#include "wait_queue.hpp"
+
+// A server wide cache for the files we serve. Streams for the same file share one open handle, and the file contents are cached in large blocks that are
+// kept in a sharded LRU with a fixed memory budget. If several streams need the same block at the same time, only the first one reads it from disk and
+// the others wait for that read, so a file that is downloaded by many clients at once is read (and held in memory) only once.
+
+namespace rft {
+
+struct FileCacheOptions {
+    // Upper bound for the bytes held by cached blocks, split evenly over all shards. Blocks that are still being used by a stream stay alive after they
+    // were evicted, so the actual memory use can be slightly higher for a short time.
+    size_t memoryBudgetBytes = 256 * 1024 * 1024;
+    // Files are read from disk and cached in blocks of this size. Larger blocks mean fewer reads, but a coarser eviction.
+    size_t blockSize = 1024 * 1024;
+    // Every shard has its own lock and LRU list
+    size_t shards = 16;
+    // Files up to this size (and never larger than a block) are small: they are cached in one piece together with their digest, so that they can be served
+    // without touching the disk or hashing them again
+    size_t smallFileThreshold = 16 * 1024;
+};
+
+// The contents and the digest of a small file. The data stays valid as long as this is alive, even if the cache evicts it in the meantime.
+struct SmallFileContents {
+    std::shared_ptr<const std::vector<char>> data;
+    Digest digest;
+};
+
+class FileCache;
+
+// A range of a file that holds data, everything between two extents is a hole of a sparse file
+struct FileExtent {
+    U64 offset;
+    U64 size;
+};
+
+// True if all bytes are zero. Works on 64 byte blocks whose words are ORed together without branches, which the compiler turns into vector instructions,
+// and gives up at the first block that isn't zero, so data that isn't zero is rejected after a few bytes.
+bool IsAllZero(std::span<const char> bytes) noexcept;
+
+// A handle to an open file, shared by all streams that serve it. The file is closed once the last stream lets go of it.
+class CachedFile {
+public:
+    CachedFile(FileCache& cache, U64 id, std::filesystem::path path, boost::asio::random_access_file file, U64 size, I64 lastModified,
+               std::vector<FileExtent> dataExtents);
+    ~CachedFile();
+
+    CachedFile(const CachedFile&) = delete;
+    CachedFile& operator=(const CachedFile&) = delete;
+
+    U64 Size() const noexcept {
+        return size_;
+    }
+
+    const std::filesystem::path& Path() const noexcept {
+        return path_;
+    }
+
+    // Seconds since the Unix epoch, as of when the file was opened
+    I64 LastModified() const noexcept {
+        return lastModified_;
+    }
+
+    // Copies the bytes at offset into out, going through the block cache. Returns fewer bytes than requested only at the end of the file.
+    boost::asio::awaitable<size_t> ReadAt(U64 offset, std::span<char> out);
+
+    bool IsSmall() const noexcept;
+
+    // True if the range lies completely in a hole, so reading it would only yield zeros. Holes are looked up once when the file is opened, on systems
+    // without SEEK_HOLE a file has none.
+    bool IsHole(U64 offset, U64 size) const noexcept;
+
+    // Where the first data at or after offset starts, so a hole can be skipped in one step. Size() if only a hole is left.
+    U64 NextData(U64 offset) const noexcept;
+
+    // The whole file without copying it, only for small files. The digest is computed once for as long as the file stays in the cache.
+    boost::asio::awaitable<SmallFileContents> ReadSmall();
+
+private:
+    friend class FileCache;
+
+    FileCache& cache_;
+    // Identifies the contents of the file. Reopening an unmodified file yields the same ID, so its blocks can still be found in the cache.
+    const U64 id_;
+    const std::filesystem::path path_;
+    // Reads are positional and don't share a file pointer, so concurrent reads of different blocks through one handle are fine
+    boost::asio::random_access_file file_;
+    const U64 size_;
+    const I64 lastModified_;
+    // Sorted by offset
+    const std::vector<FileExtent> dataExtents_;
+};
+
+class FileCache {
+public:
+    FileCache(boost::asio::any_io_executor executor, FileCacheOptions options = {});
+
+    // Throws if the file can't be opened. The file system is only accessed without the lock on the open files, so concurrent calls for different files
+    // don't wait for each other.
+    std::shared_ptr<CachedFile> Open(const std::filesystem::path& path);
+
+    const FileCacheOptions& Options() const noexcept {
+        return options_;
+    }
+
+    metrics::FileCacheMetrics& Metrics() noexcept {
+        return metrics_;
+    }
+
+private:
+    friend class CachedFile;
+
+    struct Block {
+        std::vector<char> data;
+        // Only for small files, guarded by the shard lock
+        mutable std::optional<Digest> digest;
+        bool ready = false;
+        std::exception_ptr error;
+        // Streams waiting for the read of this block to finish, guarded by the shard lock
+        WaitQueue waiters;
+    };
+
+    struct BlockKey {
+        U64 fileId;
+        U64 index;
+
+        bool operator==(const BlockKey&) const noexcept = default;
+    };
+
+    struct BlockKeyHash {
+        size_t operator()(const BlockKey& key) const noexcept {
+            return std::hash<U64>{}(key.fileId * 0x9E3779B97F4A7C15ull ^ key.index);
+        }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first
+        std::list<BlockKey> lru;
+        std::unordered_map<BlockKey, std::pair<std::shared_ptr<Block>, std::list<BlockKey>::iterator>, BlockKeyHash> blocks;
+        size_t residentBytes = 0;
+    };
+
+    // Returns the block once it's in memory, reading it from disk if nobody else is already doing so
+    boost::asio::awaitable<std::shared_ptr<const Block>> GetBlock(CachedFile& file, U64 index);
+
+    // The CachedFile of path if somebody still holds it open
+    std::shared_ptr<CachedFile> FindOpen(const std::filesystem::path& path);
+    void Forget(const std::filesystem::path& path);
+
+    Shard& ShardFor(const BlockKey& key) noexcept {
+        return *shards_[BlockKeyHash{}(key) % shards_.size()];
+    }
+
+    // Evicts least recently used blocks until the shard is within its budget. Blocks that are still being read aren't resident and are skipped.
+    void EvictLocked(Shard& shard);
+
+    boost::asio::any_io_executor executor_;
+    FileCacheOptions options_;
+    size_t shardBudget_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::mutex filesMutex_;
+    std::map<std::filesystem::path, std::weak_ptr<CachedFile>> files_;
+    // The version of a file we saw last. A modified file replaces its entry, nothing asks for the blocks of the old version anymore and they age out of the
+    // LRU. So there is at most one entry per file that exists.
+    struct FileVersion {
+        I64 lastWrite = 0;
+        U64 size = 0;
+        U64 id = 0;
+    };
+    std::map<std::filesystem::path, FileVersion> fileIds_;
+    U64 nextFileId_ = 1;
+
+    metrics::FileCacheMetrics metrics_;
+};
+
+} // namespace rft
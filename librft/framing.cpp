@@ -0,0 +1,579 @@
+#include "pch.hpp"
+#include "framing.hpp"
+
+#include <cstring>
+
+namespace rft::framing {
+
+namespace {
+
+void WriteHeader(Writer& writer, const MessageBase& header, MessageType type) noexcept {
+    writer.Put(header.streamId).Put(type).Put(header.sequenceNumber);
+}
+
+// Reads the header and checks that the datagram has a valid size for the expected type
+std::optional<MessageBase> ReadHeader(Reader& reader, std::span<const char> datagram, MessageType expected) noexcept {
+    if (!IsValidSize(expected, datagram.size())) {
+        return std::nullopt;
+    }
+
+    MessageBase header{};
+    header.streamId = reader.Get<U16>();
+    header.messageType = reader.Get<MessageType>();
+    header.sequenceNumber = reader.Get<U64>();
+
+    if (!reader.Ok() || header.messageType != expected) {
+        return std::nullopt;
+    }
+
+    return header;
+}
+
+void WriteCookie(Writer& writer, const Cookie& cookie) noexcept {
+    writer.Put(cookie.timestamp).Put(cookie.mac);
+}
+
+Cookie ReadCookie(Reader& reader) noexcept {
+    Cookie cookie{};
+    cookie.timestamp = reader.Get<U32>();
+    std::array<U8, COOKIE_MAC_SIZE> mac{};
+    reader.Get(mac);
+    cookie.mac = mac;
+    return cookie;
+}
+
+void WriteAckFrequency(Writer& writer, const AckFrequency& ackFrequency) noexcept {
+    writer.Put(ackFrequency.ackEvery).Put(ackFrequency.maxDelayMicroseconds);
+}
+
+AckFrequency ReadAckFrequency(Reader& reader) noexcept {
+    AckFrequency ackFrequency{};
+    ackFrequency.ackEvery = reader.Get<U8>();
+    ackFrequency.maxDelayMicroseconds = reader.Get<U32>();
+    return ackFrequency;
+}
+
+void WriteKeyShare(Writer& writer, const KeyShare& keyShare) noexcept {
+    writer.Put(keyShare.publicKey);
+}
+
+KeyShare ReadKeyShare(Reader& reader) noexcept {
+    KeyShare keyShare{};
+    std::array<U8, 32> publicKey{};
+    reader.Get(publicKey);
+    keyShare.publicKey = publicKey;
+    return keyShare;
+}
+
+constexpr size_t NextHeaderSize(U8 flag) noexcept {
+    switch (flag) {
+    case NEXT_HEADER_COOKIE:
+        return sizeof(Cookie);
+    case NEXT_HEADER_ACK_FREQUENCY:
+        return sizeof(AckFrequency);
+    case NEXT_HEADER_KEY_SHARE:
+        return sizeof(KeyShare);
+    case NEXT_HEADER_ZERO_RANGES:
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+// The bytes of the next header with the given flag, if the hello has it. Next headers are laid out in the order of their flags, so where one starts
+// depends on which of the lower flags are set.
+std::optional<std::span<const char>> FindNextHeader(std::span<const char> hello, size_t fixedSize, U8 type, U8 offset, U8 flag) noexcept {
+    if ((type & flag) == 0) {
+        return std::nullopt;
+    }
+
+    size_t position = 0;
+    for (U8 lower = 1; lower < flag; lower <<= 1) {
+        if ((type & lower) != 0) {
+            position += NextHeaderSize(lower);
+        }
+    }
+
+    const size_t size = NextHeaderSize(flag);
+    if (position + size > offset || fixedSize + position + size > hello.size()) {
+        return std::nullopt;
+    }
+
+    return hello.subspan(fixedSize + position, size);
+}
+
+template <typename T>
+std::vector<char> Allocate(size_t variableSize) {
+    return std::vector<char>(Layout<T>::MINIMUM_SIZE + variableSize);
+}
+
+} // namespace
+
+std::optional<MessageBase> ParseHeader(std::span<const char> datagram) noexcept {
+    if (datagram.size() < HEADER_SIZE) {
+        return std::nullopt;
+    }
+
+    Reader reader(datagram);
+    MessageBase header{};
+    header.streamId = reader.Get<U16>();
+    header.messageType = reader.Get<MessageType>();
+    header.sequenceNumber = reader.Get<U64>();
+
+    if (!IsValidSize(header.messageType, datagram.size())) {
+        return std::nullopt;
+    }
+
+    return header;
+}
+
+void PatchHeader(std::span<char> datagram, U16 streamId, U64 sequenceNumber) noexcept {
+    assert(datagram.size() >= HEADER_SIZE);
+    StoreLittleEndian(datagram.data(), streamId);
+    StoreLittleEndian(datagram.data() + sizeof(U16) + sizeof(MessageType), sequenceNumber);
+}
+
+std::vector<char> Serialize(const ClientHello& message, const std::optional<Cookie>& cookie, const std::optional<AckFrequency>& ackFrequency,
+                            const std::optional<KeyShare>& keyShare, bool zeroRanges) {
+    const auto fileNameSize = strnlen(message.fileName, sizeof(message.fileName));
+    const U8 nextHeaderType = (cookie ? NEXT_HEADER_COOKIE : 0) | (ackFrequency ? NEXT_HEADER_ACK_FREQUENCY : 0) | (keyShare ? NEXT_HEADER_KEY_SHARE : 0) |
+                              (zeroRanges ? NEXT_HEADER_ZERO_RANGES : 0);
+    const auto headersSize = (cookie ? sizeof(Cookie) : 0) + (ackFrequency ? sizeof(AckFrequency) : 0) + (keyShare ? sizeof(KeyShare) : 0);
+    // Peers skip what is left of the next header area after the headers they know, so that's where the padding goes
+    const auto unpaddedSize = Layout<ClientHello>::MINIMUM_SIZE + headersSize + fileNameSize;
+    const auto padding = unpaddedSize < MIN_CLIENT_HELLO_SIZE ? MIN_CLIENT_HELLO_SIZE - unpaddedSize : 0;
+    const auto nextHeaderSize = headersSize + padding;
+    assert(fileNameSize + nextHeaderSize <= VARIABLE_SIZE<ClientHello>);
+    auto buffer = Allocate<ClientHello>(nextHeaderSize + fileNameSize);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, ClientHello::TYPE);
+    writer.Put(message.version).Put(nextHeaderType).Put(static_cast<U8>(nextHeaderSize));
+    writer.Put(message.windowInMessages).Put(message.startChunk);
+    if (cookie) {
+        WriteCookie(writer, *cookie);
+    }
+    if (ackFrequency) {
+        WriteAckFrequency(writer, *ackFrequency);
+    }
+    if (keyShare) {
+        WriteKeyShare(writer, *keyShare);
+    }
+    const std::array<char, MIN_CLIENT_HELLO_SIZE> zeros{};
+    writer.PutBytes({zeros.data(), padding});
+    writer.PutBytes({message.fileName, fileNameSize});
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const ServerHello& message, const std::optional<AckFrequency>& ackFrequency, const std::optional<KeyShare>& keyShare,
+                            bool zeroRanges) {
+    const U8 nextHeaderType = (ackFrequency ? NEXT_HEADER_ACK_FREQUENCY : 0) | (keyShare ? NEXT_HEADER_KEY_SHARE : 0) | (zeroRanges ? NEXT_HEADER_ZERO_RANGES : 0);
+    const auto nextHeaderSize = (ackFrequency ? sizeof(AckFrequency) : 0) + (keyShare ? sizeof(KeyShare) : 0);
+    auto buffer = Allocate<ServerHello>(nextHeaderSize);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, ServerHello::TYPE);
+    writer.Put(message.version).Put(nextHeaderType).Put(static_cast<U8>(nextHeaderSize));
+    writer.Put(message.windowInMessages);
+    writer.Put(message.checksum).Put(message.lastModified).Put(message.fileSizeInBytes);
+    if (ackFrequency) {
+        WriteAckFrequency(writer, *ackFrequency);
+    }
+    if (keyShare) {
+        WriteKeyShare(writer, *keyShare);
+    }
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const AckMessage& message) {
+    auto buffer = Allocate<AckMessage>(0);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, AckMessage::TYPE);
+    writer.Put(message.windowInMessages).Put(message.ackNumber);
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const FinMessage& message, bool withChecksum) {
+    auto buffer = Allocate<FinMessage>(withChecksum ? sizeof(message.checksum) : 0);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, FinMessage::TYPE);
+    if (withChecksum) {
+        writer.Put(message.checksum);
+    }
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const HelloRetry& message) {
+    auto buffer = Allocate<HelloRetry>(0);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, HelloRetry::TYPE);
+    WriteCookie(writer, message.cookie);
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const MulticastAnnounce& message) {
+    const auto fileNameSize = std::ranges::find(message.fileName, '\0') - std::begin(message.fileName);
+    assert(static_cast<size_t>(fileNameSize) < sizeof(message.fileName));
+    auto buffer = Allocate<MulticastAnnounce>(static_cast<size_t>(fileNameSize));
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, MulticastAnnounce::TYPE);
+    writer.Put(message.checksum).Put(message.lastModified).Put(message.fileSizeInBytes);
+    writer.PutBytes({message.fileName, static_cast<size_t>(fileNameSize)});
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const NackMessage& message) {
+    const size_t rangeCount = std::min<size_t>(message.rangeCount, message.ranges.size());
+    auto buffer = Allocate<NackMessage>(rangeCount * sizeof(NackRange));
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, NackMessage::TYPE);
+    writer.Put(static_cast<U8>(rangeCount));
+    WriteCookie(writer, message.cookie);
+    for (size_t i = 0; i < rangeCount; ++i) {
+        writer.Put(message.ranges[i].firstChunk).Put(message.ranges[i].chunkCount);
+    }
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const ZeroRangeMessage& message) {
+    auto buffer = Allocate<ZeroRangeMessage>(0);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, ZeroRangeMessage::TYPE);
+    writer.Put(message.firstChunk).Put(message.chunkCount);
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const ErrorMessage& message, size_t messageSize) {
+    messageSize = std::min(messageSize, message.message.size());
+    auto buffer = Allocate<ErrorMessage>(messageSize);
+
+    Writer writer(buffer);
+    WriteHeader(writer, message, ErrorMessage::TYPE);
+    writer.Put(message.errorCategory).Put(message.errorCode);
+    writer.PutBytes({message.message.data(), messageSize});
+
+    return buffer;
+}
+
+std::vector<char> Serialize(const ChunkMessage& message, size_t payloadSize) {
+    payloadSize = std::min(payloadSize, message.payload.size());
+    auto buffer = SerializeChunkHeader(message, message.checksum, payloadSize);
+    std::ranges::copy_n(message.payload.begin(), static_cast<std::ptrdiff_t>(payloadSize), ChunkPayload(buffer).begin());
+
+    return buffer;
+}
+
+std::vector<char> SerializeChunkHeader(const MessageBase& header, const std::array<U8, 8>& checksum, size_t payloadSize) {
+    assert(payloadSize <= VARIABLE_SIZE<ChunkMessage>);
+    auto buffer = Allocate<ChunkMessage>(payloadSize);
+
+    Writer writer(buffer);
+    WriteHeader(writer, header, ChunkMessage::TYPE);
+    writer.Put(checksum);
+
+    return buffer;
+}
+
+std::span<char> ChunkPayload(std::span<char> datagram) noexcept {
+    return datagram.subspan(Layout<ChunkMessage>::MINIMUM_SIZE);
+}
+
+std::span<char> ChunkChecksum(std::span<char> datagram) noexcept {
+    return datagram.subspan(HEADER_SIZE, sizeof(ChunkMessage::checksum));
+}
+
+template <>
+std::optional<ClientHello> Parse<ClientHello>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, ClientHello::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    ClientHello message{};
+    static_cast<MessageBase&>(message) = *header;
+    message.version = reader.Get<U8>();
+    message.nextHeaderType = reader.Get<U8>();
+    message.nextHeaderOffset = reader.Get<U8>();
+    message.windowInMessages = reader.Get<U16>();
+    message.startChunk = reader.Get<U32>();
+
+    // The next header isn't part of the ClientHello itself, see ParseCookie(). Without next headers, the area only holds padding.
+    reader.Bytes(message.nextHeaderOffset);
+
+    // We need room for the terminator
+    const auto fileName = reader.Rest();
+    if (!reader.Ok() || fileName.size() >= sizeof(message.fileName) || std::ranges::find(fileName, '\0') != fileName.end()) {
+        return std::nullopt;
+    }
+    std::ranges::copy(fileName, message.fileName);
+    message.fileName[fileName.size()] = '\0';
+
+    return message;
+}
+
+template <>
+std::optional<ServerHello> Parse<ServerHello>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, ServerHello::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    ServerHello message{};
+    static_cast<MessageBase&>(message) = *header;
+    message.version = reader.Get<U8>();
+    message.nextHeaderType = reader.Get<U8>();
+    message.nextHeaderOffset = reader.Get<U8>();
+    message.windowInMessages = reader.Get<U16>();
+    std::array<U64, 4> checksum{};
+    reader.Get(checksum);
+    message.checksum = checksum;
+    message.lastModified = reader.Get<I64>();
+    message.fileSizeInBytes = reader.Get<U64>();
+
+    // The next headers aren't part of the ServerHello itself, see ParseAckFrequency()
+    if (reader.Rest().size() != message.nextHeaderOffset) {
+        return std::nullopt;
+    }
+
+    return reader.Ok() ? std::optional{message} : std::nullopt;
+}
+
+template <>
+std::optional<AckMessage> Parse<AckMessage>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, AckMessage::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    AckMessage message{};
+    static_cast<MessageBase&>(message) = *header;
+    message.windowInMessages = reader.Get<U16>();
+    message.ackNumber = reader.Get<U64>();
+
+    return reader.Ok() ? std::optional{message} : std::nullopt;
+}
+
+template <>
+std::optional<FinMessage> Parse<FinMessage>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, FinMessage::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    FinMessage message{};
+    static_cast<MessageBase&>(message) = *header;
+
+    // It's either all of the checksum or nothing
+    const auto rest = reader.Rest();
+    if (!rest.empty()) {
+        if (rest.size() != sizeof(message.checksum)) {
+            return std::nullopt;
+        }
+
+        Reader checksumReader(rest);
+        std::array<U64, 4> checksum{};
+        checksumReader.Get(checksum);
+        message.checksum = checksum;
+    }
+
+    return message;
+}
+
+template <>
+std::optional<HelloRetry> Parse<HelloRetry>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, HelloRetry::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    HelloRetry message{};
+    static_cast<MessageBase&>(message) = *header;
+    message.cookie = ReadCookie(reader);
+
+    return reader.Ok() ? std::optional{message} : std::nullopt;
+}
+
+template <>
+std::optional<MulticastAnnounce> Parse<MulticastAnnounce>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, MulticastAnnounce::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    MulticastAnnounce message{};
+    static_cast<MessageBase&>(message) = *header;
+    std::array<U64, 4> checksum{};
+    reader.Get(checksum);
+    message.checksum = checksum;
+    message.lastModified = reader.Get<I64>();
+    message.fileSizeInBytes = reader.Get<U64>();
+
+    // We need room for the terminator
+    const auto fileName = reader.Rest();
+    if (!reader.Ok() || fileName.empty() || fileName.size() >= sizeof(message.fileName) || std::ranges::find(fileName, '\0') != fileName.end()) {
+        return std::nullopt;
+    }
+    std::ranges::copy(fileName, message.fileName);
+    message.fileName[fileName.size()] = '\0';
+
+    return message;
+}
+
+template <>
+std::optional<NackMessage> Parse<NackMessage>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, NackMessage::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    NackMessage message{};
+    static_cast<MessageBase&>(message) = *header;
+    message.rangeCount = reader.Get<U8>();
+    message.cookie = ReadCookie(reader);
+    if (datagram.size() != Layout<NackMessage>::MINIMUM_SIZE + message.rangeCount * sizeof(NackRange)) {
+        return std::nullopt;
+    }
+
+    for (size_t i = 0; i < message.rangeCount; ++i) {
+        message.ranges[i].firstChunk = reader.Get<U64>();
+        message.ranges[i].chunkCount = reader.Get<U32>();
+    }
+
+    return reader.Ok() ? std::optional{message} : std::nullopt;
+}
+
+template <>
+std::optional<ZeroRangeMessage> Parse<ZeroRangeMessage>(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, ZeroRangeMessage::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    ZeroRangeMessage message{};
+    static_cast<MessageBase&>(message) = *header;
+    message.firstChunk = reader.Get<U64>();
+    message.chunkCount = reader.Get<U64>();
+
+    return reader.Ok() ? std::optional{message} : std::nullopt;
+}
+
+std::optional<Cookie> ParseCookie(std::span<const char> clientHello) noexcept {
+    const auto message = Parse<ClientHello>(clientHello);
+    if (!message) {
+        return std::nullopt;
+    }
+
+    const auto bytes = FindNextHeader(clientHello, Layout<ClientHello>::MINIMUM_SIZE, message->nextHeaderType, message->nextHeaderOffset, NEXT_HEADER_COOKIE);
+    if (!bytes) {
+        return std::nullopt;
+    }
+
+    Reader reader(*bytes);
+    const auto cookie = ReadCookie(reader);
+    return reader.Ok() ? std::optional{cookie} : std::nullopt;
+}
+
+namespace {
+
+// Hellos of both directions can carry ACK frequency and key share
+std::optional<std::span<const char>> FindHelloNextHeader(std::span<const char> hello, U8 flag) noexcept {
+    const auto header = ParseHeader(hello);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    const auto find = [hello, flag]<typename T>(const std::optional<T>& message) -> std::optional<std::span<const char>> {
+        if (!message) {
+            return std::nullopt;
+        }
+        return FindNextHeader(hello, Layout<T>::MINIMUM_SIZE, message->nextHeaderType, message->nextHeaderOffset, flag);
+    };
+
+    if (header->messageType == MessageType::kClientHello) {
+        return find(Parse<ClientHello>(hello));
+    }
+    if (header->messageType == MessageType::kServerHello) {
+        return find(Parse<ServerHello>(hello));
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+std::optional<AckFrequency> ParseAckFrequency(std::span<const char> hello) noexcept {
+    const auto bytes = FindHelloNextHeader(hello, NEXT_HEADER_ACK_FREQUENCY);
+    if (!bytes) {
+        return std::nullopt;
+    }
+
+    Reader reader(*bytes);
+    const auto ackFrequency = ReadAckFrequency(reader);
+    return reader.Ok() ? std::optional{ackFrequency} : std::nullopt;
+}
+
+std::optional<KeyShare> ParseKeyShare(std::span<const char> hello) noexcept {
+    const auto bytes = FindHelloNextHeader(hello, NEXT_HEADER_KEY_SHARE);
+    if (!bytes) {
+        return std::nullopt;
+    }
+
+    Reader reader(*bytes);
+    const auto keyShare = ReadKeyShare(reader);
+    return reader.Ok() ? std::optional{keyShare} : std::nullopt;
+}
+
+bool HasZeroRanges(std::span<const char> hello) noexcept {
+    return FindHelloNextHeader(hello, NEXT_HEADER_ZERO_RANGES).has_value();
+}
+
+std::optional<ErrorView> ParseError(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, ErrorMessage::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    ErrorView view{*header, reader.Get<U8>(), reader.Get<U8>(), {}};
+    const auto message = reader.Rest();
+    view.message = {message.data(), message.size()};
+
+    return reader.Ok() ? std::optional{view} : std::nullopt;
+}
+
+std::optional<ChunkView> ParseChunk(std::span<const char> datagram) noexcept {
+    Reader reader(datagram);
+    const auto header = ReadHeader(reader, datagram, ChunkMessage::TYPE);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    ChunkView view{*header, {}, {}};
+    reader.Get(view.checksum);
+    view.payload = reader.Rest();
+
+    return reader.Ok() ? std::optional{view} : std::nullopt;
+}
+
+} // namespace rft::framing
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <cassert>
+#include <span>
+
+#include "messages.hpp"
+
+// Encoding and decoding of messages. Every integer is written explicitly in little-endian byte order, independent of the host, and variable-length
+// messages only carry the bytes that are in use.
+
+namespace rft::framing {
+
+template <typename T>
+concept wire_integer = std::is_integral_v<T> || std::is_enum_v<T>;
+
+template <wire_integer T>
+using WireUnsigned = std::make_unsigned_t<typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::type_identity<T>>::type>;
+
+template <wire_integer T>
+constexpr void StoreLittleEndian(char* out, T value) noexcept {
+    using Unsigned = WireUnsigned<T>;
+    auto bits = static_cast<Unsigned>(value);
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<char>(bits & 0xFF);
+        bits = static_cast<Unsigned>(bits >> 8);
+    }
+}
+
+template <wire_integer T>
+constexpr T LoadLittleEndian(const char* in) noexcept {
+    using Unsigned = WireUnsigned<T>;
+    Unsigned bits = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        bits |= static_cast<Unsigned>(static_cast<Unsigned>(static_cast<U8>(in[i])) << (8 * i));
+    }
+    return static_cast<T>(bits);
+}
+
+// Writes into a buffer that is already large enough. Running past the end is a programming error.
+class Writer {
+public:
+    explicit Writer(std::span<char> out) noexcept
+        : out_(out) {
+    }
+
+    template <wire_integer T>
+    Writer& Put(T value) noexcept {
+        assert(offset_ + sizeof(T) <= out_.size());
+        StoreLittleEndian(out_.data() + offset_, value);
+        offset_ += sizeof(T);
+        return *this;
+    }
+
+    template <typename T, size_t N>
+    Writer& Put(const std::array<T, N>& values) noexcept {
+        for (const auto& value : values) {
+            Put(value);
+        }
+        return *this;
+    }
+
+    Writer& PutBytes(std::span<const char> bytes) noexcept {
+        assert(offset_ + bytes.size() <= out_.size());
+        std::ranges::copy(bytes, out_.begin() + static_cast<std::ptrdiff_t>(offset_));
+        offset_ += bytes.size();
+        return *this;
+    }
+
+    size_t Offset() const noexcept {
+        return offset_;
+    }
+
+private:
+    std::span<char> out_;
+    size_t offset_ = 0;
+};
+
+// Reads from an untrusted datagram. Reading past the end doesn't throw, but marks the reader as failed and yields zeros.
+class Reader {
+public:
+    explicit Reader(std::span<const char> in) noexcept
+        : in_(in) {
+    }
+
+    template <wire_integer T>
+    T Get() noexcept {
+        if (in_.size() - offset_ < sizeof(T)) {
+            failed_ = true;
+            offset_ = in_.size();
+            return T{};
+        }
+
+        const auto value = LoadLittleEndian<T>(in_.data() + offset_);
+        offset_ += sizeof(T);
+        return value;
+    }
+
+    template <typename T, size_t N>
+    void Get(std::array<T, N>& values) noexcept {
+        for (auto& value : values) {
+            value = Get<T>();
+        }
+    }
+
+    std::span<const char> Bytes(size_t count) noexcept {
+        if (in_.size() - offset_ < count) {
+            failed_ = true;
+            offset_ = in_.size();
+            return {};
+        }
+
+        auto bytes = in_.subspan(offset_, count);
+        offset_ += count;
+        return bytes;
+    }
+
+    // Everything that hasn't been read yet
+    std::span<const char> Rest() noexcept {
+        auto rest = in_.subspan(offset_);
+        offset_ = in_.size();
+        return rest;
+    }
+
+    bool Ok() const noexcept {
+        return !failed_;
+    }
+
+private:
+    std::span<const char> in_;
+    size_t offset_ = 0;
+    bool failed_ = false;
+};
+
+// Compile-time layout of a message. The variable part (if any) is always the last member.
+template <typename T>
+constexpr size_t VARIABLE_SIZE = 0;
+template <>
+constexpr size_t VARIABLE_SIZE<ClientHello> = sizeof(ClientHello::fileName);
+template <>
+constexpr size_t VARIABLE_SIZE<ServerHello> = sizeof(ServerHello::nextHeader);
+template <>
+constexpr size_t VARIABLE_SIZE<FinMessage> = sizeof(FinMessage::checksum);
+template <>
+constexpr size_t VARIABLE_SIZE<ErrorMessage> = sizeof(ErrorMessage::message);
+template <>
+constexpr size_t VARIABLE_SIZE<ChunkMessage> = sizeof(ChunkMessage::payload);
+template <>
+constexpr size_t VARIABLE_SIZE<MulticastAnnounce> = sizeof(MulticastAnnounce::fileName);
+template <>
+constexpr size_t VARIABLE_SIZE<NackMessage> = sizeof(NackMessage::ranges);
+
+template <typename T>
+struct Layout {
+    constexpr static MessageType TYPE = T::TYPE;
+    constexpr static size_t MINIMUM_SIZE = sizeof(T) - VARIABLE_SIZE<T>;
+    constexpr static size_t MAXIMUM_SIZE = sizeof(T);
+};
+
+constexpr static size_t HEADER_SIZE = sizeof(MessageBase);
+static_assert(HEADER_SIZE == 11);
+static_assert(Layout<ClientHello>::MINIMUM_SIZE == 20 && Layout<ClientHello>::MAXIMUM_SIZE == MAX_DATAGRAM_SIZE);
+static_assert(Layout<ServerHello>::MINIMUM_SIZE == 64 && Layout<ServerHello>::MAXIMUM_SIZE == 64 + sizeof(AckFrequency) + sizeof(KeyShare));
+static_assert(Layout<AckMessage>::MINIMUM_SIZE == 21);
+static_assert(Layout<FinMessage>::MINIMUM_SIZE == HEADER_SIZE && Layout<FinMessage>::MAXIMUM_SIZE == HEADER_SIZE + 32);
+static_assert(Layout<ErrorMessage>::MINIMUM_SIZE == 13);
+static_assert(Layout<ChunkMessage>::MINIMUM_SIZE == 19 && Layout<ChunkMessage>::MAXIMUM_SIZE == MAX_DATAGRAM_SIZE);
+static_assert(Layout<HelloRetry>::MINIMUM_SIZE == HEADER_SIZE + sizeof(Cookie));
+static_assert(Layout<MulticastAnnounce>::MINIMUM_SIZE == 59 && Layout<MulticastAnnounce>::MAXIMUM_SIZE == MAX_DATAGRAM_SIZE);
+static_assert(Layout<NackMessage>::MINIMUM_SIZE == 12 + sizeof(Cookie) && Layout<NackMessage>::MAXIMUM_SIZE <= MAX_DATAGRAM_SIZE);
+static_assert(Layout<ZeroRangeMessage>::MINIMUM_SIZE == 27 && Layout<ZeroRangeMessage>::MAXIMUM_SIZE == 27);
+
+struct SizeRange {
+    bool known = false;
+    size_t minimum = 0;
+    size_t maximum = 0;
+};
+
+template <typename... Messages>
+constexpr std::array<SizeRange, 256> MakeSizeTable() noexcept {
+    std::array<SizeRange, 256> table{};
+    ((table[static_cast<U8>(Layout<Messages>::TYPE)] = SizeRange{true, Layout<Messages>::MINIMUM_SIZE, Layout<Messages>::MAXIMUM_SIZE}), ...);
+    return table;
+}
+
+// Valid datagram sizes, indexed by message type
+constexpr static auto SIZE_TABLE = MakeSizeTable<ClientHello, ServerHello, AckMessage, FinMessage, ErrorMessage, ChunkMessage, HelloRetry, MulticastAnnounce, NackMessage,
+                                                 ZeroRangeMessage>();
+
+constexpr bool IsValidSize(MessageType type, size_t size) noexcept {
+    const auto& range = SIZE_TABLE[static_cast<U8>(type)];
+    return range.known && size >= range.minimum && size <= range.maximum;
+}
+
+static_assert(IsValidSize(MessageType::kAck, 21) && !IsValidSize(MessageType::kAck, 22));
+static_assert(!IsValidSize(static_cast<MessageType>(0x42), HEADER_SIZE));
+
+// Returns the header if the datagram is large enough for its message type and the type is known
+std::optional<MessageBase> ParseHeader(std::span<const char> datagram) noexcept;
+
+// Overwrites the stream ID and sequence number of an already serialized message
+void PatchHeader(std::span<char> datagram, U16 streamId, U64 sequenceNumber) noexcept;
+
+// The minimum size of a ClientHello on the wire. A server that wants a cookie drops smaller ones without an answer, so that the HelloRetry is never larger
+// than what provoked it. Shorter hellos are padded with zeros in the next header area, which is nextHeaderOffset bytes long whether or not nextHeaderType
+// names any next headers, and which receivers skip past the headers they know.
+constexpr static size_t MIN_CLIENT_HELLO_SIZE = Layout<HelloRetry>::MINIMUM_SIZE;
+
+// nextHeaderType and nextHeaderOffset are set according to the next headers that are given. The file name has to leave room for them. The next header
+// area is always padded with zeros up to MIN_CLIENT_HELLO_SIZE.
+std::vector<char> Serialize(const ClientHello& message, const std::optional<Cookie>& cookie = std::nullopt,
+                            const std::optional<AckFrequency>& ackFrequency = std::nullopt, const std::optional<KeyShare>& keyShare = std::nullopt,
+                            bool zeroRanges = false);
+std::vector<char> Serialize(const ServerHello& message, const std::optional<AckFrequency>& ackFrequency = std::nullopt,
+                            const std::optional<KeyShare>& keyShare = std::nullopt, bool zeroRanges = false);
+std::vector<char> Serialize(const AckMessage& message);
+// Without a checksum, only the header is sent
+std::vector<char> Serialize(const FinMessage& message, bool withChecksum = true);
+std::vector<char> Serialize(const HelloRetry& message);
+std::vector<char> Serialize(const MulticastAnnounce& message);
+// Only the first rangeCount ranges are sent
+std::vector<char> Serialize(const NackMessage& message);
+std::vector<char> Serialize(const ZeroRangeMessage& message);
+// Only the first messageSize bytes of the message are sent
+std::vector<char> Serialize(const ErrorMessage& message, size_t messageSize);
+// Only the first payloadSize bytes of the payload are sent
+std::vector<char> Serialize(const ChunkMessage& message, size_t payloadSize);
+
+// Like Serialize(), but only writes the header and leaves payloadSize zeroed bytes for the payload, so that it can be read into ChunkPayload() directly
+std::vector<char> SerializeChunkHeader(const MessageBase& header, const std::array<U8, 8>& checksum, size_t payloadSize);
+std::span<char> ChunkPayload(std::span<char> datagram) noexcept;
+std::span<char> ChunkChecksum(std::span<char> datagram) noexcept;
+
+template <typename T>
+std::optional<T> Parse(std::span<const char> datagram) noexcept;
+
+template <>
+std::optional<ClientHello> Parse<ClientHello>(std::span<const char> datagram) noexcept;
+template <>
+std::optional<ServerHello> Parse<ServerHello>(std::span<const char> datagram) noexcept;
+template <>
+std::optional<AckMessage> Parse<AckMessage>(std::span<const char> datagram) noexcept;
+// The checksum is all zeros if the sender didn't send one
+template <>
+std::optional<FinMessage> Parse<FinMessage>(std::span<const char> datagram) noexcept;
+template <>
+std::optional<HelloRetry> Parse<HelloRetry>(std::span<const char> datagram) noexcept;
+template <>
+std::optional<MulticastAnnounce> Parse<MulticastAnnounce>(std::span<const char> datagram) noexcept;
+template <>
+std::optional<NackMessage> Parse<NackMessage>(std::span<const char> datagram) noexcept;
+template <>
+std::optional<ZeroRangeMessage> Parse<ZeroRangeMessage>(std::span<const char> datagram) noexcept;
+
+// The cookie a ClientHello carries as next header, if any
+std::optional<Cookie> ParseCookie(std::span<const char> clientHello) noexcept;
+
+// The ACK frequency a ClientHello or ServerHello carries as next header, if any
+std::optional<AckFrequency> ParseAckFrequency(std::span<const char> hello) noexcept;
+
+// The key share a ClientHello or ServerHello carries as next header, if any
+std::optional<KeyShare> ParseKeyShare(std::span<const char> hello) noexcept;
+
+// Whether a ClientHello or ServerHello has the NEXT_HEADER_ZERO_RANGES flag
+bool HasZeroRanges(std::span<const char> hello) noexcept;
+
+struct ErrorView {
+    MessageBase header;
+    U8 errorCategory;
+    U8 errorCode;
+    std::string_view message;
+};
+
+// Views point into the datagram, which has to outlive them
+std::optional<ErrorView> ParseError(std::span<const char> datagram) noexcept;
+
+struct ChunkView {
+    MessageBase header;
+    std::array<U8, 8> checksum;
+    std::span<const char> payload;
+};
+
+std::optional<ChunkView> ParseChunk(std::span<const char> datagram) noexcept;
+
+} // namespace rft::framing
@@ -0,0 +1,183 @@
+#include "pch.hpp"
+#include "handshake.hpp"
+
+#include <cstring>
+#include <random>
+
+#include <hash-library/sha256.h>
+
+#include "framing.hpp"
+
+namespace rft {
+
+namespace {
+
+constexpr size_t HMAC_BLOCK_SIZE = 64;
+
+// The bytes of an address, independent of the address family
+std::vector<char> AddressBytes(const boost::asio::ip::address& address) {
+    std::vector<char> bytes;
+    if (address.is_v4()) {
+        const auto v4 = address.to_v4().to_bytes();
+        bytes.assign(v4.begin(), v4.end());
+    } else {
+        const auto v6 = address.to_v6().to_bytes();
+        bytes.assign(v6.begin(), v6.end());
+    }
+    return bytes;
+}
+
+} // namespace
+
+CookieGenerator::CookieGenerator(std::chrono::seconds lifetime)
+    : lifetime_(lifetime) {
+    std::random_device random;
+    std::ranges::generate(secret_, [&random] { return static_cast<U8>(random()); });
+}
+
+Cookie CookieGenerator::Make(const boost::asio::ip::udp::endpoint& source, const ClientHello& hello) const {
+    const auto timestamp = Now();
+    return Truncate(timestamp, Compute(source, hello, timestamp));
+}
+
+bool CookieGenerator::Verify(const boost::asio::ip::udp::endpoint& source, const ClientHello& hello, const Cookie& cookie) const {
+    return Fresh(cookie) && Matches(cookie, Compute(source, hello, cookie.timestamp));
+}
+
+Cookie CookieGenerator::Make(const boost::asio::ip::udp::endpoint& source, U16 sessionId) const {
+    const auto timestamp = Now();
+    return Truncate(timestamp, Compute(source, sessionId, timestamp));
+}
+
+bool CookieGenerator::Verify(const boost::asio::ip::udp::endpoint& source, U16 sessionId, const Cookie& cookie) const {
+    return Fresh(cookie) && Matches(cookie, Compute(source, sessionId, cookie.timestamp));
+}
+
+Cookie CookieGenerator::Truncate(U32 timestamp, const Mac& mac) noexcept {
+    Cookie cookie{};
+    cookie.timestamp = timestamp;
+
+    std::array<U8, COOKIE_MAC_SIZE> truncated{};
+    std::copy_n(mac.begin(), COOKIE_MAC_SIZE, truncated.begin());
+    cookie.mac = truncated;
+
+    return cookie;
+}
+
+bool CookieGenerator::Fresh(const Cookie& cookie) const noexcept {
+    const auto now = Now();
+    const U32 timestamp = cookie.timestamp;
+    return timestamp <= now && now - timestamp <= static_cast<U64>(lifetime_.count());
+}
+
+bool CookieGenerator::Matches(const Cookie& cookie, const Mac& expected) noexcept {
+    const std::array<U8, COOKIE_MAC_SIZE> received = cookie.mac;
+
+    // Don't tell an attacker how many bytes were right
+    U8 difference = 0;
+    for (size_t i = 0; i < COOKIE_MAC_SIZE; ++i) {
+        difference |= static_cast<U8>(expected[i] ^ received[i]);
+    }
+    return difference == 0;
+}
+
+CookieGenerator::Mac CookieGenerator::Compute(const boost::asio::ip::udp::endpoint& source, const ClientHello& hello, U32 timestamp) const {
+    // The cookie is only good for the same source and the same request
+    auto message = AddressBytes(source.address());
+    const auto fileNameSize = strnlen(hello.fileName, sizeof(hello.fileName));
+    const auto fixedSize = message.size();
+    message.resize(fixedSize + sizeof(U16) + sizeof(U32) + sizeof(U8) + sizeof(U16) + sizeof(U32) + fileNameSize);
+
+    framing::Writer writer(std::span{message}.subspan(fixedSize));
+    writer.Put(source.port()).Put(timestamp).Put(hello.version).Put(hello.windowInMessages).Put(hello.startChunk);
+    writer.PutBytes({hello.fileName, fileNameSize});
+
+    return Sign(message);
+}
+
+CookieGenerator::Mac CookieGenerator::Compute(const boost::asio::ip::udp::endpoint& source, U16 sessionId, U32 timestamp) const {
+    // Another message type in front, so a multicast cookie can never pass as one for a ClientHello
+    auto message = AddressBytes(source.address());
+    const auto fixedSize = message.size();
+    message.resize(fixedSize + sizeof(U8) + sizeof(U16) + sizeof(U32) + sizeof(U16));
+
+    framing::Writer writer(std::span{message}.subspan(fixedSize));
+    writer.Put(static_cast<U8>(MessageType::kNack)).Put(source.port()).Put(timestamp).Put(sessionId);
+
+    return Sign(message);
+}
+
+CookieGenerator::Mac CookieGenerator::Sign(std::span<const char> message) const {
+    // HMAC-SHA256, the secret is shorter than the block size
+    std::array<U8, HMAC_BLOCK_SIZE> innerPad{};
+    std::array<U8, HMAC_BLOCK_SIZE> outerPad{};
+    for (size_t i = 0; i < HMAC_BLOCK_SIZE; ++i) {
+        const U8 key = i < secret_.size() ? secret_[i] : 0;
+        innerPad[i] = key ^ 0x36;
+        outerPad[i] = key ^ 0x5C;
+    }
+
+    Mac inner{};
+    SHA256 innerHash;
+    innerHash.add(innerPad.data(), innerPad.size());
+    innerHash.add(message.data(), message.size());
+    innerHash.getHash(inner.data());
+
+    Mac outer{};
+    SHA256 outerHash;
+    outerHash.add(outerPad.data(), outerPad.size());
+    outerHash.add(inner.data(), inner.size());
+    outerHash.getHash(outer.data());
+
+    return outer;
+}
+
+U32 CookieGenerator::Now() noexcept {
+    return static_cast<U32>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+HelloRateLimiter::HelloRateLimiter(double hellosPerSecond, double burst, size_t buckets)
+    : rate_(hellosPerSecond),
+      burst_(std::max(burst, 1.0)),
+      seed_(std::random_device{}() | (static_cast<U64>(std::random_device{}()) << 32)),
+      buckets_(std::max<size_t>(buckets, 1)) {
+}
+
+bool HelloRateLimiter::Allow(const boost::asio::ip::address& address, std::chrono::steady_clock::time_point now) noexcept {
+    auto& bucket = buckets_[Index(address)];
+
+    // Buckets that were never used start out full
+    const auto elapsed = std::chrono::duration<double>(now - bucket.lastRefill).count();
+    bucket.tokens = bucket.lastRefill == std::chrono::steady_clock::time_point{} ? burst_ : std::min(burst_, bucket.tokens + elapsed * rate_);
+    bucket.lastRefill = now;
+
+    if (bucket.tokens < 1.0) {
+        return false;
+    }
+
+    bucket.tokens -= 1.0;
+    return true;
+}
+
+size_t HelloRateLimiter::Index(const boost::asio::ip::address& address) const noexcept {
+    // FNV-1a, keyed with a random seed so that nobody can pick addresses that share a bucket with their victim
+    U64 hash = 0xCBF29CE484222325ull ^ seed_;
+    const auto mix = [&hash](U8 byte) {
+        hash ^= byte;
+        hash *= 0x100000001B3ull;
+    };
+
+    if (address.is_v4()) {
+        for (const auto byte : address.to_v4().to_bytes()) {
+            mix(byte);
+        }
+    } else {
+        for (const auto byte : address.to_v6().to_bytes()) {
+            mix(byte);
+        }
+    }
+
+    return static_cast<size_t>(hash % buckets_.size());
+}
+
+} // namespace rft
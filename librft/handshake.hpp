@@ -0,0 +1,91 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <span>
+
+#include <boost/asio.hpp>
+
+#include "messages.hpp"
+
+// Protection of the server's handshake. A ClientHello only makes the server allocate a stream, open a file and hash it once the client has proven that
+// it can receive at its source address: the first ClientHello is answered statelessly with a HelloRetry carrying a cookie (an HMAC over the source
+// address, a timestamp and the request), and only a ClientHello that echoes a valid cookie commits a stream. On top of that, every source address may
+// only send so many ClientHellos per second.
+
+namespace rft {
+
+struct HandshakeOptions {
+    // If false, every well-formed ClientHello commits a stream right away (the old behavior)
+    bool requireCookie = true;
+    std::chrono::seconds cookieLifetime{30};
+    // Per source address
+    double hellosPerSecond = 20.0;
+    double helloBurst = 40.0;
+    // The most a client may delay its ACKs, whatever it proposes
+    AckFrequency ackFrequencyLimit{16, 25000};
+    // Send the ServerHello right away and the digest in the FinMessage, hashing the file on the way. Otherwise the whole file is hashed before the
+    // ServerHello, which for large, cold files takes longer than clients wait.
+    bool digestInFin = true;
+    // Send runs of all-zero chunks as ZeroRangeMessages to clients that support them. Never used for encrypted streams.
+    bool allowZeroRanges = true;
+    // Encryption of chunk payloads, see chunk_cipher.hpp. Clients opt in by sending a key share, unless the server requires it.
+    bool allowEncryption = true;
+    bool requireEncryption = false;
+    // Mixed into the keys of encrypted streams. Without it, the key exchange is not authenticated.
+    std::string preSharedKey;
+};
+
+class CookieGenerator {
+public:
+    // Draws a random secret, so cookies don't survive a restart of the server
+    explicit CookieGenerator(std::chrono::seconds lifetime);
+
+    Cookie Make(const boost::asio::ip::udp::endpoint& source, const ClientHello& hello) const;
+
+    // Checks the MAC in constant time and that the cookie isn't older than the lifetime
+    bool Verify(const boost::asio::ip::udp::endpoint& source, const ClientHello& hello, const Cookie& cookie) const;
+
+    // The same for the receivers of a multicast session, which prove their address before they get unicast repairs
+    Cookie Make(const boost::asio::ip::udp::endpoint& source, U16 sessionId) const;
+    bool Verify(const boost::asio::ip::udp::endpoint& source, U16 sessionId, const Cookie& cookie) const;
+
+private:
+    using Mac = std::array<U8, 32>;
+
+    static Cookie Truncate(U32 timestamp, const Mac& mac) noexcept;
+    bool Fresh(const Cookie& cookie) const noexcept;
+    static bool Matches(const Cookie& cookie, const Mac& expected) noexcept;
+    Mac Compute(const boost::asio::ip::udp::endpoint& source, const ClientHello& hello, U32 timestamp) const;
+    Mac Compute(const boost::asio::ip::udp::endpoint& source, U16 sessionId, U32 timestamp) const;
+    Mac Sign(std::span<const char> message) const;
+
+    static U32 Now() noexcept;
+
+    std::array<U8, 32> secret_{};
+    std::chrono::seconds lifetime_;
+};
+
+// Token buckets per source address. The buckets live in a fixed-size table indexed by a keyed hash of the address, so a flood from many (spoofed)
+// addresses can't make it grow. Addresses that happen to collide share a bucket.
+class HelloRateLimiter {
+public:
+    HelloRateLimiter(double hellosPerSecond, double burst, size_t buckets = 4096);
+
+    bool Allow(const boost::asio::ip::address& address, std::chrono::steady_clock::time_point now) noexcept;
+
+private:
+    struct Bucket {
+        double tokens = 0.0;
+        std::chrono::steady_clock::time_point lastRefill{};
+    };
+
+    size_t Index(const boost::asio::ip::address& address) const noexcept;
+
+    double rate_;
+    double burst_;
+    U64 seed_;
+    std::vector<Bucket> buckets_;
+};
+
+} // namespace rft
@@ -1,5 +1,5 @@
 #include "pch.hpp"
-#include "Logger.hpp"
+#include "logger.hpp"
 
 #include <boost/log/utility/setup/formatter_parser.hpp>
 #include <boost/log/utility/setup/console.hpp>
@@ -9,6 +9,7 @@
 #include <boost/log/expressions/formatters/auto_newline.hpp>
 #include <boost/log/expressions/formatters/if.hpp>
 #include <boost/log/expressions/predicates/is_in_range.hpp>
+#include <boost/log/expressions/attr.hpp>
 #include <boost/log/expressions/formatters/wrap_formatter.hpp>
 #include <boost/log/attributes/attribute.hpp>
 #include <boost/log/attributes/attribute_value.hpp>
@@ -105,4 +106,13 @@ gLogger::logger_type gLogger::construct_logger() {
     return lg;
 }
 
+namespace log {
+
+void SetMinimumSeverity(Severity severity) {
+    detail::gMinimumSeverity.store(severity, std::memory_order_relaxed);
+    boost::log::core::get()->set_filter(expr::attr<Severity>("Severity") >= severity);
+}
+
+} // namespace log
+
 } // namespace prcd::log
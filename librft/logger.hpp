@@ -1,5 +1,7 @@
 #pragma once
 
+#include "pch.hpp"
+
 #include <format>
 
 //#define BOOST_USE_WINAPI_VERSION BOOST_WINAPI_VERSION_WIN7
@@ -8,6 +10,11 @@
 #include <boost/log/sources/global_logger_storage.hpp>
 #include <boost/log/sources/severity_channel_logger.hpp>
 
+// Everything below this severity is stripped at compile time. Release builds set this to kDebug, so that the per-chunk trace calls don't cost anything.
+#ifndef RFT_LOG_MIN_LEVEL
+#define RFT_LOG_MIN_LEVEL 0
+#endif
+
 namespace rft {
 enum Severity {
     kTrace,
@@ -31,11 +38,89 @@ constexpr std::basic_ostream<CharT, TraitsT>& operator<<(std::basic_ostream<Char
 }
 
 BOOST_LOG_GLOBAL_LOGGER(gLogger, boost::log::sources::severity_channel_logger_mt<Severity>)
-} // namespace prcd::log
-
-#define LOG_FATAL(...) BOOST_LOG_SEV(rft::gLogger::get(), rft::Severity::kFatal) << std::format(##__VA_ARGS__)
-#define LOG_ERROR(...) BOOST_LOG_SEV(rft::gLogger::get(), rft::Severity::kError) << std::format(##__VA_ARGS__)
-#define LOG_WARNING(...) BOOST_LOG_SEV(rft::gLogger::get(), rft::Severity::kWarning) << std::format(##__VA_ARGS__)
-#define LOG_INFO(...) BOOST_LOG_SEV(rft::gLogger::get(), rft::Severity::kInfo) << std::format(##__VA_ARGS__)
-#define LOG_DEBUG(...) BOOST_LOG_SEV(rft::gLogger::get(), rft::Severity::kDebug) << std::format(##__VA_ARGS__)
-#define LOG_TRACE(...) BOOST_LOG_SEV(rft::gLogger::get(), rft::Severity::kTrace) << std::format(##__VA_ARGS__)
+
+namespace log {
+
+// A log record as it travels from the producing thread to the logging thread. The message is formatted by the producer (we can't keep references to the
+// arguments around), everything else (timestamps, colors, thread names) is only done on the logging thread.
+struct LogRecord {
+    constexpr static size_t MAX_MESSAGE_SIZE = 232;
+
+    std::chrono::system_clock::time_point timestamp;
+    Severity severity;
+    U16 length;
+    std::array<char, MAX_MESSAGE_SIZE> message;
+};
+
+struct AsyncLoggingOptions {
+    // If empty, we log to the console
+    std::filesystem::path file{};
+    Severity minimumSeverity = kTrace;
+    std::chrono::milliseconds flushInterval{50};
+};
+
+inline std::optional<Severity> ParseSeverity(std::string_view name) {
+    constexpr static auto NAMES = std::array{"trace", "debug", "info", "warning", "error", "fatal"};
+
+    for (size_t i = 0; i < NAMES.size(); ++i) {
+        if (name == NAMES[i]) {
+            return static_cast<Severity>(i);
+        }
+    }
+
+    return std::nullopt;
+}
+
+// Applies to both the synchronous Boost.Log path and the asynchronous backend. StartAsyncLogging() overrides it with its options.
+void SetMinimumSeverity(Severity severity);
+
+void StartAsyncLogging(AsyncLoggingOptions options = {});
+void StopAsyncLogging();
+
+namespace detail {
+extern std::atomic<bool> gAsyncEnabled;
+extern std::atomic<int> gMinimumSeverity;
+
+// Pushes the record into the ring of the calling thread. Never blocks, if the ring is full the record is dropped and counted.
+void Submit(const LogRecord& record) noexcept;
+}
+
+inline bool IsAsyncLoggingEnabled() noexcept {
+    return detail::gAsyncEnabled.load(std::memory_order_relaxed);
+}
+
+template <typename... Args>
+void Push(Severity severity, std::format_string<Args...> format, Args&&... args) {
+    if (severity < detail::gMinimumSeverity.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    LogRecord record;
+    record.timestamp = std::chrono::system_clock::now();
+    record.severity = severity;
+    const auto result = std::format_to_n(record.message.data(), record.message.size(), format, std::forward<Args>(args)...);
+    record.length = static_cast<U16>(std::min<size_t>(result.size, record.message.size()));
+
+    detail::Submit(record);
+}
+
+} // namespace log
+} // namespace rft
+
+#define RFT_LOG(severity, ...)                                                                \
+    do {                                                                                      \
+        if constexpr ((severity) >= RFT_LOG_MIN_LEVEL) {                                      \
+            if (rft::log::IsAsyncLoggingEnabled()) {                                          \
+                rft::log::Push((severity), __VA_ARGS__);                                      \
+            } else {                                                                          \
+                BOOST_LOG_SEV(rft::gLogger::get(), (severity)) << std::format(__VA_ARGS__);   \
+            }                                                                                 \
+        }                                                                                     \
+    } while (false)
+
+#define LOG_FATAL(...) RFT_LOG(rft::Severity::kFatal, __VA_ARGS__)
+#define LOG_ERROR(...) RFT_LOG(rft::Severity::kError, __VA_ARGS__)
+#define LOG_WARNING(...) RFT_LOG(rft::Severity::kWarning, __VA_ARGS__)
+#define LOG_INFO(...) RFT_LOG(rft::Severity::kInfo, __VA_ARGS__)
+#define LOG_DEBUG(...) RFT_LOG(rft::Severity::kDebug, __VA_ARGS__)
+#define LOG_TRACE(...) RFT_LOG(rft::Severity::kTrace, __VA_ARGS__)
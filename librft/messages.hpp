@@ -9,10 +9,20 @@ enum class MessageType: U8 {
     kServerHello = 0x2,
     kAck = 0x3,
     kFin = 0x4,
+    kHelloRetry = 0x5,
+    kMulticastAnnounce = 0x6,
+    kNack = 0x7,
+    kZeroRange = 0x8,
     kError = 0xFF,
     kChunk = 0x00
 };
 
+// The largest datagram we send or expect to receive: 1024 bytes minus the UDP header
+constexpr static size_t MAX_DATAGRAM_SIZE = 1024 - 8;
+
+// These structs describe the wire layout of every message (all integers are little-endian). Messages are not sent by copying the structs, see framing.hpp.
+// The last member of ClientHello, ErrorMessage and ChunkMessage is variable-length on the wire: only the bytes actually in use are sent.
+
 #ifdef _MSC_VER
 #pragma pack(push, 1)
 #endif
@@ -25,46 +35,152 @@ struct PACKED MessageBase {
 
 constexpr static size_t MAX_FILENAME_SIZE = 1024 - 8 /* UDP Frame*/ - 1 - 1 - 1 - 2 - 4 - sizeof(MessageBase);
 struct PACKED ClientHello final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kClientHello;
+
     U8 version;
     U8 nextHeaderType;
     U8 nextHeaderOffset;
     U16 windowInMessages;
     U32 startChunk;
+    // 0-terminated in memory, on the wire the terminator is not sent
     char fileName[MAX_FILENAME_SIZE];
 };
 static_assert(sizeof(ClientHello) + 8 == 1024);
 
+// nextHeaderType is a set of the flags below. The headers it names sit between the fixed fields of a hello and its variable part (if any), in the order of
+// their flags, and take up nextHeaderOffset bytes together. Peers skip headers they don't know.
+constexpr static U8 NEXT_HEADER_COOKIE = 0x1;
+constexpr static U8 NEXT_HEADER_ACK_FREQUENCY = 0x2;
+constexpr static U8 NEXT_HEADER_KEY_SHARE = 0x4;
+// Takes no bytes. In a ClientHello it says that the client understands ZeroRangeMessages, in the ServerHello that the server will send them.
+constexpr static U8 NEXT_HEADER_ZERO_RANGES = 0x8;
+
+constexpr static size_t COOKIE_MAC_SIZE = 16;
+struct PACKED Cookie {
+    // Seconds, as chosen by the server
+    U32 timestamp;
+    std::array<U8, COOKIE_MAC_SIZE> mac;
+};
+
+// Sent by the server instead of a ServerHello if a ClientHello didn't carry a valid cookie. The client repeats its ClientHello with the cookie as next
+// header. The server doesn't keep any state until then.
+struct PACKED HelloRetry final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kHelloRetry;
+
+    Cookie cookie;
+};
+
+// The receiver of data ACKs at least every ackEvery in-order datagrams and holds an ACK back for at most maxDelayMicroseconds. The client proposes it in its
+// ClientHello, the server answers with what it accepts in its ServerHello. Without an answer, every datagram is ACKed.
+struct PACKED AckFrequency {
+    U8 ackEvery;
+    U32 maxDelayMicroseconds;
+};
+
+// An ephemeral X25519 public key. A client that wants its chunks encrypted sends one in its ClientHello, and the server answers with its own in the
+// ServerHello, see chunk_cipher.hpp. Without the server's key share, the chunks are sent in clear text.
+struct PACKED KeyShare {
+    std::array<U8, 32> publicKey;
+};
+
 struct PACKED ServerHello final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kServerHello;
+
     U8 version;
     U8 nextHeaderType;
     U8 nextHeaderOffset;
     U16 windowInMessages;
+    // All zeros if the digest follows in the FinMessage
     std::array<U64, 4> checksum;
     I64 lastModified;
     U64 fileSizeInBytes;
+    // Room for the next headers, only the ones in use are sent
+    std::array<U8, sizeof(AckFrequency) + sizeof(KeyShare)> nextHeader;
 };
 
 struct PACKED AckMessage final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kAck;
+
     U16 windowInMessages;
     U64 ackNumber;
 };
 
+// Sent by the server after the last chunk. If the ServerHello went out before the file was hashed (its checksum is all zeros), the digest comes here
+// instead. Senders that don't have a digest send the header only.
 struct PACKED FinMessage final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kFin;
+
+    std::array<U64, 4> checksum;
 };
 
+// ErrorMessage::errorCategory and errorCode. Errors about a ClientHello have stream ID 0 and sequence number 0, like the ServerHello they replace.
+constexpr static U8 ERROR_CATEGORY_REQUEST = 0x1;
+constexpr static U8 ERROR_FILE_NAME_REJECTED = 0x1;
+constexpr static U8 ERROR_FILE_NOT_AVAILABLE = 0x2;
+
+constexpr static size_t MAX_ERROR_MESSAGE_SIZE = MAX_DATAGRAM_SIZE - 1 - 1 - sizeof(MessageBase);
 struct PACKED ErrorMessage final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kError;
+
     U8 errorCategory;
     U8 errorCode;
-    std::string message;
+    // Not 0-terminated, the length is given by the datagram size
+    std::array<char, MAX_ERROR_MESSAGE_SIZE> message;
 };
+static_assert(sizeof(ErrorMessage) == MAX_DATAGRAM_SIZE);
 
 struct PACKED ChunkMessage final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kChunk;
+
+    // The authentication tag of the payload if the stream is encrypted, unused otherwise
     std::array<U8, 8> checksum;
     std::array<U8, 997> payload;
 };
 
 static_assert(sizeof(ChunkMessage) + 8 == 1024);
 
+// Sent by the server instead of a run of chunks that only hold zeros (holes of sparse files, zero-filled regions of disk images), if both sides agreed
+// on it in the hellos. It takes the place of the chunks in the stream, the client recreates them without writing anything.
+struct PACKED ZeroRangeMessage final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kZeroRange;
+
+    U64 firstChunk;
+    U64 chunkCount;
+};
+
+// Multicast distribution (see multicast.hpp) reuses ChunkMessage and FinMessage: their stream ID is the session ID, the sequence number of a chunk is its
+// index in the file, and the sequence number of a FinMessage is the round it ends.
+
+constexpr static size_t MAX_ANNOUNCED_FILENAME_SIZE = MAX_DATAGRAM_SIZE - sizeof(MessageBase) - 32 - 8 - 8;
+// Sent by a multicast sender to its group before the first chunk and again every so often, so that receivers that join late learn what is being sent
+struct PACKED MulticastAnnounce final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kMulticastAnnounce;
+
+    std::array<U64, 4> checksum;
+    I64 lastModified;
+    U64 fileSizeInBytes;
+    // 0-terminated in memory, on the wire the terminator is not sent
+    char fileName[MAX_ANNOUNCED_FILENAME_SIZE];
+};
+static_assert(sizeof(MulticastAnnounce) == MAX_DATAGRAM_SIZE);
+
+struct PACKED NackRange {
+    U64 firstChunk;
+    U32 chunkCount;
+};
+
+constexpr static size_t MAX_NACK_RANGES = (MAX_DATAGRAM_SIZE - sizeof(MessageBase) - 1 - sizeof(Cookie)) / sizeof(NackRange);
+// Sent by a multicast receiver to the sender (unicast) after a round, listing the chunks it is still missing. The sequence number is the round. The
+// cookie is the one the sender last sent this receiver in a HelloRetry, all zeros before that. Only receivers with a valid cookie get unicast repairs.
+struct PACKED NackMessage final : MessageBase {
+    constexpr static MessageType TYPE = MessageType::kNack;
+
+    U8 rangeCount;
+    Cookie cookie;
+    // Only the first rangeCount ranges are sent
+    std::array<NackRange, MAX_NACK_RANGES> ranges;
+};
+
 }
 
 #ifdef _MSC_VER
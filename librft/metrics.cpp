@@ -0,0 +1,96 @@
+#include "pch.hpp"
+#include "metrics.hpp"
+
+namespace rft::metrics {
+
+void StreamMetrics::WriteJson(std::string& out) const {
+    std::format_to(std::back_inserter(out),
+                   R"({{"id":{},"role":"{}","datagramsSent":{},"bytesSent":{},"datagramsReceived":{},"bytesReceived":{},"chunksSent":{},"chunksReceived":{},)"
+                   R"("zeroChunksSent":{},"zeroChunksReceived":{},"acksSent":{},"duplicateAcksSent":{},"acksCoalesced":{},"delayedAcksFlushed":{},"acksReceived":{},"outOfOrderReceived":{},)"
+                   R"("receiveBufferDrops":{},"cwnd":{},"ssthresh":{},"handshakeUs":{}}})",
+                   streamId.load(std::memory_order_relaxed), role, datagramsSent.Load(), bytesSent.Load(), datagramsReceived.Load(), bytesReceived.Load(),
+                   chunksSent.Load(), chunksReceived.Load(), zeroChunksSent.Load(), zeroChunksReceived.Load(), acksSent.Load(), duplicateAcksSent.Load(), acksCoalesced.Load(), delayedAcksFlushed.Load(),
+                   acksReceived.Load(), outOfOrderReceived.Load(), receiveBufferDrops.Load(), congestionWindow.Load(), slowStartThreshold.Load(),
+                   handshakeMicroseconds.Load());
+}
+
+void EndpointMetrics::WriteJson(std::string& out) const {
+    std::format_to(std::back_inserter(out),
+                   R"({{"datagramsReceived":{},"bytesReceived":{},"datagramsSent":{},"bytesSent":{},"malformedDatagrams":{},"unknownStreamDatagrams":{},)"
+                   R"("streamIdsExhausted":{},"hellosRateLimited":{},"cookiesIssued":{},"cookiesRejected":{},"hellosUnpadded":{},"statelessSendFailures":{},)"
+                   R"("fileNamesRejected":{},"filesUnavailable":{},"streamsOpened":{},"streamsClosed":{},"streamsTimedOut":{},"activeStreams":{},)"
+                   R"("transmitBatches":{},"egressThrottled":{},"nacksSent":{},"nacksReceived":{},"multicastRepairs":{},"unicastRepairs":{},)"
+                   R"("handshakesCompleted":{},"handshakeUs":{}}})",
+                   datagramsReceived.Load(), bytesReceived.Load(), datagramsSent.Load(), bytesSent.Load(), malformedDatagrams.Load(), unknownStreamDatagrams.Load(),
+                   streamIdsExhausted.Load(), hellosRateLimited.Load(), cookiesIssued.Load(), cookiesRejected.Load(), hellosUnpadded.Load(),
+                   statelessSendFailures.Load(), fileNamesRejected.Load(), filesUnavailable.Load(), streamsOpened.Load(), streamsClosed.Load(),
+                   streamsTimedOut.Load(), activeStreams.Load(), transmitBatches.Load(), egressThrottled.Load(), nacksSent.Load(), nacksReceived.Load(),
+                   multicastRepairs.Load(), unicastRepairs.Load(), handshakesCompleted.Load(), handshakeMicroseconds.Load());
+}
+
+void FileCacheMetrics::WriteJson(std::string& out) const {
+    std::format_to(std::back_inserter(out),
+                   R"({{"fileOpens":{},"sharedOpens":{},"openFiles":{},"blockHits":{},"blockMisses":{},"coalescedReads":{},"evictions":{},"bytesReadFromDisk":{},)"
+                   R"("residentBlocks":{},"residentBytes":{},"smallFileReads":{},"smallFileDigestHits":{}}})",
+                   fileOpens.Load(), sharedOpens.Load(), openFiles.Load(), blockHits.Load(), blockMisses.Load(), coalescedReads.Load(), evictions.Load(),
+                   bytesReadFromDisk.Load(), residentBlocks.Load(), residentBytes.Load(), smallFileReads.Load(), smallFileDigestHits.Load());
+}
+
+std::shared_ptr<StreamMetrics> MetricsRegistry::RegisterStream(U16 streamId, std::string_view role) {
+    auto metrics = std::make_shared<StreamMetrics>(streamId, role);
+
+    std::scoped_lock lock(mutex_);
+    streams_.push_back(metrics);
+    return metrics;
+}
+
+std::string MetricsRegistry::Snapshot() const {
+    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::string out;
+    std::format_to(std::back_inserter(out), R"({{"timestamp":{},"name":"{}","endpoint":)", now, name_);
+    endpoint_.WriteJson(out);
+    if (fileCache_ != nullptr) {
+        out += R"(,"fileCache":)";
+        fileCache_->WriteJson(out);
+    }
+    out += R"(,"streams":[)";
+
+    {
+        std::scoped_lock lock(mutex_);
+        std::erase_if(streams_, [](const auto& stream) { return stream.expired(); });
+
+        bool first = true;
+        for (const auto& weak : streams_) {
+            if (const auto stream = weak.lock()) {
+                if (!first) {
+                    out += ',';
+                }
+                first = false;
+                stream->WriteJson(out);
+            }
+        }
+    }
+
+    out += "]}";
+    return out;
+}
+
+boost::asio::awaitable<void> ReportPeriodically(const MetricsRegistry& registry, std::ostream& output, std::chrono::milliseconds interval) {
+    // Otherwise we would write snapshots as fast as we can
+    if (interval <= std::chrono::milliseconds::zero()) {
+        throw std::invalid_argument{std::format("The metrics interval has to be positive, not {}ms.", interval.count())};
+    }
+
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+
+    for (;;) {
+        timer.expires_after(interval);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+
+        output << registry.Snapshot() << '\n';
+        output.flush();
+    }
+}
+
+} // namespace rft::metrics
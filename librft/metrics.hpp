@@ -0,0 +1,190 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <mutex>
+#include <ostream>
+
+#include <boost/asio.hpp>
+
+namespace rft::metrics {
+
+// All metrics are plain relaxed atomics. They are only ever read by the snapshot writer, so we don't need any ordering guarantees, and updating them from
+// the hot path is as cheap as an uncontended increment.
+class Counter {
+public:
+    void Add(U64 value = 1) noexcept {
+        value_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    U64 Load() const noexcept {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<U64> value_{0};
+};
+
+class Gauge {
+public:
+    void Set(I64 value) noexcept {
+        value_.store(value, std::memory_order_relaxed);
+    }
+
+    void Add(I64 value = 1) noexcept {
+        value_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void Sub(I64 value = 1) noexcept {
+        value_.fetch_sub(value, std::memory_order_relaxed);
+    }
+
+    I64 Load() const noexcept {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<I64> value_{0};
+};
+
+// Per stream metrics. Each stream gets its own cache line(s), so that streams running on different threads don't false-share.
+struct alignas(64) StreamMetrics {
+    StreamMetrics() = default;
+    StreamMetrics(U16 streamId, std::string_view role) noexcept
+        : streamId(streamId),
+          role(role) {
+    }
+
+    // The client only learns its stream ID with the ServerHello, so this might change once
+    std::atomic<U16> streamId{0};
+    std::string_view role = "stream";
+
+    // Socket level
+    Counter datagramsSent;
+    Counter bytesSent;
+    Counter datagramsReceived;
+    Counter bytesReceived;
+
+    // Stream level
+    Counter chunksSent;
+    Counter chunksReceived;
+    // Chunks that went as part of a ZeroRangeMessage instead
+    Counter zeroChunksSent;
+    Counter zeroChunksReceived;
+
+    // Congestion control
+    Counter acksSent;
+    Counter duplicateAcksSent;
+    // In-order datagrams whose ACK was left to a later one, and ACKs that were sent because they were held back for too long
+    Counter acksCoalesced;
+    Counter delayedAcksFlushed;
+    Counter acksReceived;
+    Counter outOfOrderReceived;
+    Counter receiveBufferDrops;
+    Gauge congestionWindow;
+    Gauge slowStartThreshold;
+
+    // Time from sending the ClientHello until the ServerHello arrived (client only)
+    Gauge handshakeMicroseconds;
+
+    void WriteJson(std::string& out) const;
+};
+
+struct alignas(64) EndpointMetrics {
+    Counter datagramsReceived;
+    Counter bytesReceived;
+    Counter datagramsSent;
+    Counter bytesSent;
+    Counter malformedDatagrams;
+    Counter unknownStreamDatagrams;
+    Counter streamIdsExhausted;
+    // Handshake protection (server only)
+    Counter hellosRateLimited;
+    Counter cookiesIssued;
+    Counter cookiesRejected;
+    // ClientHellos too short to be answered with a HelloRetry
+    Counter hellosUnpadded;
+    // HelloRetries and errors that couldn't be sent, e.g. to forged source addresses
+    Counter statelessSendFailures;
+    // ClientHellos for names outside of the root directory (server only)
+    Counter fileNamesRejected;
+    // ClientHellos for files that don't exist or can't be opened (server only)
+    Counter filesUnavailable;
+    Counter streamsOpened;
+    Counter streamsClosed;
+    // Streams whose client went silent (server only)
+    Counter streamsTimedOut;
+    Gauge activeStreams;
+    // Transmit scheduler (server only)
+    Counter transmitBatches;
+    Counter egressThrottled;
+    // Multicast distribution. Receivers send NACKs, senders answer them with repairs, to the whole group or to one receiver only.
+    Counter nacksSent;
+    Counter nacksReceived;
+    Counter multicastRepairs;
+    Counter unicastRepairs;
+
+    // Summed up over all completed handshakes, so that the mean handshake latency can be derived
+    Counter handshakesCompleted;
+    Counter handshakeMicroseconds;
+
+    void WriteJson(std::string& out) const;
+};
+
+// Filled in by the server's FileCache
+struct alignas(64) FileCacheMetrics {
+    Counter fileOpens;
+    // Opens that could reuse a handle some other stream already had open
+    Counter sharedOpens;
+    Gauge openFiles;
+
+    Counter blockHits;
+    Counter blockMisses;
+    // Lookups that found the block still being read by another stream and waited for it instead of reading it again
+    Counter coalescedReads;
+    Counter evictions;
+    Counter bytesReadFromDisk;
+    Gauge residentBlocks;
+    Gauge residentBytes;
+
+    // Small files that were served in one piece, and how often their digest was already known
+    Counter smallFileReads;
+    Counter smallFileDigestHits;
+
+    void WriteJson(std::string& out) const;
+};
+
+// Owns the endpoint wide metrics and knows about all live streams. Streams only register once, so the mutex is never on the per-packet path.
+class MetricsRegistry {
+public:
+    explicit MetricsRegistry(std::string_view name) noexcept
+        : name_(name) {
+    }
+
+    EndpointMetrics& Endpoint() noexcept {
+        return endpoint_;
+    }
+
+    std::shared_ptr<StreamMetrics> RegisterStream(U16 streamId, std::string_view role);
+
+    // Includes the file cache in every snapshot. The cache has to stay alive as long as snapshots are taken.
+    void AttachFileCache(const FileCacheMetrics* fileCache) noexcept {
+        fileCache_ = fileCache;
+    }
+
+    // A single line of JSON describing the current state
+    std::string Snapshot() const;
+
+private:
+    std::string_view name_;
+    EndpointMetrics endpoint_;
+    const FileCacheMetrics* fileCache_ = nullptr;
+
+    mutable std::mutex mutex_;
+    mutable std::vector<std::weak_ptr<StreamMetrics>> streams_;
+};
+
+// Writes a snapshot of the registry to the stream every interval, until the coroutine is cancelled. Throws if the interval isn't positive.
+boost::asio::awaitable<void> ReportPeriodically(const MetricsRegistry& registry, std::ostream& output, std::chrono::milliseconds interval);
+
+} // namespace rft::metrics
@@ -0,0 +1,523 @@
+#include "pch.hpp"
+#include "multicast.hpp"
+
+#include <boost/asio/experimental/awaitable_operators.hpp>
+
+#include "logger.hpp"
+
+namespace ip = boost::asio::ip;
+
+namespace rft {
+
+namespace {
+
+constexpr size_t BLOCK_READ_SIZE = 1024 * 1024;
+// Waiting for every single datagram would cost more than it saves, the pacer only waits once the sender is this far ahead of its rate
+constexpr auto PACING_SLACK = std::chrono::milliseconds{1};
+constexpr auto SUPERVISOR_TICK = std::chrono::milliseconds{100};
+// Receivers get a fresh cookie whenever theirs has expired, so this only bounds how long a stolen one is good for
+constexpr auto COOKIE_LIFETIME = std::chrono::seconds{60};
+
+U16 RandomSessionId() {
+    std::random_device random;
+    std::uniform_int_distribution<U16> distribution(1, std::numeric_limits<U16>::max());
+    return distribution(random);
+}
+
+} // namespace
+
+MulticastSender::MulticastSender(boost::asio::any_io_executor executor, std::shared_ptr<CachedFile> file, MulticastOptions options,
+                                 metrics::EndpointMetrics& metrics)
+    : socket_(executor, ip::udp::endpoint(options.group.protocol(), 0)),
+      pacer_(executor),
+      file_(std::move(file)),
+      options_(std::move(options)),
+      metrics_(metrics),
+      cookies_(COOKIE_LIFETIME),
+      sessionId_(RandomSessionId()),
+      chunkCount_((file_->Size() + CHUNK_SIZE - 1) / CHUNK_SIZE) {
+    socket_.set_option(ip::multicast::hops(options_.ttl));
+    // Receivers on this host need their copy as well
+    socket_.set_option(ip::multicast::enable_loopback(true));
+    if (options_.interfaceAddress.is_v4()) {
+        socket_.set_option(ip::multicast::outbound_interface(options_.interfaceAddress.to_v4()));
+    }
+}
+
+boost::asio::awaitable<Digest> MulticastSender::HashFile() {
+    if (file_->IsSmall()) {
+        co_return (co_await file_->ReadSmall()).digest;
+    }
+
+    // Goes through the cache, so the blocks are likely still there when we send them
+    DigestBuilder digest;
+    std::vector<char> buffer(std::min<U64>(file_->Size(), BLOCK_READ_SIZE));
+    U64 sizeRead = 0;
+    while (sizeRead < file_->Size()) {
+        const auto actualRead = co_await file_->ReadAt(sizeRead, buffer);
+        if (actualRead == 0) {
+            throw std::runtime_error{std::format("{} is shorter than expected.", file_->Path().string())};
+        }
+        digest.Add({buffer.data(), actualRead});
+        sizeRead += actualRead;
+    }
+
+    co_return digest.Finish();
+}
+
+boost::asio::awaitable<void> MulticastSender::Announce() {
+    MulticastAnnounce announce{};
+    static_cast<MessageBase&>(announce) = MessageBase{sessionId_, MessageType::kMulticastAnnounce, 0};
+    announce.checksum = digest_;
+    announce.lastModified = file_->LastModified();
+    announce.fileSizeInBytes = file_->Size();
+
+    const auto fileName = file_->Path().filename().string();
+    if (fileName.empty() || fileName.size() >= sizeof(announce.fileName)) {
+        throw std::invalid_argument{std::format("The file name {} can't be announced, it has to be between 1 and {} bytes.", fileName, sizeof(announce.fileName) - 1)};
+    }
+    std::ranges::copy(fileName, announce.fileName);
+
+    co_await SendPaced(framing::Serialize(announce), options_.group);
+}
+
+boost::asio::awaitable<void> MulticastSender::SendChunk(U64 index, const ip::udp::endpoint& destination) {
+    if (++chunksSinceAnnounce_ >= options_.announceEvery) {
+        chunksSinceAnnounce_ = 0;
+        co_await Announce();
+    }
+
+    // The last chunk only carries what is left of the file
+    const size_t payloadSize = std::min<U64>(CHUNK_SIZE, file_->Size() - index * CHUNK_SIZE);
+    auto datagram = framing::SerializeChunkHeader(MessageBase{sessionId_, MessageType::kChunk, index}, {0}, payloadSize);
+    if (co_await file_->ReadAt(index * CHUNK_SIZE, framing::ChunkPayload(datagram)) != payloadSize) {
+        throw std::runtime_error{std::format("Could not read chunk {} of {}.", index, file_->Path().string())};
+    }
+
+    co_await SendPaced(datagram, destination);
+}
+
+boost::asio::awaitable<void> MulticastSender::SendPaced(const std::vector<char>& datagram, const ip::udp::endpoint& destination) {
+    const auto now = Clock::now();
+    if (nextSend_ > now + PACING_SLACK) {
+        pacer_.expires_at(nextSend_);
+        co_await pacer_.async_wait(boost::asio::use_awaitable);
+    }
+
+    // After a pause (like the NACK window) this allows a burst of at most the slack
+    const auto sendTime = std::chrono::duration<double>(static_cast<double>(datagram.size()) / options_.bytesPerSecond);
+    nextSend_ = std::max(nextSend_, now - PACING_SLACK) + std::chrono::duration_cast<Clock::duration>(sendTime);
+
+    const auto size = co_await socket_.async_send_to(boost::asio::buffer(datagram), destination, boost::asio::use_awaitable);
+    metrics_.datagramsSent.Add();
+    metrics_.bytesSent.Add(size);
+}
+
+boost::asio::awaitable<std::vector<MulticastSender::Repair>> MulticastSender::CollectNacks() {
+    using namespace boost::asio::experimental::awaitable_operators;
+
+    // What one source asked for in this round, as ranges [first, end). A forged NACK names up to 2^32 chunks per range, so nothing here is per chunk.
+    struct Source {
+        ip::udp::endpoint endpoint;
+        bool proven = false;
+        bool challenged = false;
+        U64 claimed = 0;
+        std::vector<std::pair<U64, U64>> ranges;
+    };
+    std::map<ip::udp::endpoint, Source> sources;
+
+    boost::asio::steady_timer window(co_await boost::asio::this_coro::executor);
+    window.expires_after(options_.nackWindow);
+
+    std::vector<char> data(MAX_DATAGRAM_SIZE);
+    ip::udp::endpoint endpoint;
+    for (;;) {
+        const auto result = co_await (socket_.async_receive_from(boost::asio::buffer(data), endpoint, boost::asio::use_awaitable) ||
+                                      window.async_wait(boost::asio::use_awaitable));
+        if (result.index() == 1) {
+            break;
+        }
+
+        const auto size = std::get<0>(result);
+        metrics_.datagramsReceived.Add();
+        metrics_.bytesReceived.Add(size);
+
+        // NACKs of earlier rounds that arrive late still name chunks the receiver didn't have
+        const auto nack = framing::Parse<NackMessage>({data.data(), size});
+        if (!nack || nack->streamId != sessionId_) {
+            metrics_.malformedDatagrams.Add();
+            LOG_DEBUG("Multicast session {}: Ignoring a datagram from {}, it is not a NACK for us.", sessionId_, endpoint.address().to_string());
+            continue;
+        }
+        metrics_.nacksReceived.Add();
+
+        auto& source = sources.try_emplace(endpoint, Source{endpoint}).first->second;
+        if (!source.proven && cookies_.Verify(endpoint, sessionId_, nack->cookie)) {
+            source.proven = true;
+        } else if (!source.proven && !source.challenged) {
+            // The NACK is larger than the HelloRetry, so this doesn't amplify anything
+            source.challenged = true;
+            co_await Challenge(endpoint);
+        }
+
+        for (size_t i = 0; i < nack->rangeCount; ++i) {
+            const auto& range = nack->ranges[i];
+            if (range.firstChunk >= chunkCount_ || source.claimed >= options_.maxRepairChunksPerSource) {
+                continue;
+            }
+
+            const auto count = std::min({U64{range.chunkCount}, chunkCount_ - range.firstChunk, options_.maxRepairChunksPerSource - source.claimed});
+            if (count > 0) {
+                source.ranges.emplace_back(range.firstChunk, range.firstChunk + count);
+                source.claimed += count;
+            }
+        }
+    }
+
+    // Sweep over where the (merged) ranges of the sources start and end. Between two edges, the chunks go to the only source that wants them if it is
+    // proven, otherwise to the group.
+    struct Edge {
+        U64 position;
+        bool start;
+        const Source* source;
+    };
+    std::vector<Edge> edges;
+    for (auto& [_, source] : sources) {
+        std::ranges::sort(source.ranges);
+        for (size_t i = 0; i < source.ranges.size();) {
+            const auto first = source.ranges[i].first;
+            auto end = source.ranges[i].second;
+            for (++i; i < source.ranges.size() && source.ranges[i].first <= end; ++i) {
+                end = std::max(end, source.ranges[i].second);
+            }
+            edges.push_back(Edge{first, true, &source});
+            edges.push_back(Edge{end, false, &source});
+        }
+    }
+    // Ends before starts, so a source is never active twice
+    std::ranges::sort(edges, {}, [](const Edge& edge) { return std::pair{edge.position, edge.start}; });
+
+    std::vector<Repair> repairs;
+    std::set<const Source*> active;
+    U64 position = 0;
+    for (const auto& edge : edges) {
+        if (!active.empty() && edge.position > position) {
+            std::optional<ip::udp::endpoint> destination;
+            if (active.size() == 1 && (*active.begin())->proven) {
+                destination = (*active.begin())->endpoint;
+            }
+
+            if (!repairs.empty() && repairs.back().end == position && repairs.back().destination == destination) {
+                repairs.back().end = edge.position;
+            } else {
+                repairs.push_back(Repair{position, edge.position, destination});
+            }
+        }
+
+        position = edge.position;
+        if (edge.start) {
+            active.insert(edge.source);
+        } else {
+            active.erase(edge.source);
+        }
+    }
+
+    co_return repairs;
+}
+
+boost::asio::awaitable<void> MulticastSender::Challenge(const ip::udp::endpoint& source) {
+    const auto retry = framing::Serialize(HelloRetry{sessionId_, MessageType::kHelloRetry, 0, cookies_.Make(source, sessionId_)});
+    try {
+        const auto size = co_await socket_.async_send_to(boost::asio::buffer(retry), source, boost::asio::use_awaitable);
+        metrics_.cookiesIssued.Add();
+        metrics_.datagramsSent.Add();
+        metrics_.bytesSent.Add(size);
+    } catch (const boost::system::system_error& e) {
+        // The source may well be made up, that's no reason to end the session
+        metrics_.statelessSendFailures.Add();
+        LOG_DEBUG("Multicast session {}: Could not send a cookie to {}: {}", sessionId_, source.address().to_string(), e.what());
+    }
+}
+
+boost::asio::awaitable<void> MulticastSender::Run() {
+    // The digest goes out with every announcement, so receivers can verify the file however they got its chunks
+    digest_ = co_await HashFile();
+    LOG_INFO("Multicast session {}: Sending {} ({} bytes in {} chunks, digest {}) to {}:{}.", sessionId_, file_->Path().string(), file_->Size(), chunkCount_,
+             ToHex(digest_), options_.group.address().to_string(), options_.group.port());
+
+    co_await Announce();
+    for (U64 index = 0; index < chunkCount_; ++index) {
+        co_await SendChunk(index, options_.group);
+    }
+
+    for (U64 round = 0;; ++round) {
+        for (unsigned i = 0; i < FIN_REPEATS; ++i) {
+            co_await SendPaced(framing::Serialize(FinMessage{sessionId_, MessageType::kFin, round, digest_}), options_.group);
+        }
+
+        const auto repairs = co_await CollectNacks();
+        if (repairs.empty()) {
+            LOG_INFO("Multicast session {}: No receiver misses anything after round {}, done.", sessionId_, round);
+            co_return;
+        }
+
+        U64 missing = 0;
+        for (const auto& repair : repairs) {
+            missing += repair.end - repair.first;
+        }
+
+        if (round + 1 >= options_.maxRepairRounds) {
+            LOG_WARNING("Multicast session {}: Receivers still miss {} chunks after {} rounds, giving up.", sessionId_, missing, round + 1);
+            co_return;
+        }
+
+        LOG_DEBUG("Multicast session {}: Repairing {} chunks after round {}.", sessionId_, missing, round);
+        for (const auto& repair : repairs) {
+            for (U64 index = repair.first; index < repair.end; ++index) {
+                if (repair.destination) {
+                    co_await SendChunk(index, *repair.destination);
+                    metrics_.unicastRepairs.Add();
+                } else {
+                    co_await SendChunk(index, options_.group);
+                    metrics_.multicastRepairs.Add();
+                }
+            }
+        }
+    }
+}
+
+MulticastReceiver::MulticastReceiver(boost::asio::any_io_executor executor, std::filesystem::path downloadDirectory, MulticastOptions options)
+    : strand_(boost::asio::make_strand(executor)),
+      groupSocket_(strand_),
+      unicastSocket_(strand_, ip::udp::endpoint(options.group.protocol(), 0)),
+      downloadDirectory_(std::move(downloadDirectory)),
+      options_(std::move(options)) {
+    // Every receiver on this host binds the group's port
+    groupSocket_.open(options_.group.protocol());
+    groupSocket_.set_option(ip::udp::socket::reuse_address(true));
+    groupSocket_.bind(ip::udp::endpoint(options_.group.protocol(), options_.group.port()));
+
+    const auto& group = options_.group.address();
+    if (group.is_v4() && options_.interfaceAddress.is_v4()) {
+        groupSocket_.set_option(ip::multicast::join_group(group.to_v4(), options_.interfaceAddress.to_v4()));
+    } else {
+        groupSocket_.set_option(ip::multicast::join_group(group));
+    }
+}
+
+boost::asio::awaitable<std::filesystem::path> MulticastReceiver::Run(std::string fileName) {
+    co_return co_await boost::asio::co_spawn(strand_, RunOnStrand(std::move(fileName)), boost::asio::use_awaitable);
+}
+
+boost::asio::awaitable<std::filesystem::path> MulticastReceiver::RunOnStrand(std::string fileName) {
+    using namespace boost::asio::experimental::awaitable_operators;
+
+    wantedFileName_ = std::move(fileName);
+    lastHeard_ = Clock::now();
+    LOG_INFO("Waiting for an announcement of {} on {}:{}.", wantedFileName_.empty() ? "any file" : wantedFileName_, options_.group.address().to_string(),
+             options_.group.port());
+
+    // Whichever finishes first ends the others: a receive loop or the supervisor once the file is complete, the supervisor if the sender went quiet
+    co_await (ReceiveLoop(groupSocket_) || ReceiveLoop(unicastSocket_) || Supervise());
+    if (!Complete()) {
+        throw std::runtime_error{"The multicast download ended before the file was complete."};
+    }
+
+    file_->close();
+    file_.reset();
+
+    const Digest expected = announce_->checksum;
+    const auto digest = HashDownload();
+    if (digest != expected) {
+        throw std::runtime_error{std::format("{} is corrupt, its digest is {}, but the sender's is {}.", path_.string(), ToHex(digest), ToHex(expected))};
+    }
+
+    LOG_INFO("Multicast session {}: Received and verified {} ({} chunks).", sessionId_, path_.string(), received_.size());
+    co_return path_;
+}
+
+boost::asio::awaitable<void> MulticastReceiver::ReceiveLoop(ip::udp::socket& socket) {
+    std::vector<char> data(MAX_DATAGRAM_SIZE);
+    ip::udp::endpoint source;
+
+    while (!Complete()) {
+        const auto size = co_await socket.async_receive_from(boost::asio::buffer(data), source, boost::asio::use_awaitable);
+        metrics_.Endpoint().datagramsReceived.Add();
+        metrics_.Endpoint().bytesReceived.Add(size);
+
+        co_await Handle({data.data(), size}, source);
+    }
+}
+
+boost::asio::awaitable<void> MulticastReceiver::Handle(std::span<const char> datagram, const ip::udp::endpoint& source) {
+    const auto header = framing::ParseHeader(datagram);
+    if (!header) {
+        metrics_.Endpoint().malformedDatagrams.Add();
+        co_return;
+    }
+
+    if (!announce_) {
+        if (header->messageType == MessageType::kMulticastAnnounce) {
+            if (const auto announce = framing::Parse<MulticastAnnounce>(datagram)) {
+                Adopt(*announce, source);
+            }
+        }
+        // Chunks that were sent before we knew what they belong to are asked for again after the round
+        co_return;
+    }
+
+    if (header->streamId != sessionId_) {
+        metrics_.Endpoint().unknownStreamDatagrams.Add();
+        co_return;
+    }
+    lastHeard_ = Clock::now();
+
+    if (header->messageType == MessageType::kChunk) {
+        if (const auto chunk = framing::ParseChunk(datagram)) {
+            co_await StoreChunk(*chunk);
+        }
+    } else if (header->messageType == MessageType::kHelloRetry && source == sender_) {
+        // Proves that we receive at our address, from now on our repairs may come unicast
+        if (const auto retry = framing::Parse<HelloRetry>(datagram)) {
+            cookie_ = retry->cookie;
+        }
+    } else if (header->messageType == MessageType::kFin && (!lastNackedRound_ || *lastNackedRound_ < header->sequenceNumber)) {
+        lastNackedRound_ = header->sequenceNumber;
+
+        boost::asio::steady_timer jitter(strand_);
+        jitter.expires_after(std::chrono::milliseconds{std::uniform_int_distribution<I64>(0, options_.nackJitter.count())(random_)});
+        co_await jitter.async_wait(boost::asio::use_awaitable);
+
+        co_await SendNacks(header->sequenceNumber);
+    }
+}
+
+void MulticastReceiver::Adopt(const MulticastAnnounce& announce, const ip::udp::endpoint& source) {
+    // Never write outside the download directory, whatever the sender announces
+    const auto fileName = std::filesystem::path{announce.fileName}.filename();
+    if (fileName.empty() || fileName == "." || fileName == "..") {
+        LOG_WARNING("Ignoring the announcement of {} from {}.", announce.fileName, source.address().to_string());
+        return;
+    }
+    if (!wantedFileName_.empty() && fileName != wantedFileName_) {
+        LOG_DEBUG("Ignoring the announcement of {}, we wait for {}.", announce.fileName, wantedFileName_);
+        return;
+    }
+
+    announce_ = announce;
+    sessionId_ = announce.streamId;
+    // Chunks and announcements come from the sender's unicast address, that's where our NACKs go
+    sender_ = source;
+    received_.assign((announce.fileSizeInBytes + CHUNK_SIZE - 1) / CHUNK_SIZE, false);
+    path_ = downloadDirectory_ / fileName;
+
+    file_ = std::make_unique<boost::asio::random_access_file>(strand_, path_.string(),
+                                                              boost::asio::file_base::create | boost::asio::file_base::write_only | boost::asio::file_base::truncate);
+    file_->resize(announce.fileSizeInBytes);
+
+    const Digest digest = announce.checksum;
+    LOG_INFO("Multicast session {}: Receiving {} ({} bytes, digest {}) from {}.", sessionId_, fileName.string(), U64{announce.fileSizeInBytes}, ToHex(digest),
+             source.address().to_string());
+}
+
+boost::asio::awaitable<void> MulticastReceiver::StoreChunk(const framing::ChunkView& chunk) {
+    const auto index = chunk.header.sequenceNumber;
+    if (index >= received_.size() || received_[index]) {
+        co_return;
+    }
+
+    const size_t payloadSize = std::min<U64>(CHUNK_SIZE, announce_->fileSizeInBytes - index * CHUNK_SIZE);
+    if (chunk.payload.size() != payloadSize) {
+        metrics_.Endpoint().malformedDatagrams.Add();
+        LOG_WARNING("Chunk {} has {} bytes, but we expected {} bytes.", index, chunk.payload.size(), payloadSize);
+        co_return;
+    }
+
+    // While we wait for the write, the other loop may store the same chunk. Writing it twice is harmless, counting it twice is not.
+    co_await boost::asio::async_write_at(*file_, index * CHUNK_SIZE, boost::asio::buffer(chunk.payload.data(), payloadSize), boost::asio::use_awaitable);
+    if (!received_[index]) {
+        received_[index] = true;
+        ++receivedCount_;
+    }
+}
+
+std::vector<NackRange> MulticastReceiver::MissingRanges(size_t limit) const {
+    std::vector<NackRange> ranges;
+
+    U64 index = 0;
+    while (index < received_.size() && ranges.size() < limit) {
+        if (received_[index]) {
+            ++index;
+            continue;
+        }
+
+        NackRange range{index, 0};
+        while (index < received_.size() && !received_[index] && range.chunkCount < std::numeric_limits<U32>::max()) {
+            ++range.chunkCount;
+            ++index;
+        }
+        ranges.push_back(range);
+    }
+
+    return ranges;
+}
+
+boost::asio::awaitable<void> MulticastReceiver::SendNacks(U64 round) {
+    const auto missing = MissingRanges(MAX_NACKS_PER_ROUND * MAX_NACK_RANGES);
+    lastNack_ = Clock::now();
+    if (missing.empty()) {
+        co_return;
+    }
+
+    LOG_DEBUG("Multicast session {}: Missing {} ranges after round {}.", sessionId_, missing.size(), round);
+
+    for (size_t offset = 0; offset < missing.size(); offset += MAX_NACK_RANGES) {
+        NackMessage nack{};
+        static_cast<MessageBase&>(nack) = MessageBase{sessionId_, MessageType::kNack, round};
+        nack.rangeCount = static_cast<U8>(std::min(MAX_NACK_RANGES, missing.size() - offset));
+        nack.cookie = cookie_;
+        std::copy_n(missing.begin() + static_cast<std::ptrdiff_t>(offset), nack.rangeCount, nack.ranges.begin());
+
+        const auto datagram = framing::Serialize(nack);
+        const auto size = co_await unicastSocket_.async_send_to(boost::asio::buffer(datagram), sender_, boost::asio::use_awaitable);
+        metrics_.Endpoint().nacksSent.Add();
+        metrics_.Endpoint().datagramsSent.Add();
+        metrics_.Endpoint().bytesSent.Add(size);
+    }
+}
+
+boost::asio::awaitable<void> MulticastReceiver::Supervise() {
+    boost::asio::steady_timer timer(strand_);
+
+    while (!Complete()) {
+        timer.expires_after(SUPERVISOR_TICK);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+
+        const auto now = Clock::now();
+        if (now - lastHeard_ > options_.idleTimeout) {
+            throw std::runtime_error{announce_ ? std::format("The multicast sender was quiet for {}s, {} of {} chunks are missing.", options_.idleTimeout.count(),
+                                                             received_.size() - receivedCount_, received_.size())
+                                               : std::format("Nobody announced {} for {}s.", wantedFileName_.empty() ? "a file" : wantedFileName_,
+                                                             options_.idleTimeout.count())};
+        }
+
+        // The round's FinMessage may have been lost, or our NACKs
+        if (announce_ && now - lastHeard_ > options_.nackRetry && now - lastNack_ > options_.nackRetry) {
+            co_await SendNacks(lastNackedRound_.value_or(0));
+        }
+    }
+}
+
+Digest MulticastReceiver::HashDownload() const {
+    DigestBuilder digest;
+
+    std::ifstream file(path_, std::ios::binary);
+    std::vector<char> buffer(BLOCK_READ_SIZE);
+    while (file.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || file.gcount() > 0) {
+        digest.Add({buffer.data(), static_cast<size_t>(file.gcount())});
+    }
+
+    return digest.Finish();
+}
+
+} // namespace rft
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <random>
+#include <span>
+
+#include <boost/asio.hpp>
+
+#include "digest.hpp"
+#include "file_cache.hpp"
+#include "framing.hpp"
+#include "handshake.hpp"
+#include "messages.hpp"
+#include "metrics.hpp"
+
+// One-to-many distribution of a file. Instead of one ServerStream per client, each of which sends the whole file, the sender sends every chunk once to a
+// multicast group that all receivers joined. There are no ACKs: after a round of chunks the sender sends a FinMessage, every receiver answers it with the
+// ranges of chunks it is still missing (NackMessage, unicast to the sender), and the sender repairs those in the next round. A chunk only one receiver
+// misses goes to that receiver alone, a chunk several receivers miss goes to the group once. The rounds go on until no receiver misses anything, so the
+// sender's egress is about one file size plus repairs, independent of the number of receivers.
+//
+// NACKs are not authenticated and anyone who sees the group traffic knows the session ID. So that a forged NACK can't make the sender unicast the file
+// to a victim, a receiver only gets unicast repairs once it has proven its address: the sender answers a NACK without a valid cookie with a HelloRetry,
+// and the receiver puts that cookie into its later NACKs. Until then its repairs go to the group. How many chunks one source can ask for per round is
+// capped as well.
+//
+// The sender is paced to a fixed rate, there is no congestion control, and multicast transfers are not encrypted. A receiver that loses every FinMessage
+// of the last round doesn't hear about the end of the session and gives up once the sender has been quiet for too long.
+
+namespace rft {
+
+struct MulticastOptions {
+    // 239.0.0.0/8 is administratively scoped, so the chunks don't leave the site
+    boost::asio::ip::udp::endpoint group{boost::asio::ip::make_address("239.255.70.84"), 5052};
+    // Local address of the interface to send from and to join the group on (IPv4 only), unspecified leaves it to the OS. 127.0.0.1 keeps everything on
+    // one machine.
+    boost::asio::ip::address interfaceAddress;
+
+    // Sender only
+    U8 ttl = 1;
+    double bytesPerSecond = 12.5e6;
+    // Receivers that join late learn what is being sent from the next announcement
+    U64 announceEvery = 1024;
+    // How long the sender waits for NACKs after every round
+    std::chrono::milliseconds nackWindow{250};
+    unsigned maxRepairRounds = 32;
+    // The most chunks one source gets repaired per round, the rest waits for the next round
+    U64 maxRepairChunksPerSource = 65536;
+
+    // Receiver only
+    // A receiver waits up to this long before it answers a FinMessage, so the sender doesn't get all NACKs at once
+    std::chrono::milliseconds nackJitter{50};
+    // NACK again if the sender has been quiet for this long, in case the FinMessage got lost
+    std::chrono::milliseconds nackRetry{1000};
+    std::chrono::seconds idleTimeout{15};
+};
+
+class MulticastSender {
+public:
+    // Throws if the socket can't be set up
+    MulticastSender(boost::asio::any_io_executor executor, std::shared_ptr<CachedFile> file, MulticastOptions options, metrics::EndpointMetrics& metrics);
+
+    // Sends the file to the group, then repairs until a round ends without NACKs or the rounds run out
+    boost::asio::awaitable<void> Run();
+
+    U16 SessionId() const noexcept {
+        return sessionId_;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // A run of chunks to repair after a round, [first, end)
+    struct Repair {
+        U64 first;
+        U64 end;
+        // Only set if a single receiver asked for these chunks and it has proven its address, otherwise they go to the group
+        std::optional<boost::asio::ip::udp::endpoint> destination;
+    };
+
+    constexpr static size_t CHUNK_SIZE = sizeof(ChunkMessage::payload);
+    // Receivers only answer the first FinMessage of a round, the others make it less likely that a receiver misses the round altogether
+    constexpr static unsigned FIN_REPEATS = 3;
+
+    boost::asio::awaitable<Digest> HashFile();
+    boost::asio::awaitable<void> Announce();
+    boost::asio::awaitable<void> SendChunk(U64 index, const boost::asio::ip::udp::endpoint& destination);
+    boost::asio::awaitable<void> SendPaced(const std::vector<char>& datagram, const boost::asio::ip::udp::endpoint& destination);
+    // The chunks receivers reported missing until the NACK window of the round closed, sorted and without overlaps
+    boost::asio::awaitable<std::vector<Repair>> CollectNacks();
+    // Sends the source a cookie to put into its next NACKs
+    boost::asio::awaitable<void> Challenge(const boost::asio::ip::udp::endpoint& source);
+
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::steady_timer pacer_;
+    std::shared_ptr<CachedFile> file_;
+    MulticastOptions options_;
+    metrics::EndpointMetrics& metrics_;
+    CookieGenerator cookies_;
+
+    const U16 sessionId_;
+    const U64 chunkCount_;
+    Digest digest_{};
+    Clock::time_point nextSend_ = Clock::now();
+    U64 chunksSinceAnnounce_ = 0;
+};
+
+class MulticastReceiver {
+public:
+    // Throws if the group can't be joined
+    MulticastReceiver(boost::asio::any_io_executor executor, std::filesystem::path downloadDirectory, MulticastOptions options = {});
+
+    // Waits for the announcement of fileName (of any file if it is empty), receives the file and checks its digest. Returns where the file was saved.
+    // Throws if the sender goes quiet before the file is complete or the file is corrupt.
+    boost::asio::awaitable<std::filesystem::path> Run(std::string fileName = {});
+
+    metrics::MetricsRegistry& Metrics() noexcept {
+        return metrics_;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    constexpr static size_t CHUNK_SIZE = sizeof(ChunkMessage::payload);
+    // Ranges that don't fit are asked for in the next round
+    constexpr static size_t MAX_NACKS_PER_ROUND = 16;
+
+    // Everything below runs on the strand, so the two receive loops and the supervisor never touch the state at the same time
+    boost::asio::awaitable<std::filesystem::path> RunOnStrand(std::string fileName);
+    boost::asio::awaitable<void> ReceiveLoop(boost::asio::ip::udp::socket& socket);
+    boost::asio::awaitable<void> Handle(std::span<const char> datagram, const boost::asio::ip::udp::endpoint& source);
+    boost::asio::awaitable<void> Supervise();
+    void Adopt(const MulticastAnnounce& announce, const boost::asio::ip::udp::endpoint& source);
+    boost::asio::awaitable<void> StoreChunk(const framing::ChunkView& chunk);
+    boost::asio::awaitable<void> SendNacks(U64 round);
+    std::vector<NackRange> MissingRanges(size_t limit) const;
+    Digest HashDownload() const;
+
+    bool Complete() const noexcept {
+        return announce_ && receivedCount_ == received_.size();
+    }
+
+    boost::asio::strand<boost::asio::any_io_executor> strand_;
+    // The group socket shares its port with the other receivers on this host, so NACKs and unicast repairs go through a socket of our own
+    boost::asio::ip::udp::socket groupSocket_;
+    boost::asio::ip::udp::socket unicastSocket_;
+    std::filesystem::path downloadDirectory_;
+    MulticastOptions options_;
+
+    std::string wantedFileName_;
+    std::optional<MulticastAnnounce> announce_;
+    U16 sessionId_ = 0;
+    boost::asio::ip::udp::endpoint sender_;
+    // From the sender's last HelloRetry, all zeros until then
+    Cookie cookie_{};
+    std::filesystem::path path_;
+    std::unique_ptr<boost::asio::random_access_file> file_;
+    std::vector<bool> received_;
+    U64 receivedCount_ = 0;
+    std::optional<U64> lastNackedRound_;
+    Clock::time_point lastHeard_ = Clock::now();
+    Clock::time_point lastNack_{};
+    std::minstd_rand random_{std::random_device{}()};
+
+    metrics::MetricsRegistry metrics_{"multicast-receiver"};
+};
+
+} // namespace rft
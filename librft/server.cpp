@@ -11,145 +11,396 @@ namespace rft {
 decltype(Server::random) Server::random;
 decltype(Server::distribution) Server::distribution{std::numeric_limits<decltype(MessageBase::streamId)>::min(), std::numeric_limits<decltype(MessageBase::streamId)>::max()};
 
-Server::Server(boost::asio::any_io_executor executor, short serverPort)
+Server::Server(boost::asio::any_io_executor executor, short serverPort, std::filesystem::path rootDirectory, FileCacheOptions fileCacheOptions,
+               HandshakeOptions handshakeOptions, TransmitSchedulerOptions transmitOptions, StreamLifetimeOptions lifetimeOptions)
     : socket_(executor, ip::udp::endpoint(ip::udp::v4(), serverPort)),
       //TODO: Should also work with IPv6
-      executor_(executor) {
+      executor_(executor),
+      rootDirectory_(std::move(rootDirectory)),
+      fileCache_(executor, fileCacheOptions),
+      handshakeOptions_(handshakeOptions),
+      cookies_(handshakeOptions.cookieLifetime),
+      helloRateLimiter_(handshakeOptions.hellosPerSecond, handshakeOptions.helloBurst),
+      scheduler_(socket_, metrics_.Endpoint(), transmitOptions),
+      lifetimeOptions_(lifetimeOptions),
+      timers_(lifetimeOptions.tick) {
+    metrics_.AttachFileCache(&fileCache_.Metrics());
 }
 
-boost::asio::awaitable<void> Server::Run() {
+std::filesystem::path Server::DefaultRootDirectory() {
+    const auto* userProfile = getenv("USERPROFILE");
+    return std::filesystem::path{userProfile != nullptr ? userProfile : "."} / "RFT";
+}
+
+void Server::CheckIdle(StreamId id, U64 serial) {
+    std::scoped_lock lock(streamsMutex_);
+
+    const auto lifetime = lifetimes_.find(id);
+    if (lifetime == lifetimes_.end() || lifetime->second.serial != serial || lifetime->second.finished) {
+        return;
+    }
+
+    auto& stream = streams_.at(id);
+    const auto deadline = stream.LastActivity() + lifetimeOptions_.idleTimeout;
+    if (std::chrono::steady_clock::now() < deadline) {
+        lifetime->second.timer = timers_.ScheduleAt(deadline, [this, id, serial] { CheckIdle(id, serial); });
+        return;
+    }
+
+    metrics_.Endpoint().streamsTimedOut.Add();
+    LOG_INFO("Stream {}: The client didn't send anything for {} seconds. Aborting the stream.", id, lifetimeOptions_.idleTimeout.count());
+
+    // Run() returns at its next chunk and the stream is reclaimed in OnStreamFinished()
+    stream.Abort();
+    rings_.at(id).Close();
+}
+
+void Server::OnStreamFinished(StreamId id) {
+    std::scoped_lock lock(streamsMutex_);
+
+    auto& lifetime = lifetimes_.at(id);
+    lifetime.finished = true;
+    timers_.Cancel(lifetime.timer);
+
+    if (streams_.at(id).Aborted()) {
+        ReclaimLocked(id);
+        return;
+    }
+
+    const auto serial = lifetime.serial;
+    lifetime.timer = timers_.Schedule(lifetimeOptions_.linger, [this, id, serial] {
+        std::scoped_lock lock(streamsMutex_);
+        if (const auto it = lifetimes_.find(id); it != lifetimes_.end() && it->second.serial == serial) {
+            ReclaimLocked(id);
+        }
+    });
+}
+
+void Server::ReclaimLocked(StreamId id) {
+    if (const auto it = lifetimes_.find(id); it != lifetimes_.end()) {
+        timers_.Cancel(it->second.timer);
+        lifetimes_.erase(it);
+    }
+
+    scheduler_.RemoveFlow(id);
+    streams_.erase(id);
+    rings_.erase(id);
+
+    metrics_.Endpoint().streamsClosed.Add();
+    metrics_.Endpoint().activeStreams.Sub();
+}
+
+std::optional<std::filesystem::path> Server::ResolveFileName(std::string_view fileName) const {
+    const std::filesystem::path name{fileName};
+    if (name.empty() || name.has_root_name() || name.has_root_directory()) {
+        return std::nullopt;
+    }
+    if (std::ranges::any_of(name, [](const std::filesystem::path& part) { return part == ".."; })) {
+        return std::nullopt;
+    }
+
+    std::error_code error;
+    auto root = std::filesystem::weakly_canonical(rootDirectory_, error);
+    if (error) {
+        return std::nullopt;
+    }
+    auto path = std::filesystem::weakly_canonical(root / name, error);
+    if (error) {
+        return std::nullopt;
+    }
+
+    // A trailing separator leaves an empty last element, which would get in the way of the comparisons below
+    const auto trim = [](std::filesystem::path& directory) {
+        if (!directory.has_filename()) {
+            directory = directory.parent_path();
+        }
+    };
+    trim(root);
+    trim(path);
+    if (path == root) {
+        return std::nullopt;
+    }
+
+    // A symlink inside the root can still lead out of it
+    if (std::ranges::mismatch(root, path).in1 != root.end()) {
+        return std::nullopt;
+    }
+
+    return path;
+}
+
+boost::asio::awaitable<bool> Server::SendStateless(const std::vector<char>& datagram, const ip::udp::endpoint& endpoint) {
     try {
-        //TODO: We might want to use something like a pool allocator here instead of allocating it on the heap, but ¯\_(ツ)_/¯.
-        //std::unique_ptr<char[]> data{new char[MAX_LENGTH]};
-        std::vector<char> data(MAX_LENGTH);
+        co_await socket_.async_send_to(boost::asio::buffer(datagram), endpoint, boost::asio::use_awaitable);
+    } catch (const boost::system::system_error& e) {
+        // Source addresses of hellos are easily forged, so this is expected from time to time
+        metrics_.Endpoint().statelessSendFailures.Add();
+        LOG_DEBUG("Could not send {} bytes to {}: {}", datagram.size(), endpoint.address().to_string(), e.what());
+        co_return false;
+    }
 
-        ip::udp::endpoint endpoint;
-        for (;;) {
-            // We can't receive half a UDP datagram, so at this point we know we received a complete message
-            const size_t bytesReceived = co_await socket_.async_receive_from(boost::asio::buffer(data), endpoint, boost::asio::use_awaitable);
-            if (bytesReceived < sizeof(MessageBase)) {
-                LOG_WARNING("Received malformed message or incomplete message with size {} from {}", bytesReceived, endpoint.address().to_string());
-                continue;
-            }
-            data.resize(bytesReceived);
+    if (capture_) {
+        capture_->Record(CaptureDirection::kOutbound, endpoint, datagram);
+    }
+    metrics_.Endpoint().datagramsSent.Add();
+    metrics_.Endpoint().bytesSent.Add(datagram.size());
+    co_return true;
+}
 
-            const auto* const message = reinterpret_cast<MessageBase*>(data.data());
+boost::asio::awaitable<void> Server::SendRequestError(const ip::udp::endpoint& endpoint, U8 errorCode, std::string_view text) {
+    ErrorMessage error{0, MessageType::kError, 0, ERROR_CATEGORY_REQUEST, errorCode, {}};
+    const auto size = std::min(text.size(), error.message.size());
+    std::copy_n(text.begin(), size, error.message.begin());
+    co_await SendStateless(framing::Serialize(error, size), endpoint);
+}
 
-            if (message->messageType == MessageType::kClientHello) {
-                // At this point, we're establishing a new stream
+void Server::StartCapture(const std::filesystem::path& path) {
+    capture_ = std::make_unique<CaptureWriter>(path);
+    scheduler_.SetCaptureWriter(capture_.get());
+    LOG_INFO("Capturing all datagrams to {}.", path.string());
+}
 
-                // First, we check if all IDs are exhausted
-                // TODO: This might be an off-by-one error
-                if (streams_.size() == std::numeric_limits<decltype(MessageBase::streamId)>::max()) {
-                    LOG_WARNING("{} tried to establish a new stream, however all streamIDs are currently in use.", endpoint.address().to_string());
-                    continue;
-                }
+boost::asio::awaitable<void> Server::Multicast(std::string fileName, MulticastOptions options) {
+    try {
+        MulticastSender sender(executor_, fileCache_.Open(rootDirectory_ / fileName), std::move(options), metrics_.Endpoint());
+        co_await sender.Run();
+    } catch (const std::exception& e) {
+        LOG_ERROR("Multicasting {} failed: {}", fileName, e.what());
+    }
+}
 
-                uint16_t id = 0;
-                do {
-                    id = distribution(random);
-                } while (streams_.contains(id));
+void Server::Start() {
+    boost::asio::co_spawn(executor_, scheduler_.Run(), boost::asio::detached);
+    boost::asio::co_spawn(executor_, timers_.Run(), boost::asio::detached);
+}
 
-                auto [channelsIterator, channelSuccess] = channels_.try_emplace(id, executor_);
-                if (!channelSuccess) {
-                    LOG_WARNING("Could not emplace stream channels {}. Skipping.", id);
-                    continue;
-                }
+void Server::Stop() {
+    scheduler_.Stop();
+    timers_.Stop();
+    if (capture_) {
+        capture_->Flush();
+    }
+}
 
-                auto& outputChannel = channelsIterator->second;
+boost::asio::awaitable<void> Server::Dispatch(std::vector<char> data, const ip::udp::endpoint& endpoint, std::optional<StreamId> preferredStreamId) {
+    metrics_.Endpoint().datagramsReceived.Add();
+    metrics_.Endpoint().bytesReceived.Add(data.size());
 
-                auto [stream, streamSuccess] = streams_.try_emplace(id, executor_, outputChannel, id, reinterpret_cast<const ClientHello*>(message));
-                if (!streamSuccess) {
-                    LOG_WARNING("Could not emplace stream {}. Skipping.", id);
-                    continue;
-                }
+    // Checks that the datagram is large enough for its message type, everything after this can trust the header
+    const auto message = framing::ParseHeader(data);
+    if (!message) {
+        metrics_.Endpoint().malformedDatagrams.Add();
+        LOG_WARNING("Received malformed message or incomplete message with size {} from {}", data.size(), endpoint.address().to_string());
+        co_return;
+    }
 
-                // We now let the stream run its course. As soon as the stream is done, we clean up all related resources
-                boost::asio::co_spawn(executor_, [&stream, id, this]() -> boost::asio::awaitable<void> {
-                    try {
-                        co_await stream->second.Run();
-                    } catch (const std::exception& e) {
-                        LOG_ERROR("Connection {} encountered an error. Please check the logs above.", id);
-                    }
+    if (message->messageType == MessageType::kClientHello) {
+        // At this point, we're establishing a new stream
+        const auto clientHello = framing::Parse<ClientHello>(data);
+        if (!clientHello) {
+            metrics_.Endpoint().malformedDatagrams.Add();
+            LOG_WARNING("Received a malformed client hello from {}", endpoint.address().to_string());
+            co_return;
+        }
 
-                    streams_.erase(streams_.find(id));
-                    channels_.erase(channels_.find(id));
-                    co_return;
-                }, boost::asio::detached);
-
-                boost::asio::co_spawn(executor_, [id, &outputChannel, this, destination = endpoint]() -> boost::asio::awaitable<void> {
-                    while (outputChannel.is_open()) {
-                        try {
-                            //constexpr auto SIZE = sizeof(ServerHello);
-
-                            const auto message = co_await outputChannel.async_receive(boost::asio::use_awaitable);
-
-                            const auto* base = reinterpret_cast<const MessageBase*>(message.data());
-                            auto size = 0;
-                            switch (base->messageType) {
-                                case MessageType::kClientHello:
-                                    size = sizeof(ClientHello);
-                                    break;
-                                case MessageType::kServerHello:
-                                    size = sizeof(ServerHello);
-                                    break;
-                                case MessageType::kAck:
-                                    size = sizeof(AckMessage);
-                                    break;
-                                case MessageType::kFin:
-                                    size = sizeof(FinMessage);
-                                    break;
-                                case MessageType::kError:
-                                    size = sizeof(ErrorMessage);
-                                    break;
-                                case MessageType::kChunk:
-                                    size = sizeof(ChunkMessage);
-                                    break;
-                            }
-
-                            assert(size != 0);
-
-                            const auto actualSize = co_await socket_.async_send_to(boost::asio::buffer(message.data(), size), destination, boost::asio::use_awaitable);
-                            LOG_TRACE("Stream {}: Sent {} bytes to {}.", id, size, destination.address().to_string());
-
-                            if (actualSize != size) {
-                                LOG_ERROR("In stream {} a fewer bytes than the message size were sent out. Expected size: {}, actual size: {}.", id, size, actualSize);
-                                co_return;
-                            }
-                        } catch (const boost::system::system_error& e) {
-                            if (e.code() == boost::asio::experimental::error::channel_closed) {
-                                LOG_INFO("co_awaited a closed channel, cleaning up...");
-                            } else {
-                                LOG_ERROR("Connection {} encountered an error while trying to send using the output channel: {}", id, e.what());
-                            }
-
-                            break;
-                        } catch (const std::exception& e) {
-                            LOG_ERROR("Connection {} encountered an error while trying to send using the output channel: {}", id, e.what());
-                            break;
-                        }
-                    }
+        // Everything up to here was cheap. Before we do anything else, the source has to stay within its rate and prove that it can receive.
+        if (!helloRateLimiter_.Allow(endpoint.address(), std::chrono::steady_clock::now())) {
+            metrics_.Endpoint().hellosRateLimited.Add();
+            LOG_DEBUG("Dropping a client hello from {}, since it exceeds its rate.", endpoint.address().to_string());
+            co_return;
+        }
+
+        if (handshakeOptions_.requireCookie) {
+            const auto cookie = framing::ParseCookie(data);
+            if (!cookie || !cookies_.Verify(endpoint, *clientHello, *cookie)) {
+                if (cookie) {
+                    metrics_.Endpoint().cookiesRejected.Add();
+                    LOG_DEBUG("Rejected an invalid or expired cookie from {}.", endpoint.address().to_string());
+                }
 
+                // A spoofed hello must not get more bytes sent to its victim than it cost
+                if (data.size() < framing::MIN_CLIENT_HELLO_SIZE) {
+                    metrics_.Endpoint().hellosUnpadded.Add();
+                    LOG_DEBUG("Dropping a client hello of {} bytes from {}, since it isn't padded.", data.size(), endpoint.address().to_string());
                     co_return;
-                }, boost::asio::detached);
-            } else {
-                // We already have a stream
-                const auto streamId = message->streamId;
-
-                if (!streams_.contains(streamId)) {
-                    LOG_WARNING("Received message for stream {} from {}, however no stream with such an ID was found. Discarding the message.", streamId,
-                                endpoint.address().to_string());
-                    continue;
                 }
 
-                auto& stream = streams_.at(streamId);
+                // Stateless: the client has to come back with the cookie, until then we don't remember anything
+                const auto retry = framing::Serialize(HelloRetry{0, MessageType::kHelloRetry, 0, cookies_.Make(endpoint, *clientHello)});
+                if (co_await SendStateless(retry, endpoint)) {
+                    metrics_.Endpoint().cookiesIssued.Add();
+                }
+                co_return;
+            }
+        }
 
-                stream.PushMessage(std::move(data));
+        // framing::Parse<ClientHello>() guarantees that the file name is 0-terminated
+        const std::string_view fileName{clientHello->fileName};
+        const auto filePath = ResolveFileName(fileName);
+        if (!filePath) {
+            metrics_.Endpoint().fileNamesRejected.Add();
+            LOG_WARNING("Rejecting a client hello from {}, since the file name {} leads outside of the root directory.", endpoint.address().to_string(), fileName);
+            co_await SendRequestError(endpoint, ERROR_FILE_NAME_REJECTED, "The file name must be relative and stay inside the served directory.");
+            co_return;
+        }
+
+        const auto clientKeyShare = framing::ParseKeyShare(data);
+        if (!clientKeyShare && handshakeOptions_.requireEncryption) {
+            LOG_WARNING("Dropping a client hello from {}, since it didn't ask for encryption.", endpoint.address().to_string());
+            co_return;
+        }
+
+        std::optional<StreamEncryption> encryption;
+        if (clientKeyShare && handshakeOptions_.allowEncryption) {
+            try {
+                const KeyExchange exchange;
+                encryption = StreamEncryption{exchange.Share(), exchange.DeriveKey(*clientKeyShare, KeyExchange::Role::kServer, handshakeOptions_.preSharedKey)};
+            } catch (const std::exception& e) {
+                LOG_WARNING("Dropping a client hello from {}, since its key share is invalid: {}", endpoint.address().to_string(), e.what());
+                co_return;
+            }
+        }
+
+        // Opening a file blocks (the open itself, its modification time, looking for holes), so it happens before we take the lock all streams need
+        std::shared_ptr<CachedFile> file;
+        try {
+            file = fileCache_.Open(*filePath);
+        } catch (const std::exception& e) {
+            metrics_.Endpoint().filesUnavailable.Add();
+            LOG_WARNING("Rejecting a client hello from {}, since {} can't be opened: {}", endpoint.address().to_string(), fileName, e.what());
+        }
+        if (!file) {
+            co_await SendRequestError(endpoint, ERROR_FILE_NOT_AVAILABLE, "The file doesn't exist or can't be read.");
+            co_return;
+        }
+
+        std::unique_lock lock(streamsMutex_);
+
+        // First, we check if all IDs are exhausted
+        // TODO: This might be an off-by-one error
+        if (streams_.size() == std::numeric_limits<decltype(MessageBase::streamId)>::max()) {
+            metrics_.Endpoint().streamIdsExhausted.Add();
+            LOG_WARNING("{} tried to establish a new stream, however all streamIDs are currently in use.", endpoint.address().to_string());
+            co_return;
+        }
+
+        uint16_t id = 0;
+        if (preferredStreamId && *preferredStreamId != 0 && !streams_.contains(*preferredStreamId)) {
+            id = *preferredStreamId;
+        } else {
+            do {
+                id = distribution(random);
+            } while (streams_.contains(id));
+        }
+
+        auto [ringIterator, ringSuccess] = rings_.try_emplace(id, scheduler_.Options().flowQueueLimit);
+        if (!ringSuccess) {
+            LOG_WARNING("Could not emplace transmit ring {}. Skipping.", id);
+            co_return;
+        }
+
+        auto& outputQueue = ringIterator->second;
+        auto& lifetime = lifetimes_[id];
+        lifetime.serial = nextLifetimeSerial_++;
+
+        std::optional<AckFrequency> ackFrequency;
+        if (const auto proposal = framing::ParseAckFrequency(data)) {
+            ackFrequency = NegotiateAckFrequency(*proposal, handshakeOptions_.ackFrequencyLimit);
+        }
+
+        const bool zeroRanges = handshakeOptions_.allowZeroRanges && framing::HasZeroRanges(data);
+
+        auto streamMetrics = metrics_.RegisterStream(id, "server");
+        decltype(streams_)::iterator stream;
+        bool streamSuccess = false;
+        try {
+            std::tie(stream, streamSuccess) = streams_.try_emplace(id, executor_, outputQueue, id, file, streamMetrics, ackFrequency, handshakeOptions_.digestInFin,
+                                                                   encryption, zeroRanges);
+        } catch (const std::exception& e) {
+            LOG_ERROR("Could not set up stream {}: {}", id, e.what());
+        }
+        if (!streamSuccess) {
+            LOG_WARNING("Could not emplace stream {}. Skipping.", id);
+            rings_.erase(ringIterator);
+            lifetimes_.erase(id);
+            co_return;
+        }
+
+        metrics_.Endpoint().streamsOpened.Add();
+        metrics_.Endpoint().activeStreams.Add();
+
+        const auto& transmitOptions = scheduler_.Options();
+        const auto weight = stream->second.FileSize() <= transmitOptions.interactiveFileSize ? transmitOptions.interactiveWeight : 1u;
+        scheduler_.AddFlow(id, endpoint, weight, streamMetrics, outputQueue);
+
+        const auto serial = lifetime.serial;
+        lifetime.timer = timers_.Schedule(lifetimeOptions_.idleTimeout, [this, id, serial] { CheckIdle(id, serial); });
+        lock.unlock();
+
+        // We now let the stream run its course. As soon as the stream is done, the timer wheel takes care of cleaning up all related resources.
+        boost::asio::co_spawn(executor_, [serverStream = &stream->second, id, this]() -> boost::asio::awaitable<void> {
+            try {
+                co_await serverStream->Run();
+            } catch (const std::exception& e) {
+                LOG_ERROR("Connection {} encountered an error. Please check the logs above.", id);
+            }
+
+            OnStreamFinished(id);
+            co_return;
+        }, boost::asio::detached);
+    } else {
+        // We already have a stream
+        const auto streamId = message->streamId;
+
+        std::scoped_lock lock(streamsMutex_);
+        const auto it = streams_.find(streamId);
+        if (it == streams_.end()) {
+            metrics_.Endpoint().unknownStreamDatagrams.Add();
+            LOG_WARNING("Received message for stream {} from {}, however no stream with such an ID was found. Discarding the message.", streamId,
+                        endpoint.address().to_string());
+            co_return;
+        }
+
+        auto& stream = it->second;
+        stream.Touch(std::chrono::steady_clock::now());
+        stream.Metrics().datagramsReceived.Add();
+        stream.Metrics().bytesReceived.Add(data.size());
+
+        stream.PushMessage(std::move(data));
+    }
+}
+
+boost::asio::awaitable<void> Server::Run() {
+    Start();
+
+    try {
+        //TODO: We might want to use something like a pool allocator here instead of allocating it on the heap, but ¯\_(ツ)_/¯.
+        //std::unique_ptr<char[]> data{new char[MAX_LENGTH]};
+        ip::udp::endpoint endpoint;
+        for (;;) {
+            // The buffer is handed over to the stream, so we need a fresh one for every datagram
+            std::vector<char> data(MAX_LENGTH);
+
+            // We can't receive half a UDP datagram, so at this point we know we received a complete message
+            const size_t bytesReceived = co_await socket_.async_receive_from(boost::asio::buffer(data), endpoint, boost::asio::use_awaitable);
+            data.resize(bytesReceived);
+
+            if (capture_) {
+                capture_->Record(CaptureDirection::kInbound, endpoint, data);
+            }
+
+            // Whatever goes wrong with one datagram must not stop the server for everybody else
+            try {
+                co_await Dispatch(std::move(data), endpoint);
+            } catch (const std::exception& e) {
+                LOG_ERROR("Dispatching a datagram from {} failed: {}", endpoint.address().to_string(), e.what());
             }
         }
     } catch (const std::exception& e) {
         LOG_ERROR("Server::Run() encountered an error: {}", e.what());
     }
+
+    Stop();
 }
 
 } // namespace rft
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <boost/asio.hpp>
-#include <boost/asio/experimental/channel.hpp>
 #include <boost/asio/experimental/awaitable_operators.hpp>
 #include <boost/circular_buffer.hpp>
 #include <boost/pool/object_pool.hpp>
@@ -10,35 +9,129 @@
 #include <chrono>
 #include <tuple>
 
-#include <hash-library/sha3.h>
-
 #include "logger.hpp"
+#include "capture.hpp"
 #include "messages.hpp"
+#include "framing.hpp"
+#include "chunk_cipher.hpp"
 #include "congestion_control.hpp"
+#include "digest.hpp"
+#include "file_cache.hpp"
+#include "handshake.hpp"
+#include "multicast.hpp"
+#include "timer_wheel.hpp"
+#include "transmit_scheduler.hpp"
+#include "metrics.hpp"
 
 namespace rft {
 
 template <congestion_control_algorithm C>
 class ServerStream;
 
+// How long the server keeps streams around. All of these run on the server's timer wheel, not on a timer per stream.
+struct StreamLifetimeOptions {
+    // Resolution of all stream timeouts
+    std::chrono::milliseconds tick{10};
+    // A stream whose client didn't send anything for this long is aborted and reclaimed. There are no keepalive messages, the client's ACKs are its
+    // keepalives.
+    std::chrono::seconds idleTimeout{15};
+    // How long a stream stays around after its last chunk, so the client's last ACKs still find it
+    std::chrono::milliseconds linger{5000};
+};
+
 class Server {
     // TODO: This is a code smell
     template <congestion_control_algorithm C>
     friend class ServerStream;
 
 public:
-    Server(boost::asio::any_io_executor executor, short serverPort);
+    Server(boost::asio::any_io_executor executor, short serverPort, std::filesystem::path rootDirectory = DefaultRootDirectory(), FileCacheOptions fileCacheOptions = {},
+           HandshakeOptions handshakeOptions = {}, TransmitSchedulerOptions transmitOptions = {}, StreamLifetimeOptions lifetimeOptions = {});
+
+    // %USERPROFILE%\RFT
+    static std::filesystem::path DefaultRootDirectory();
+
+    using StreamId = decltype(MessageBase::streamId);
 
+    // Receives datagrams until the socket fails. Calls Start() and Stop() itself.
     boost::asio::awaitable<void> Run();
 
+    // Starts and stops what the streams need besides the receive loop: the transmit scheduler and the timer wheel. Only needed without Run().
+    void Start();
+    void Stop();
+
+    // Handles one datagram as if it had been received from endpoint. Run() calls it for every datagram it receives, the replay tool for the datagrams of a
+    // capture. A ClientHello gets preferredStreamId if it is still free, so that the rest of a replayed stream finds it.
+    boost::asio::awaitable<void> Dispatch(std::vector<char> data, const boost::asio::ip::udp::endpoint& endpoint,
+                                          std::optional<StreamId> preferredStreamId = std::nullopt);
+
+    // Writes every datagram the server receives and sends to a capture file. Has to be called before Run() or Start().
+    void StartCapture(const std::filesystem::path& path);
+
+    // Sends one file of the root directory to a multicast group, see multicast.hpp. Runs next to the unicast streams, out of the same file cache, and
+    // returns once no receiver misses anything.
+    boost::asio::awaitable<void> Multicast(std::string fileName, MulticastOptions options);
+
+    metrics::MetricsRegistry& Metrics() noexcept {
+        return metrics_;
+    }
+
 private:
-    constexpr static auto MAX_LENGTH = 1024 - 8;
+    constexpr static auto MAX_LENGTH = MAX_DATAGRAM_SIZE;
+
+    struct StreamLifetime {
+        // Stream ids are reused, so the callbacks of a timer that was already on its way when the stream went away must not touch the next stream
+        U64 serial = 0;
+        TimerWheel::TimerId timer;
+        bool finished = false;
+    };
+
+    // Re-arms the idle check of a running stream for when it could expire next, or aborts the stream if it did. The check only looks at when the stream
+    // last received something, so the receive path never has to touch the wheel.
+    void CheckIdle(StreamId id, U64 serial);
+
+    // Called once the stream's Run() returned. Aborted streams are reclaimed right away, all others linger.
+    void OnStreamFinished(StreamId id);
+
+    // Frees everything a stream holds on to: its file, its ring and its flow in the scheduler. Its Run() must have returned.
+    void ReclaimLocked(StreamId id);
+
+    // The path of the file a ClientHello asks for, if it lies inside the root directory: the name has to be relative and free of "..", and the path
+    // must still be inside the root once symlinks are resolved
+    std::optional<std::filesystem::path> ResolveFileName(std::string_view fileName) const;
+
+    // For datagrams that don't belong to a stream, they go out on the socket right away. Failures are counted and reported as false, they must not end the
+    // receive loop.
+    boost::asio::awaitable<bool> SendStateless(const std::vector<char>& datagram, const boost::asio::ip::udp::endpoint& endpoint);
+    boost::asio::awaitable<void> SendRequestError(const boost::asio::ip::udp::endpoint& endpoint, U8 errorCode, std::string_view text);
 
     boost::asio::ip::udp::socket socket_;
     boost::asio::any_io_executor executor_;
+    std::filesystem::path rootDirectory_;
+
+    metrics::MetricsRegistry metrics_{"server"};
+    std::unique_ptr<CaptureWriter> capture_;
 
-    std::map<decltype(MessageBase::streamId), ServerStream<RenolikeCongestionControl>> streams_{};
-    std::map<decltype(MessageBase::streamId), CongestionControl::output_channel> channels_{};
+    // Streams hold on to files of the cache, so it has to outlive them
+    FileCache fileCache_;
+
+    HandshakeOptions handshakeOptions_;
+    CookieGenerator cookies_;
+    // Only used by Run(), which handles one datagram at a time
+    HelloRateLimiter helloRateLimiter_;
+
+    TransmitScheduler scheduler_;
+
+    StreamLifetimeOptions lifetimeOptions_;
+    TimerWheel timers_;
+
+    // Guards the maps below. The receive loop, the streams finishing and the timer wheel all run on the thread pool.
+    std::mutex streamsMutex_;
+    // Streams close their ring when they are destroyed, so the rings have to outlive them
+    std::map<StreamId, CongestionControl::output_queue> rings_{};
+    std::map<StreamId, ServerStream<RenolikeCongestionControl>> streams_{};
+    std::map<StreamId, StreamLifetime> lifetimes_{};
+    U64 nextLifetimeSerial_ = 0;
 
     static std::random_device random;
     static std::uniform_int<std::uint16_t> distribution;
@@ -50,49 +143,98 @@ class ServerStream : private CongestionControlMixin {
 public:
     ServerStream(
         boost::asio::any_io_executor executor,
-        CongestionControl::output_channel& outputChannel,
+        CongestionControl::output_queue& outputQueue,
         U16 streamId,
-        const ClientHello* const message)
-        : CongestionControlMixin(outputChannel),
+        std::shared_ptr<CachedFile> file,
+        std::shared_ptr<metrics::StreamMetrics> streamMetrics,
+        std::optional<AckFrequency> ackFrequency = std::nullopt,
+        bool digestInFin = false,
+        std::optional<StreamEncryption> encryption = std::nullopt,
+        bool zeroRanges = false)
+        : CongestionControlMixin(outputQueue),
           id_(streamId),
-          file_(executor),
+          ackFrequency_(ackFrequency),
+          digestInFin_(digestInFin),
+          // Which chunks are zero would tell an observer about the contents of the file, so encrypted streams send every chunk
+          zeroRanges_(zeroRanges && !encryption),
+          file_(std::move(file)),
           executor_(executor) {
+        if (encryption) {
+            keyShare_ = encryption->share;
+            cipher_ = std::make_unique<ChunkCipher>(encryption->key);
+        }
 
-        //This might be a bug,when the string is not 0-terminated? Maybe?
         CongestionControlMixin::SetStreamId(streamId);
-        std::string filename{message->fileName};
-        std::string filePath = getenv("USERPROFILE");
-        filePath += "\\RFT\\";
-        filePath += filename;
-        file_.open(filePath, boost::asio::file_base::read_only);
-        LOG_INFO("New stream {} for file {} established.", streamId, filename);
+        CongestionControlMixin::AttachMetrics(std::move(streamMetrics));
+        LOG_INFO("New stream {} for file {} established.", streamId, file_->Path().string());
+    }
+
+    U64 FileSize() const noexcept {
+        return file_->Size();
     }
 
     ~ServerStream() {
         LOG_INFO("Cleaned up stream {}.", id_);
     }
 
-    boost::asio::awaitable<void> SendServerHello() {
-        SHA3 sha3;
-        auto sizeRead = 0;
+    // Makes Run() return at the next chunk. The server closes the stream's ring as well, so it doesn't wait for room in there either.
+    void Abort() noexcept {
+        aborted_.store(true, std::memory_order_relaxed);
+    }
+
+    bool Aborted() const noexcept {
+        return aborted_.load(std::memory_order_relaxed);
+    }
+
+    // Called for every datagram the client sends us
+    void Touch(std::chrono::steady_clock::time_point now) noexcept {
+        lastActivity_.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    std::chrono::steady_clock::time_point LastActivity() const noexcept {
+        return std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{lastActivity_.load(std::memory_order_relaxed)}};
+    }
+
+    // We have a connection timeout here, if our file is large enough, because it just takes too long to read it from HDD. Going through the cache at least
+    // means that concurrent streams for the same file don't read it again. With digestInFin_ this isn't needed.
+    boost::asio::awaitable<Digest> HashFile() {
+        DigestBuilder digest;
+
+        std::vector<char> buffer(std::min<U64>(file_->Size(), BLOCK_READ_SIZE));
+        U64 sizeRead = 0;
+        while (sizeRead < file_->Size()) {
+            if (Aborted()) {
+                throw std::runtime_error{"The stream was aborted while hashing the file."};
+            }
+
+            // Holes of sparse files don't have to be read
+            const auto holeSize = std::min<U64>(buffer.size(), file_->Size() - sizeRead);
+            if (file_->IsHole(sizeRead, holeSize)) {
+                digest.AddZeros(holeSize);
+                sizeRead += holeSize;
+                // Nothing in here waits, a large hole would hold up the other streams
+                co_await boost::asio::post(executor_, boost::asio::use_awaitable);
+                continue;
+            }
 
-        // We have a connection timeout here, if our file is large enough, because it just takes too long to read it from HDD
-        constexpr auto BUFFER_SIZE = 10 * 1024 * 1024;
-        auto buffer = new char[BUFFER_SIZE];
-        while(sizeRead < file_.size()) {
-            auto actualRead = co_await file_.async_read_some_at(sizeRead, boost::asio::buffer(buffer, BUFFER_SIZE), boost::asio::use_awaitable);
-            sha3.add(buffer, actualRead);
+            const auto actualRead = co_await file_->ReadAt(sizeRead, buffer);
+            if (actualRead == 0) {
+                throw std::runtime_error{std::format("{} is shorter than expected.", file_->Path().string())};
+            }
+            digest.Add({buffer.data(), actualRead});
             sizeRead += actualRead;
         }
-        delete[] buffer;
 
-        unsigned char hash[32];
-        //TODO: Fill hash buffer :c
+        co_return digest.Finish();
+    }
 
-        LOG_INFO("Hash of file is {}.", sha3.getHash());
+    // An all zero digest tells the client to expect the digest in the FinMessage
+    boost::asio::awaitable<void> SendServerHello(const Digest& digest) {
+        if (digest != Digest{}) {
+            LOG_INFO("Hash of file is {}.", ToHex(digest));
+        }
 
-        std::vector<char> buffer2(sizeof(ServerHello));
-        auto* serverHello = new (buffer2.data()) ServerHello{
+        ServerHello serverHello{
             id_,
             MessageType::kServerHello,
             0,
@@ -100,13 +242,74 @@ public:
             0,
             0,
             0,
-            {0},
-            0,
-            file_.size()
+            digest,
+            file_->LastModified(),
+            file_->Size()
         };
-        std::ranges::copy_n(reinterpret_cast<uint64_t*>(hash), 4, serverHello->checksum.begin());
 
-        co_await Send(std::move(buffer2));
+        // Only answer with an ACK frequency, a key share or zero ranges if the client proposed them, older clients don't expect a next header
+        co_await Send(framing::Serialize(serverHello, ackFrequency_, keyShare_, zeroRanges_));
+    }
+
+    // Small files come out of the cache in one piece, together with their digest, and all their chunks follow the ServerHello in one burst. The client is
+    // done one round trip after its ClientHello.
+    boost::asio::awaitable<void> SendSmallFile() {
+        constexpr auto CHUNK_SIZE = sizeof(ChunkMessage::payload);
+
+        const auto contents = co_await file_->ReadSmall();
+        co_await SendServerHello(contents.digest);
+
+        const auto& data = *contents.data;
+        std::vector<std::vector<char>> chunks;
+        chunks.reserve((data.size() + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        for (size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE) {
+            const auto payloadSize = std::min(CHUNK_SIZE, data.size() - offset);
+            auto& buffer = chunks.emplace_back(framing::SerializeChunkHeader(MessageBase{0, MessageType::kChunk, 0}, {0}, payloadSize));
+            std::copy_n(data.begin() + static_cast<std::ptrdiff_t>(offset), payloadSize, framing::ChunkPayload(buffer).begin());
+        }
+
+        if (cipher_) {
+            cipher_->SealBatch(chunks, 0);
+        }
+
+        for (auto& buffer : chunks) {
+            co_await Send(std::move(buffer));
+            Metrics().chunksSent.Add();
+        }
+
+        co_await SendFin(contents.digest);
+        LOG_DEBUG("Stream {}: Sent all {} bytes of {} in one burst.", id_, data.size(), file_->Path().string());
+    }
+
+    boost::asio::awaitable<void> SendFin(const Digest& digest) {
+        co_await Send(framing::Serialize(FinMessage{id_, MessageType::kFin, 0, digest}));
+    }
+
+    // The batch holds the chunks firstIndex, firstIndex + 1, ... Empties it.
+    boost::asio::awaitable<void> SendBatch(std::vector<std::vector<char>>& batch, U64 firstIndex) {
+        using namespace std::chrono_literals;
+
+        if (cipher_) {
+            cipher_->SealBatch(batch, firstIndex);
+        }
+
+        boost::asio::steady_timer pacer(executor_);
+        for (size_t j = 0; j < batch.size(); ++j) {
+            LOG_TRACE("Stream {}: Sending chunk {}.", id_, firstIndex + j);
+            co_await Send(std::move(batch[j]));
+            Metrics().chunksSent.Add();
+
+            //Hotfix: Make up for lack of congestion control. Waiting on a timer instead of sleeping leaves the thread to the scheduler and the other streams.
+            pacer.expires_after(100ms);
+            co_await pacer.async_wait(boost::asio::use_awaitable);
+        }
+        batch.clear();
+    }
+
+    boost::asio::awaitable<void> SendZeroRange(U64 firstChunk, U64 chunkCount) {
+        LOG_TRACE("Stream {}: Sending chunks {} to {} as a zero range.", id_, firstChunk, firstChunk + chunkCount - 1);
+        co_await Send(framing::Serialize(ZeroRangeMessage{id_, MessageType::kZeroRange, 0, firstChunk, chunkCount}));
+        Metrics().zeroChunksSent.Add(chunkCount);
     }
 
     bool PushMessage(char* data) {
@@ -116,17 +319,26 @@ public:
 
     boost::asio::awaitable<void> Run() {
         using namespace std::chrono_literals;
-        using namespace boost::asio::experimental::awaitable_operators;
 
         try {
-            co_await SendServerHello();
+            if (file_->IsSmall()) {
+                co_await SendSmallFile();
+                co_return;
+            }
+
+            // Either the client gets the digest up front, or we hash the file on the way, over the same blocks we read for the chunks
+            Digest fileDigest{};
+            DigestBuilder digest;
+            if (!digestInFin_) {
+                fileDigest = co_await HashFile();
+            }
+            co_await SendServerHello(fileDigest);
 
             if(false) {
                 // Await first client ack
-                boost::asio::steady_timer t(executor_, 5s);
-                const auto result = co_await (t.async_wait(boost::asio::use_awaitable) || Receive());
+                const auto result = co_await Receive(5s);
 
-                if (result.index() == 0) {
+                if (!result) {
                     LOG_INFO("5 seconds expired and we got no client ACK. Destroying connection.");
                     co_return;
                 }
@@ -134,37 +346,97 @@ public:
 
             constexpr auto CHUNK_SIZE = sizeof(ChunkMessage::payload);
 
-            auto firstChunk = 0; //TODO
-            auto lastChunk = static_cast<size_t>(std::ceil(file_.size() / CHUNK_SIZE));
+            const auto fileSize = file_->Size();
+            // Hashing on the way only works as long as we start at the beginning of the file
+            const U64 firstChunk = 0; //TODO
+            const U64 chunkCount = (fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+            // Chunks are read, hashed and sealed a batch at a time and only then handed to congestion control one by one. With zero ranges, a run of
+            // chunks that only hold zeros goes out as one ZeroRangeMessage in their place. The batch and the run always end right before chunk i, and
+            // at most one of them is non-empty.
+            std::vector<std::vector<char>> batch;
+            batch.reserve(SEAL_BATCH_SIZE);
+            U64 zeroCount = 0;
+
+            for (U64 i = firstChunk; i < chunkCount;) {
+                if (Aborted()) {
+                    LOG_INFO("Stream {}: Aborted after {} of {} chunks.", id_, i, chunkCount);
+                    co_return;
+                }
 
-            for (int i = firstChunk; i <= lastChunk; ++i) {
-                std::vector<char> buffer(sizeof(ChunkMessage));
-                auto* message = new(buffer.data()) ChunkMessage{
-                    0,
-                    MessageType::kChunk,
-                    0,
-                    {0},
-                    {0}
-                };
+                // Long runs go out in pieces, so the client keeps ACKing and neither side times out in the middle of a large hole. Holes don't wait for
+                // anything, so we make room for the other streams here as well.
+                if (zeroCount == MAX_ZERO_RANGE_CHUNKS) {
+                    co_await SendZeroRange(i - zeroCount, zeroCount);
+                    zeroCount = 0;
+                    co_await boost::asio::post(executor_, boost::asio::use_awaitable);
+                }
 
-                const size_t payloadSize = (i != lastChunk) ? CHUNK_SIZE : file_.size() % CHUNK_SIZE; //TODO: The last expression can be 0, which is incorrect
-                auto bytesRead = co_await async_read_at(file_, i * CHUNK_SIZE, boost::asio::buffer(message->payload, payloadSize), boost::asio::use_awaitable);
+                // The last chunk only carries what is left of the file
+                const U64 offset = i * CHUNK_SIZE;
+                const size_t payloadSize = std::min<U64>(CHUNK_SIZE, fileSize - offset);
+
+                // Holes aren't even read, we skip to where the data starts again
+                if (zeroRanges_ && file_->IsHole(offset, payloadSize)) {
+                    if (!batch.empty()) {
+                        co_await SendBatch(batch, i - batch.size());
+                    }
+
+                    const auto dataStart = file_->NextData(offset);
+                    const U64 holeEnd = dataStart >= fileSize ? chunkCount : dataStart / CHUNK_SIZE;
+                    const U64 count = std::min(holeEnd - i, MAX_ZERO_RANGE_CHUNKS - zeroCount);
+                    if (digestInFin_) {
+                        digest.AddZeros(std::min(fileSize, (i + count) * CHUNK_SIZE) - offset);
+                    }
+                    zeroCount += count;
+                    i += count;
+                    continue;
+                }
 
-                LOG_TRACE("Stream {}: Sending chunk {}.", id_, i);
-                co_await Send(std::move(buffer));
+                auto buffer = framing::SerializeChunkHeader(MessageBase{0, MessageType::kChunk, 0}, {0}, payloadSize);
+                {
+                    RFT_TRACE_STAGE(kFileRead, id_);
+                    if (co_await file_->ReadAt(offset, framing::ChunkPayload(buffer)) != payloadSize) {
+                        throw std::runtime_error{std::format("Could not read chunk {} of {}.", i, file_->Path().string())};
+                    }
+                }
 
-                //Hotfix: Make up for lack of congestion control
-                std::this_thread::sleep_for(100ms);
+                if (!(zeroRanges_ && IsAllZero(framing::ChunkPayload(buffer)))) {
+                    if (zeroCount > 0) {
+                        co_await SendZeroRange(i - zeroCount, zeroCount);
+                        zeroCount = 0;
+                    }
+                    if (digestInFin_) {
+                        digest.Add(framing::ChunkPayload(buffer));
+                    }
+                    batch.push_back(std::move(buffer));
+                    if (batch.size() == SEAL_BATCH_SIZE) {
+                        co_await SendBatch(batch, i + 1 - batch.size());
+                    }
+                } else {
+                    if (!batch.empty()) {
+                        co_await SendBatch(batch, i - batch.size());
+                    }
+                    if (digestInFin_) {
+                        digest.AddZeros(payloadSize);
+                    }
+                    ++zeroCount;
+                }
+                ++i;
             }
 
-            boost::asio::steady_timer t(executor_, 5s);
-            co_await t.async_wait(boost::asio::use_awaitable);
+            if (!batch.empty()) {
+                co_await SendBatch(batch, chunkCount - batch.size());
+            }
+            if (zeroCount > 0) {
+                co_await SendZeroRange(chunkCount - zeroCount, zeroCount);
+            }
 
-            {
-                // Fin Message
-                /*FinMessage message{};
-                co_await Send(&message);*/
+            if (digestInFin_) {
+                fileDigest = digest.Finish();
+                LOG_INFO("Hash of file is {}.", ToHex(fileDigest));
             }
+            co_await SendFin(fileDigest);
         } catch (const std::exception& e) {
             LOG_ERROR("Stream {}: There was an excpetion {}.", id_, e.what());
         }
@@ -173,15 +445,30 @@ public:
     }
 
     using CongestionControlMixin::PushMessage;
+    using CongestionControlMixin::Metrics;
 
 private:
     using CongestionControlMixin::Send;
     using CongestionControlMixin::Receive;
 
     static constexpr const size_t MAX_BUFFER_SIZE = 15;
+    static constexpr const size_t BLOCK_READ_SIZE = 1024 * 1024;
+    static constexpr const U64 SEAL_BATCH_SIZE = 16;
+    // About a megabyte of zeros per ZeroRangeMessage
+    static constexpr const U64 MAX_ZERO_RANGE_CHUNKS = 1024;
 
     const decltype(MessageBase::streamId) id_;
-    boost::asio::random_access_file file_;
+    // What we accepted of the client's proposal, if it made one
+    const std::optional<AckFrequency> ackFrequency_;
+    const bool digestInFin_;
+    // Whether runs of zero chunks go out as ZeroRangeMessages, only if the client asked for them
+    const bool zeroRanges_;
+    std::atomic<bool> aborted_{false};
+    // Only set if the client asked for encryption
+    std::optional<KeyShare> keyShare_;
+    std::unique_ptr<ChunkCipher> cipher_;
+    std::atomic<std::chrono::steady_clock::rep> lastActivity_{std::chrono::steady_clock::now().time_since_epoch().count()};
+    std::shared_ptr<CachedFile> file_;
     boost::asio::any_io_executor executor_;
 };
 
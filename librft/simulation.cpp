@@ -0,0 +1,143 @@
+#include "pch.hpp"
+#include "simulation.hpp"
+
+namespace rft::simulation {
+
+void EventQueue::Schedule(Duration at, std::function<void()> action) {
+    events_.push_back({std::max(at, now_), nextOrder_++, std::move(action)});
+    std::ranges::push_heap(events_, Later{});
+}
+
+std::optional<Duration> EventQueue::NextEventTime() const noexcept {
+    if (events_.empty()) {
+        return std::nullopt;
+    }
+
+    return events_.front().at;
+}
+
+bool EventQueue::RunNext() {
+    if (events_.empty()) {
+        return false;
+    }
+
+    std::ranges::pop_heap(events_, Later{});
+    auto event = std::move(events_.back());
+    events_.pop_back();
+
+    now_ = event.at;
+    event.action();
+    return true;
+}
+
+SimulatedLink::SimulatedLink(EventQueue& events, LinkParameters parameters, U64 seed, Receiver receiver)
+    : events_(events),
+      parameters_(parameters),
+      random_(seed),
+      receiver_(std::move(receiver)) {
+}
+
+void SimulatedLink::Transmit(std::vector<char> datagram) {
+    ++statistics_.datagramsSent;
+
+    if (!HasCapacity()) {
+        ++statistics_.queueDrops;
+        return;
+    }
+
+    // Serialization: the datagram has to wait for everything that's already queued
+    const auto size = datagram.size();
+    const auto serializationTime = std::chrono::duration_cast<Duration>(std::chrono::duration<double>(static_cast<double>(size) * 8.0 / parameters_.bandwidthBitsPerSecond));
+    const auto departure = std::max(busyUntil_, events_.Now()) + serializationTime;
+    busyUntil_ = departure;
+
+    queuedBytes_ += size;
+    events_.Schedule(departure, [this, size] { queuedBytes_ -= size; });
+
+    std::uniform_real_distribution<double> probability(0.0, 1.0);
+    if (probability(random_) < parameters_.lossRate) {
+        ++statistics_.datagramsLost;
+        return;
+    }
+
+    auto arrival = departure + parameters_.delay;
+    if (parameters_.jitter.count() > 0) {
+        std::uniform_int_distribution<Duration::rep> jitter(-parameters_.jitter.count(), parameters_.jitter.count());
+        arrival = std::max(departure, arrival + Duration{jitter(random_)});
+    }
+
+    if (probability(random_) < parameters_.reorderRate) {
+        ++statistics_.datagramsReordered;
+        arrival += parameters_.reorderDelay;
+    }
+
+    if (probability(random_) < parameters_.duplicateRate) {
+        ++statistics_.datagramsDuplicated;
+        Deliver(arrival, datagram);
+    }
+
+    Deliver(arrival, std::move(datagram));
+}
+
+void SimulatedLink::Deliver(Duration at, std::vector<char> datagram) {
+    events_.Schedule(at, [this, datagram = std::move(datagram)]() mutable {
+        ++statistics_.datagramsDelivered;
+        statistics_.bytesDelivered += datagram.size();
+        receiver_(std::move(datagram));
+    });
+}
+
+bool SimulatedSocket::Pump() {
+    bool moved = false;
+    std::vector<std::vector<char>> datagram;
+
+    // One at a time, the link might be full after any of them
+    while (link_.HasCapacity() && queue_.TryPopBatch(datagram, 1) > 0) {
+        link_.Transmit(std::move(datagram.back()));
+        datagram.clear();
+        moved = true;
+    }
+
+    return moved;
+}
+
+double JainFairness(const std::vector<FlowResult>& flows) noexcept {
+    double sum = 0.0;
+    double sumOfSquares = 0.0;
+
+    for (const auto& flow : flows) {
+        sum += flow.goodputBitsPerSecond;
+        sumOfSquares += flow.goodputBitsPerSecond * flow.goodputBitsPerSecond;
+    }
+
+    return sumOfSquares == 0.0 ? 1.0 : (sum * sum) / (static_cast<double>(flows.size()) * sumOfSquares);
+}
+
+std::string SimulationResult::ToJson(std::string_view algorithm) const {
+    const auto linkJson = [](const LinkStatistics& link) {
+        return std::format(R"({{"sent":{},"delivered":{},"bytesDelivered":{},"lost":{},"queueDrops":{},"reordered":{},"duplicated":{}}})", link.datagramsSent,
+                           link.datagramsDelivered, link.bytesDelivered, link.datagramsLost, link.queueDrops, link.datagramsReordered, link.datagramsDuplicated);
+    };
+
+    std::string out;
+    auto inserter = std::back_inserter(out);
+    std::format_to(inserter, R"({{"algorithm":"{}","virtualSeconds":{:.6f},"wallSeconds":{:.3f},"fairness":{:.4f},"forward":{},"reverse":{},"flows":[)", algorithm,
+                   std::chrono::duration<double>(virtualTime).count(), wallSeconds, fairness, linkJson(forward), linkJson(reverse));
+
+    for (size_t i = 0; i < flows.size(); ++i) {
+        const auto& flow = flows[i];
+        std::format_to(inserter, R"({}{{"id":{},"bytesDelivered":{},"completionSeconds":{},"goodputMbps":{:.3f},"samples":[)", i == 0 ? "" : ",", flow.streamId,
+                       flow.bytesDelivered, flow.completionTime ? std::format("{:.6f}", std::chrono::duration<double>(*flow.completionTime).count()) : "null",
+                       flow.goodputBitsPerSecond / 1e6);
+
+        for (size_t j = 0; j < flow.samples.size(); ++j) {
+            std::format_to(inserter, "{}{}", j == 0 ? "" : ",", flow.samples[j]);
+        }
+        out += "]}";
+    }
+
+    out += "]}";
+    return out;
+}
+
+} // namespace rft::simulation
@@ -0,0 +1,305 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <boost/asio.hpp>
+#include <random>
+
+#include "messages.hpp"
+#include "framing.hpp"
+#include "congestion_control.hpp"
+
+// A deterministic network simulator for evaluating congestion control algorithms. Instead of a UDP socket, the output queue of a congestion control
+// instance is drained into a simulated link, which applies bandwidth, delay, jitter, loss, reordering and duplication on a virtual clock. Everything runs
+// on a single thread and all randomness comes from a seeded generator, so a run is reproducible bit for bit.
+
+namespace rft::simulation {
+
+using namespace std::chrono_literals;
+
+// Virtual time, relative to the start of the simulation
+using Duration = std::chrono::nanoseconds;
+
+class EventQueue {
+public:
+    Duration Now() const noexcept {
+        return now_;
+    }
+
+    // Events scheduled for the same point in time run in the order they were scheduled
+    void Schedule(Duration at, std::function<void()> action);
+
+    std::optional<Duration> NextEventTime() const noexcept;
+
+    // Advances the clock to the next event and runs it. Returns false if there are no more events.
+    bool RunNext();
+
+private:
+    struct Event {
+        Duration at;
+        U64 order;
+        std::function<void()> action;
+    };
+
+    struct Later {
+        bool operator()(const Event& lhs, const Event& rhs) const noexcept {
+            return std::tie(lhs.at, lhs.order) > std::tie(rhs.at, rhs.order);
+        }
+    };
+
+    std::vector<Event> events_;
+    Duration now_{0};
+    U64 nextOrder_ = 0;
+};
+
+struct LinkParameters {
+    double bandwidthBitsPerSecond = 100e6;
+    Duration delay = 50ms;
+    // The delay of every datagram is drawn uniformly from [delay - jitter, delay + jitter]
+    Duration jitter = 0ms;
+    double lossRate = 0.0;
+    // Reordered datagrams are held back for an additional reorderDelay
+    double reorderRate = 0.0;
+    Duration reorderDelay = 5ms;
+    double duplicateRate = 0.0;
+    // Bytes that may be waiting for serialization. Senders are back-pressured before this is reached, so only datagrams pushed past it are dropped.
+    size_t queueLimitBytes = 256 * 1024;
+};
+
+struct LinkStatistics {
+    U64 datagramsSent = 0;
+    U64 datagramsDelivered = 0;
+    U64 bytesDelivered = 0;
+    U64 datagramsLost = 0;
+    U64 queueDrops = 0;
+    U64 datagramsReordered = 0;
+    U64 datagramsDuplicated = 0;
+};
+
+class SimulatedLink {
+public:
+    using Receiver = std::function<void(std::vector<char>)>;
+
+    SimulatedLink(EventQueue& events, LinkParameters parameters, U64 seed, Receiver receiver);
+
+    bool HasCapacity() const noexcept {
+        return queuedBytes_ < parameters_.queueLimitBytes;
+    }
+
+    void Transmit(std::vector<char> datagram);
+
+    const LinkStatistics& Statistics() const noexcept {
+        return statistics_;
+    }
+
+private:
+    void Deliver(Duration at, std::vector<char> datagram);
+
+    EventQueue& events_;
+    LinkParameters parameters_;
+    std::mt19937_64 random_;
+    Receiver receiver_;
+
+    Duration busyUntil_{0};
+    size_t queuedBytes_ = 0;
+    LinkStatistics statistics_;
+};
+
+// Takes the place of the UDP socket: drains an output queue into a link, but only as fast as the link accepts data.
+class SimulatedSocket {
+public:
+    SimulatedSocket(CongestionControl::output_queue& queue, SimulatedLink& link) noexcept
+        : queue_(queue),
+          link_(link) {
+    }
+
+    // Returns true if at least one datagram was moved
+    bool Pump();
+
+private:
+    CongestionControl::output_queue& queue_;
+    SimulatedLink& link_;
+};
+
+struct Scenario {
+    LinkParameters forward{};
+    LinkParameters reverse{};
+    // All flows share the same forward and reverse link
+    unsigned flows = 1;
+    U64 bytesPerFlow = 10 * 1024 * 1024;
+    Duration timeLimit = 600s;
+    Duration sampleInterval = 100ms;
+    U64 seed = 1;
+    // What the receivers were negotiated down to, without it they ACK every datagram
+    std::optional<AckFrequency> ackFrequency;
+};
+
+struct FlowResult {
+    U16 streamId = 0;
+    U64 bytesDelivered = 0;
+    std::optional<Duration> completionTime;
+    double goodputBitsPerSecond = 0.0;
+    // Bytes delivered in order, sampled every Scenario::sampleInterval
+    std::vector<U64> samples;
+};
+
+struct SimulationResult {
+    Duration virtualTime{0};
+    double wallSeconds = 0.0;
+    std::vector<FlowResult> flows;
+    // Jain's fairness index over the goodput of all flows
+    double fairness = 1.0;
+    LinkStatistics forward;
+    LinkStatistics reverse;
+
+    std::string ToJson(std::string_view algorithm) const;
+};
+
+double JainFairness(const std::vector<FlowResult>& flows) noexcept;
+
+template <congestion_control_algorithm C>
+SimulationResult Simulate(const Scenario& scenario) {
+    // Same as a server stream
+    constexpr size_t QUEUE_CAPACITY = 64;
+    constexpr size_t CHUNK_SIZE = sizeof(ChunkMessage::payload);
+
+    struct Flow {
+        explicit Flow(U16 streamId)
+            : senderQueue(QUEUE_CAPACITY),
+              receiverQueue(QUEUE_CAPACITY),
+              sender(senderQueue),
+              receiver(receiverQueue) {
+            sender.SetStreamId(streamId);
+            receiver.SetStreamId(streamId);
+            result.streamId = streamId;
+        }
+
+        CongestionControl::output_queue senderQueue;
+        CongestionControl::output_queue receiverQueue;
+        C sender;
+        C receiver;
+        FlowResult result;
+        bool ackFlushScheduled = false;
+    };
+
+    const auto wallStart = std::chrono::steady_clock::now();
+
+    boost::asio::io_context context;
+    auto work = boost::asio::make_work_guard(context);
+    EventQueue events;
+
+    std::vector<std::unique_ptr<Flow>> flows;
+    for (unsigned i = 0; i < scenario.flows; ++i) {
+        flows.push_back(std::make_unique<Flow>(static_cast<U16>(i + 1)));
+        if (scenario.ackFrequency) {
+            flows.back()->receiver.SetAckFrequency(*scenario.ackFrequency);
+        }
+    }
+
+    const auto findFlow = [&flows](const std::vector<char>& datagram) -> Flow* {
+        const auto header = framing::ParseHeader(datagram);
+        if (!header) {
+            return nullptr;
+        }
+
+        const auto streamId = header->streamId;
+        return (streamId == 0 || streamId > flows.size()) ? nullptr : flows[streamId - 1].get();
+    };
+
+    SimulatedLink forward(events, scenario.forward, scenario.seed, [&](std::vector<char> datagram) {
+        auto* flow = findFlow(datagram);
+        if (flow == nullptr) {
+            return;
+        }
+
+        flow->receiver.PushMessage(std::move(datagram));
+
+        // The ACK timer of the receiver, on the virtual clock
+        if (const auto delay = flow->receiver.AckDelay(); delay.count() > 0 && !flow->ackFlushScheduled) {
+            flow->ackFlushScheduled = true;
+            events.Schedule(events.Now() + delay, [flow] {
+                flow->ackFlushScheduled = false;
+                flow->receiver.FlushAck();
+            });
+        }
+        while (const auto message = flow->receiver.TryReceive()) {
+            if (const auto chunk = framing::ParseChunk(*message)) {
+                flow->result.bytesDelivered = std::min(scenario.bytesPerFlow, flow->result.bytesDelivered + chunk->payload.size());
+            }
+        }
+
+        if (!flow->result.completionTime && flow->result.bytesDelivered >= scenario.bytesPerFlow) {
+            flow->result.completionTime = events.Now();
+        }
+    });
+
+    SimulatedLink reverse(events, scenario.reverse, scenario.seed ^ 0x9E3779B97F4A7C15ull, [&](std::vector<char> datagram) {
+        if (auto* flow = findFlow(datagram)) {
+            flow->sender.PushMessage(std::move(datagram));
+        }
+    });
+
+    std::vector<SimulatedSocket> sockets;
+    for (auto& flow : flows) {
+        sockets.emplace_back(flow->senderQueue, forward);
+        sockets.emplace_back(flow->receiverQueue, reverse);
+
+        const auto chunks = (scenario.bytesPerFlow + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        boost::asio::co_spawn(
+            context,
+            [&sender = flow->sender, chunks]() -> boost::asio::awaitable<void> {
+                for (U64 i = 0; i < chunks; ++i) {
+                    co_await sender.Send(framing::SerializeChunkHeader(MessageBase{0, MessageType::kChunk, 0}, {0}, CHUNK_SIZE));
+                }
+            },
+            boost::asio::detached);
+    }
+
+    const auto allCompleted = [&flows] { return std::ranges::all_of(flows, [](const auto& flow) { return flow->result.completionTime.has_value(); }); };
+
+    auto nextSample = scenario.sampleInterval;
+    for (;;) {
+        context.poll();
+
+        bool moved = false;
+        for (auto& socket : sockets) {
+            moved |= socket.Pump();
+        }
+
+        if (moved) {
+            continue;
+        }
+
+        const auto next = events.NextEventTime();
+        if (allCompleted() || !next || *next > scenario.timeLimit) {
+            break;
+        }
+
+        for (; nextSample <= *next; nextSample += scenario.sampleInterval) {
+            for (auto& flow : flows) {
+                flow->result.samples.push_back(flow->result.bytesDelivered);
+            }
+        }
+
+        events.RunNext();
+    }
+
+    SimulationResult result;
+    result.virtualTime = events.Now();
+    result.forward = forward.Statistics();
+    result.reverse = reverse.Statistics();
+
+    for (auto& flow : flows) {
+        const auto elapsed = flow->result.completionTime.value_or(events.Now());
+        if (elapsed.count() > 0) {
+            flow->result.goodputBitsPerSecond = static_cast<double>(flow->result.bytesDelivered) * 8.0 / std::chrono::duration<double>(elapsed).count();
+        }
+        result.flows.push_back(std::move(flow->result));
+    }
+
+    result.fairness = JainFairness(result.flows);
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    return result;
+}
+
+} // namespace rft::simulation
@@ -0,0 +1,199 @@
+#include "pch.hpp"
+#include "timer_wheel.hpp"
+
+#include "logger.hpp"
+
+namespace rft {
+
+TimerWheel::TimerWheel(Clock::duration tick, Clock::time_point start)
+    : tick_(std::max<Clock::duration>(tick, Clock::duration{1})),
+      start_(start) {
+    buckets_.fill(NO_INDEX);
+}
+
+U64 TimerWheel::ToTick(Clock::time_point time) const noexcept {
+    return time <= start_ ? 0 : static_cast<U64>((time - start_) / tick_);
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(Clock::duration after, Callback callback) {
+    return ScheduleAt(Clock::now() + after, std::move(callback));
+}
+
+TimerWheel::TimerId TimerWheel::ScheduleAt(Clock::time_point deadline, Callback callback) {
+    // Rounded up, so a timer never fires before its deadline
+    const auto sinceStart = std::max(deadline - start_, Clock::duration{0});
+    const auto expiry = static_cast<U64>((sinceStart + tick_ - Clock::duration{1}) / tick_);
+
+    std::scoped_lock lock(mutex_);
+
+    U32 index = freeList_;
+    if (index != NO_INDEX) {
+        freeList_ = nodes_[index].next;
+    } else {
+        index = static_cast<U32>(nodes_.size());
+        nodes_.emplace_back();
+    }
+
+    auto& node = nodes_[index];
+    node.expiry = expiry;
+    node.callback = std::move(callback);
+    InsertLocked(index);
+    ++size_;
+
+    return TimerId{index, node.generation};
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+    std::scoped_lock lock(mutex_);
+
+    if (id.index >= nodes_.size() || nodes_[id.index].generation != id.generation || nodes_[id.index].bucket == NO_INDEX) {
+        return false;
+    }
+
+    UnlinkLocked(id.index);
+    FreeLocked(id.index);
+    return true;
+}
+
+size_t TimerWheel::Size() const {
+    std::scoped_lock lock(mutex_);
+    return size_;
+}
+
+void TimerWheel::InsertLocked(U32 index) {
+    auto& node = nodes_[index];
+    node.expiry = std::max(node.expiry, nextTick_);
+
+    auto delta = node.expiry - nextTick_;
+    if (delta > MAX_TICKS) {
+        delta = MAX_TICKS;
+        node.expiry = nextTick_ + MAX_TICKS;
+    }
+
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >= (U64{1} << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    const auto bucket = static_cast<U32>(level * SLOTS + ((node.expiry >> (SLOT_BITS * level)) & (SLOTS - 1)));
+    node.bucket = bucket;
+    node.previous = NO_INDEX;
+    node.next = buckets_[bucket];
+    if (node.next != NO_INDEX) {
+        nodes_[node.next].previous = index;
+    }
+    buckets_[bucket] = index;
+}
+
+void TimerWheel::UnlinkLocked(U32 index) {
+    auto& node = nodes_[index];
+
+    if (node.previous != NO_INDEX) {
+        nodes_[node.previous].next = node.next;
+    } else {
+        buckets_[node.bucket] = node.next;
+    }
+    if (node.next != NO_INDEX) {
+        nodes_[node.next].previous = node.previous;
+    }
+
+    node.bucket = NO_INDEX;
+    node.previous = NO_INDEX;
+    node.next = NO_INDEX;
+}
+
+void TimerWheel::FreeLocked(U32 index) {
+    auto& node = nodes_[index];
+    node.callback = nullptr;
+    // Invalidates all ids that are still around
+    ++node.generation;
+    node.next = freeList_;
+    freeList_ = index;
+    --size_;
+}
+
+void TimerWheel::CascadeLocked(unsigned level) {
+    const auto bucket = level * SLOTS + ((nextTick_ >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+    auto index = std::exchange(buckets_[bucket], NO_INDEX);
+    while (index != NO_INDEX) {
+        const auto next = nodes_[index].next;
+        InsertLocked(index);
+        index = next;
+    }
+}
+
+void TimerWheel::ProcessTickLocked(std::vector<Callback>& expired) {
+    // Whenever a level wraps around, the next slot of the level above comes within its reach
+    for (unsigned level = 1; level < LEVELS; ++level) {
+        if ((nextTick_ & ((U64{1} << (SLOT_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        CascadeLocked(level);
+    }
+
+    // Everything in this slot expires now
+    auto index = std::exchange(buckets_[nextTick_ & (SLOTS - 1)], NO_INDEX);
+    while (index != NO_INDEX) {
+        const auto next = nodes_[index].next;
+        expired.push_back(std::move(nodes_[index].callback));
+        nodes_[index].bucket = NO_INDEX;
+        FreeLocked(index);
+        index = next;
+    }
+
+    ++nextTick_;
+}
+
+size_t TimerWheel::Advance(Clock::time_point now) {
+    std::vector<Callback> expired;
+
+    {
+        std::scoped_lock lock(mutex_);
+
+        const auto currentTick = ToTick(now);
+        while (nextTick_ <= currentTick) {
+            if (size_ == 0) {
+                // Nothing to cascade or fire, an empty wheel can skip ahead
+                nextTick_ = currentTick + 1;
+                break;
+            }
+            ProcessTickLocked(expired);
+        }
+    }
+
+    for (auto& callback : expired) {
+        try {
+            callback();
+        } catch (const std::exception& e) {
+            LOG_ERROR("Timer wheel: A timer callback threw {}.", e.what());
+        }
+    }
+
+    return expired.size();
+}
+
+boost::asio::awaitable<void> TimerWheel::Run() {
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+
+    auto next = Clock::now();
+    while (!stopped_.load(std::memory_order_acquire)) {
+        next += tick_;
+        timer.expires_at(next);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+
+        const auto now = Clock::now();
+        Advance(now);
+
+        // Don't try to make up for ticks we missed, Advance() already fired what they had
+        next = std::max(next, now - tick_);
+    }
+
+    LOG_INFO("Timer wheel stopped.");
+}
+
+void TimerWheel::Stop() {
+    stopped_.store(true, std::memory_order_release);
+}
+
+} // namespace rft
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+#include <boost/asio.hpp>
+
+// A hierarchical timing wheel for the timeouts of many streams. Time advances in ticks, and every level of the wheel has 64 slots, each one covering 64
+// times as many ticks as a slot of the level below. A timer goes into the slot of the coarsest level that it fits into and moves down a level whenever
+// the level below wraps around, so arming and cancelling a timer is O(1) (a list insert or unlink), and the wheel only ever touches timers that are
+// about to expire. All timers share a single asio timer that ticks the wheel.
+//
+// The timers live in a pool that reuses the entries of expired and cancelled timers, so memory only grows with the number of timers armed at the same
+// time, not with how many were ever armed.
+
+namespace rft {
+
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    // Identifies an armed timer. Ids stay safe to use after the timer fired or was cancelled, Cancel() just returns false then.
+    struct TimerId {
+        U32 index = NO_INDEX;
+        U32 generation = 0;
+    };
+
+    explicit TimerWheel(Clock::duration tick = std::chrono::milliseconds{10}, Clock::time_point start = Clock::now());
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Timers fire on the first tick at or after their deadline. Deadlines further out than the wheel spans are clamped to its span.
+    TimerId Schedule(Clock::duration after, Callback callback);
+    TimerId ScheduleAt(Clock::time_point deadline, Callback callback);
+
+    // Returns false if the timer already fired or was cancelled
+    bool Cancel(TimerId id);
+
+    // Fires everything that expired until now and returns how many timers fired. Callbacks are called outside of the lock, so they may arm and cancel
+    // timers themselves.
+    size_t Advance(Clock::time_point now);
+
+    size_t Size() const;
+
+    Clock::duration Tick() const noexcept {
+        return tick_;
+    }
+
+    // The longest a timer can be armed for
+    Clock::duration Span() const noexcept {
+        return tick_ * static_cast<Clock::rep>(MAX_TICKS);
+    }
+
+    // Advances the wheel every tick until Stop() is called
+    boost::asio::awaitable<void> Run();
+
+    void Stop();
+
+private:
+    constexpr static U32 NO_INDEX = std::numeric_limits<U32>::max();
+    constexpr static unsigned SLOT_BITS = 6;
+    constexpr static unsigned SLOTS = 1u << SLOT_BITS;
+    constexpr static unsigned LEVELS = 4;
+    constexpr static U64 MAX_TICKS = (U64{1} << (SLOT_BITS * LEVELS)) - 1;
+
+    struct Node {
+        U64 expiry = 0;
+        U32 previous = NO_INDEX;
+        U32 next = NO_INDEX;
+        U32 generation = 0;
+        // Index into buckets_, NO_INDEX if the node is free
+        U32 bucket = NO_INDEX;
+        Callback callback;
+    };
+
+    U64 ToTick(Clock::time_point time) const noexcept;
+
+    // Puts an allocated node into the slot that its expiry belongs to, relative to nextTick_
+    void InsertLocked(U32 index);
+    void UnlinkLocked(U32 index);
+    void FreeLocked(U32 index);
+
+    // Moves all timers of a slot of a higher level down to where they belong now
+    void CascadeLocked(unsigned level);
+
+    // Processes nextTick_ and moves the callbacks of everything that expired into expired
+    void ProcessTickLocked(std::vector<Callback>& expired);
+
+    const Clock::duration tick_;
+    const Clock::time_point start_;
+
+    mutable std::mutex mutex_;
+    std::vector<Node> nodes_;
+    U32 freeList_ = NO_INDEX;
+    std::array<U32, SLOTS * LEVELS> buckets_;
+    size_t size_ = 0;
+    // The first tick that hasn't been processed yet
+    U64 nextTick_ = 0;
+
+    std::atomic<bool> stopped_{false};
+};
+
+} // namespace rft
@@ -0,0 +1,177 @@
+#include "pch.hpp"
+#include "tracing.hpp"
+
+namespace rft::tracing {
+
+namespace detail {
+std::atomic<bool> gEnabled{false};
+}
+
+namespace {
+
+struct TraceEvent {
+    std::atomic<bool> committed{false};
+    Stage stage;
+    U16 streamId;
+    U32 threadIndex;
+    clock::time_point start;
+    clock::time_point end;
+};
+
+struct TraceBuffer {
+    explicit TraceBuffer(const TracingOptions& options)
+        : sampleEvery(options.sampleEvery),
+          capacity(options.sampleEvery == 0 ? 0 : options.maxTraceEvents),
+          events(std::make_unique<TraceEvent[]>(capacity)),
+          epoch(clock::now()) {
+    }
+
+    U32 sampleEvery;
+    size_t capacity;
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<size_t> cursor{0};
+    clock::time_point epoch;
+};
+
+std::array<LatencyHistogram, static_cast<size_t>(Stage::kCount)> gHistograms;
+
+// The buffer is only ever replaced while tracing is disabled. Since Enable() and Disable() are called from main, this is good enough.
+std::unique_ptr<TraceBuffer> gTrace;
+
+U32 ThreadIndex() noexcept {
+    static std::atomic<U32> nextIndex{0};
+    thread_local const U32 index = nextIndex.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+} // namespace
+
+U64 LatencyHistogram::Mean() const noexcept {
+    const auto count = Count();
+    return count == 0 ? 0 : sum_.load(std::memory_order_relaxed) / count;
+}
+
+U64 LatencyHistogram::Percentile(double percentile) const noexcept {
+    const auto count = Count();
+    if (count == 0) {
+        return 0;
+    }
+
+    const auto target = std::max<U64>(1, static_cast<U64>(std::ceil(count * percentile / 100.0)));
+    U64 seen = 0;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return std::min(BucketLowerBound(i), Max());
+        }
+    }
+
+    return Max();
+}
+
+void LatencyHistogram::Reset() noexcept {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+void Enable(TracingOptions options) {
+    if constexpr (!COMPILED_IN) {
+        throw std::runtime_error{"Tracing was requested, but the library was built without RFT_ENABLE_TRACING."};
+    }
+
+    detail::gEnabled.store(false, std::memory_order_relaxed);
+
+    for (auto& histogram : gHistograms) {
+        histogram.Reset();
+    }
+    gTrace = std::make_unique<TraceBuffer>(options);
+
+    detail::gEnabled.store(true, std::memory_order_release);
+}
+
+void Disable() {
+    detail::gEnabled.store(false, std::memory_order_release);
+}
+
+void detail::Record(Stage stage, U16 streamId, clock::time_point start, clock::time_point end) noexcept {
+    const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    gHistograms[static_cast<size_t>(stage)].Record(static_cast<U64>(std::max<I64>(0, nanoseconds)));
+
+    auto* trace = gTrace.get();
+    if (trace == nullptr || trace->capacity == 0) {
+        return;
+    }
+
+    thread_local U32 counter = 0;
+    if (++counter % trace->sampleEvery != 0) {
+        return;
+    }
+
+    const auto slot = trace->cursor.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= trace->capacity) {
+        return;
+    }
+
+    auto& event = trace->events[slot];
+    event.stage = stage;
+    event.streamId = streamId;
+    event.threadIndex = ThreadIndex();
+    event.start = start;
+    event.end = end;
+    event.committed.store(true, std::memory_order_release);
+}
+
+const LatencyHistogram& Histogram(Stage stage) noexcept {
+    return gHistograms[static_cast<size_t>(stage)];
+}
+
+std::string HistogramReport() {
+    std::string out = "{";
+
+    for (size_t i = 0; i < gHistograms.size(); ++i) {
+        const auto& histogram = gHistograms[i];
+        std::format_to(std::back_inserter(out), R"({}"{}":{{"count":{},"mean":{},"p50":{},"p90":{},"p99":{},"p999":{},"max":{}}})", i == 0 ? "" : ",",
+                       STAGE_NAMES[i], histogram.Count(), histogram.Mean(), histogram.Percentile(50), histogram.Percentile(90), histogram.Percentile(99),
+                       histogram.Percentile(99.9), histogram.Max());
+    }
+
+    out += "}";
+    return out;
+}
+
+void WriteChromeTrace(const std::filesystem::path& path) {
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error{std::format("Could not open trace file {}.", path.string())};
+    }
+
+    file << R"({"displayTimeUnit":"ns","traceEvents":[)";
+
+    if (gTrace != nullptr) {
+        const auto& trace = *gTrace;
+        const auto count = std::min(trace.cursor.load(std::memory_order_relaxed), trace.capacity);
+
+        bool first = true;
+        for (size_t i = 0; i < count; ++i) {
+            const auto& event = trace.events[i];
+            if (!event.committed.load(std::memory_order_acquire)) {
+                continue;
+            }
+
+            const auto start = std::chrono::duration<double, std::micro>(event.start - trace.epoch).count();
+            const auto duration = std::chrono::duration<double, std::micro>(event.end - event.start).count();
+
+            file << std::format(R"({}{{"name":"{}","cat":"rft","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f},"args":{{"thread":{}}}}})", first ? "" : ",\n",
+                                STAGE_NAMES[static_cast<size_t>(event.stage)], event.streamId, start, duration, event.threadIndex);
+            first = false;
+        }
+    }
+
+    file << "]}\n";
+}
+
+} // namespace rft::tracing
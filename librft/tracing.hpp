@@ -0,0 +1,187 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <bit>
+#include <deque>
+
+// Hot path instrumentation. Unless the library is built with RFT_ENABLE_TRACING, RFT_TRACE_STAGE expands to nothing and none of this ends up in the binary.
+// If it is compiled in, but not enabled at runtime, every stage costs one relaxed load.
+
+namespace rft::tracing {
+
+enum class Stage : U8 {
+    kFileRead,
+    kCongestionControlEnqueue,
+    kChannelDequeue,
+    kSocketSend,
+    kAckReceipt,
+    kCount
+};
+
+constexpr static auto STAGE_NAMES = std::array{"FileRead", "CongestionControlEnqueue", "ChannelDequeue", "SocketSend", "AckReceipt"};
+static_assert(STAGE_NAMES.size() == static_cast<size_t>(Stage::kCount));
+
+#ifdef RFT_ENABLE_TRACING
+constexpr static bool COMPILED_IN = true;
+#else
+constexpr static bool COMPILED_IN = false;
+#endif
+
+using clock = std::chrono::steady_clock;
+
+// A log-linear histogram in the spirit of HdrHistogram: values below 2^SUB_BUCKET_BITS are exact, above that every power of two is split into
+// 2^(SUB_BUCKET_BITS - 1) linear buckets, so the relative error stays below ~3%.
+class LatencyHistogram {
+public:
+    constexpr static U32 SUB_BUCKET_BITS = 6;
+    constexpr static U64 HALF_SUB_BUCKETS = U64{1} << (SUB_BUCKET_BITS - 1);
+    constexpr static size_t BUCKET_COUNT = HALF_SUB_BUCKETS * (64 - SUB_BUCKET_BITS + 2);
+
+    constexpr static size_t BucketIndex(U64 value) noexcept {
+        if (value < (U64{1} << SUB_BUCKET_BITS)) {
+            return value;
+        }
+
+        const auto exponent = static_cast<U64>(std::bit_width(value)) - SUB_BUCKET_BITS;
+        return HALF_SUB_BUCKETS * exponent + (value >> exponent);
+    }
+
+    constexpr static U64 BucketLowerBound(size_t index) noexcept {
+        if (index < (U64{1} << SUB_BUCKET_BITS)) {
+            return index;
+        }
+
+        const auto exponent = index / HALF_SUB_BUCKETS - 1;
+        return (index - HALF_SUB_BUCKETS * exponent) << exponent;
+    }
+
+    void Record(U64 nanoseconds) noexcept {
+        buckets_[BucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+        auto max = max_.load(std::memory_order_relaxed);
+        while (nanoseconds > max && !max_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+        }
+    }
+
+    U64 Count() const noexcept {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    U64 Max() const noexcept {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    U64 Mean() const noexcept;
+
+    // Returns the lower bound of the bucket that contains the given percentile (0 - 100)
+    U64 Percentile(double percentile) const noexcept;
+
+    void Reset() noexcept;
+
+private:
+    std::array<std::atomic<U64>, BUCKET_COUNT> buckets_{};
+    std::atomic<U64> count_{0};
+    std::atomic<U64> sum_{0};
+    std::atomic<U64> max_{0};
+};
+
+static_assert(LatencyHistogram::BucketIndex(~U64{0}) < LatencyHistogram::BUCKET_COUNT);
+static_assert(LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketIndex(1000)) <= 1000);
+
+struct TracingOptions {
+    // Every n-th recorded stage (per thread) is also kept as a Chrome trace event. 0 disables the trace and only keeps the histograms.
+    U32 sampleEvery = 64;
+    size_t maxTraceEvents = 1 << 20;
+};
+
+void Enable(TracingOptions options = {});
+void Disable();
+
+namespace detail {
+extern std::atomic<bool> gEnabled;
+
+void Record(Stage stage, U16 streamId, clock::time_point start, clock::time_point end) noexcept;
+}
+
+inline bool IsEnabled() noexcept {
+    return detail::gEnabled.load(std::memory_order_relaxed);
+}
+
+const LatencyHistogram& Histogram(Stage stage) noexcept;
+
+// A JSON object with the count, mean, p50, p90, p99, p99.9 and max (in nanoseconds) of every stage
+std::string HistogramReport();
+
+// Writes the sampled events in the Chrome trace event format (chrome://tracing, Perfetto). Every stream gets its own lane.
+void WriteChromeTrace(const std::filesystem::path& path);
+
+// Measures the time between construction and destruction. Inside a coroutine, that includes the time spent suspended, which is exactly what we're after.
+class StageTimer {
+public:
+    StageTimer(Stage stage, U16 streamId) noexcept
+        : stage_(stage),
+          streamId_(streamId),
+          start_(IsEnabled() ? clock::now() : clock::time_point{}) {
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    ~StageTimer() {
+        if (start_ != clock::time_point{}) {
+            detail::Record(stage_, streamId_, start_, clock::now());
+        }
+    }
+
+private:
+    Stage stage_;
+    U16 streamId_;
+    clock::time_point start_;
+};
+
+// Remembers when each sequence number was handed to the congestion control, so that we can measure the time until it's acknowledged.
+class AckLatencyTracker {
+public:
+    void OnSend([[maybe_unused]] U64 sequenceEnd) {
+#ifdef RFT_ENABLE_TRACING
+        if (IsEnabled()) {
+            inFlight_.emplace_back(sequenceEnd, clock::now());
+        }
+#endif
+    }
+
+    void OnAck([[maybe_unused]] U16 streamId, [[maybe_unused]] U64 ackNumber) {
+#ifdef RFT_ENABLE_TRACING
+        // Whatever is left from before tracing was turned off is never recorded
+        if (!IsEnabled()) {
+            inFlight_.clear();
+            return;
+        }
+
+        const auto now = clock::now();
+        while (!inFlight_.empty() && inFlight_.front().first <= ackNumber) {
+            detail::Record(Stage::kAckReceipt, streamId, inFlight_.front().second, now);
+            inFlight_.pop_front();
+        }
+#endif
+    }
+
+private:
+#ifdef RFT_ENABLE_TRACING
+    std::deque<std::pair<U64, clock::time_point>> inFlight_;
+#endif
+};
+
+} // namespace rft::tracing
+
+#define RFT_TRACE_CONCAT_IMPL(a, b) a##b
+#define RFT_TRACE_CONCAT(a, b) RFT_TRACE_CONCAT_IMPL(a, b)
+
+#ifdef RFT_ENABLE_TRACING
+#define RFT_TRACE_STAGE(stage, streamId) const ::rft::tracing::StageTimer RFT_TRACE_CONCAT(rftStageTimer, __LINE__)(::rft::tracing::Stage::stage, (streamId))
+#else
+#define RFT_TRACE_STAGE(stage, streamId) static_cast<void>(0)
+#endif
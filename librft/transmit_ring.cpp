@@ -0,0 +1,109 @@
+#include "pch.hpp"
+#include "transmit_ring.hpp"
+
+#include "framing.hpp"
+
+namespace rft {
+
+TransmitRing::TransmitRing(size_t capacity, size_t urgentReserve)
+    : slots_(std::bit_ceil(std::max<size_t>(capacity, 2))),
+      mask_(slots_.size() - 1),
+      dataCapacity_(slots_.size() - std::min(urgentReserve, slots_.size() - 1)) {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+boost::asio::awaitable<bool> TransmitRing::Push(std::vector<char> datagram) {
+    for (;;) {
+        if (IsClosed()) {
+            co_return false;
+        }
+
+        if (TryPush(datagram, dataCapacity_)) {
+            WakeConsumer();
+            co_return true;
+        }
+
+        // Announce ourselves before checking for room again, so that the consumer either sees us waiting or we see the room it made
+        waitingProducers_.fetch_add(1, std::memory_order_seq_cst);
+        co_await space_.Wait(mutex_, [this] {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return HasDataRoom() || IsClosed();
+        });
+        waitingProducers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void TransmitRing::PushUrgent(std::vector<char> datagram) {
+    if (!TryPush(datagram, slots_.size())) {
+        std::scoped_lock lock(mutex_);
+        overflow_.push_back(std::move(datagram));
+        overflowSize_.store(overflow_.size(), std::memory_order_release);
+        overflows_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    WakeConsumer();
+}
+
+#ifdef RFT_ENABLE_TRACING
+void TransmitRing::TraceDequeue(std::span<const char> datagram, tracing::clock::time_point enqueued) noexcept {
+    // Streams patch their ID into the header before they push
+    const auto header = framing::ParseHeader(datagram);
+    tracing::detail::Record(tracing::Stage::kChannelDequeue, header ? U16{header->streamId} : U16{0}, enqueued, tracing::clock::now());
+}
+#endif
+
+bool TransmitRing::ParkIfEmpty() noexcept {
+    parked_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (!IsReadable()) {
+        return true;
+    }
+
+    // Something arrived in the meantime. If a producer already took the flag, we get a wake up we don't need, which is harmless.
+    parked_.store(false, std::memory_order_relaxed);
+    return false;
+}
+
+void TransmitRing::Close() {
+    closed_.store(true, std::memory_order_release);
+
+    {
+        std::scoped_lock lock(mutex_);
+        readable_.NotifyAll();
+        space_.NotifyAll();
+    }
+
+    if (readableHandler_) {
+        readableHandler_();
+    }
+}
+
+void TransmitRing::WakeConsumer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!parked_.load(std::memory_order_relaxed) || !parked_.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    {
+        std::scoped_lock lock(mutex_);
+        readable_.NotifyAll();
+    }
+
+    // Outside of our lock, the handler is free to take its own
+    if (readableHandler_) {
+        readableHandler_();
+    }
+}
+
+void TransmitRing::WakeProducers() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waitingProducers_.load(std::memory_order_relaxed) > 0) {
+        std::scoped_lock lock(mutex_);
+        space_.NotifyAll();
+    }
+}
+
+} // namespace rft
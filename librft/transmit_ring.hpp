@@ -0,0 +1,217 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <bit>
+#include <deque>
+#include <mutex>
+
+#include <boost/asio.hpp>
+
+#include "tracing.hpp"
+#include "wait_queue.hpp"
+
+// The queue between a stream (or rather its congestion control) and whoever puts its datagrams on the wire. It is a bounded lock-free ring of datagram
+// buffers (Vyukov's bounded queue) with any number of producers and exactly one consumer. Handing over a datagram costs a CAS and two stores; the mutex
+// is only taken when one side has to park because the ring is full or empty.
+//
+// Datagrams come in two kinds: data, which waits for room (that's our backpressure), and urgent datagrams like ACKs, which must never be lost or wait for
+// data. A part of the ring is reserved for urgent datagrams, and if even that is used up, they go to an overflow list that the consumer drains first.
+//
+// With tracing, every datagram in the ring is stamped when it is pushed, and the ChannelDequeue stage is the time it spent in the ring until it was popped.
+
+namespace rft {
+
+class TransmitRing {
+public:
+    // The capacity is rounded up to a power of two. urgentReserve slots can only be used by PushUrgent().
+    explicit TransmitRing(size_t capacity = 64, size_t urgentReserve = 8);
+
+    TransmitRing(const TransmitRing&) = delete;
+    TransmitRing& operator=(const TransmitRing&) = delete;
+
+    // Producers
+
+    // Waits while the ring is full. Returns false (and drops the datagram) if the ring was closed.
+    boost::asio::awaitable<bool> Push(std::vector<char> datagram);
+
+    // Never waits and never drops
+    void PushUrgent(std::vector<char> datagram);
+
+    // Consumer
+
+    // Appends up to max datagrams to out and returns how many there were
+    template <typename Container>
+    size_t TryPopBatch(Container& out, size_t max);
+
+    // Waits until there is at least one datagram. Returns 0 once the ring is closed and drained.
+    template <typename Container>
+    boost::asio::awaitable<size_t> PopBatch(Container& out, size_t max);
+
+    // For consumers that serve many rings: returns true if the ring is empty, in which case the readable handler is called as soon as something arrives.
+    // Returns false if there is something to pop.
+    bool ParkIfEmpty() noexcept;
+
+    // Called (on the producer's thread) when a parked ring becomes readable and when it is closed. Has to be set before the ring is used.
+    void SetReadableHandler(std::function<void()> handler) {
+        readableHandler_ = std::move(handler);
+    }
+
+    // Wakes up everybody. Data pushed afterwards is dropped, what's already queued can still be popped.
+    void Close();
+
+    bool IsClosed() const noexcept {
+        return closed_.load(std::memory_order_acquire);
+    }
+
+    size_t Capacity() const noexcept {
+        return slots_.size();
+    }
+
+    // Urgent datagrams that didn't fit into the ring
+    U64 Overflows() const noexcept {
+        return overflows_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<size_t> sequence{0};
+        std::vector<char> datagram;
+#ifdef RFT_ENABLE_TRACING
+        tracing::clock::time_point enqueued;
+#endif
+    };
+
+    bool TryPush(std::vector<char>& datagram, size_t limit) noexcept;
+
+#ifdef RFT_ENABLE_TRACING
+    // Records the ChannelDequeue stage for the stream the datagram belongs to
+    static void TraceDequeue(std::span<const char> datagram, tracing::clock::time_point enqueued) noexcept;
+#endif
+
+    // Both positions only ever grow, but the two loads aren't atomic together, so the dequeue position might already be past the enqueue position we saw
+    static size_t Used(size_t enqueuePosition, size_t dequeuePosition) noexcept {
+        return enqueuePosition > dequeuePosition ? enqueuePosition - dequeuePosition : 0;
+    }
+
+    bool HasDataRoom() const noexcept {
+        return Used(enqueuePosition_.load(std::memory_order_relaxed), dequeuePosition_.load(std::memory_order_relaxed)) < dataCapacity_;
+    }
+
+    bool IsReadable() const noexcept {
+        const auto position = dequeuePosition_.load(std::memory_order_relaxed);
+        return slots_[position & mask_].sequence.load(std::memory_order_acquire) == position + 1 || overflowSize_.load(std::memory_order_acquire) > 0;
+    }
+
+    // The producer half of the parking protocol
+    void WakeConsumer();
+
+    // The consumer half of the backpressure protocol
+    void WakeProducers();
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t dataCapacity_;
+
+    alignas(64) std::atomic<size_t> enqueuePosition_{0};
+    alignas(64) std::atomic<size_t> dequeuePosition_{0};
+
+    alignas(64) std::atomic<bool> parked_{false};
+    std::atomic<size_t> waitingProducers_{0};
+    std::atomic<bool> closed_{false};
+
+    std::mutex mutex_;
+    WaitQueue readable_;
+    WaitQueue space_;
+    std::function<void()> readableHandler_;
+
+    // Not stamped, only urgent datagrams end up here
+    std::deque<std::vector<char>> overflow_;
+    std::atomic<size_t> overflowSize_{0};
+    std::atomic<U64> overflows_{0};
+};
+
+inline bool TransmitRing::TryPush(std::vector<char>& datagram, size_t limit) noexcept {
+    auto position = enqueuePosition_.load(std::memory_order_relaxed);
+
+    for (;;) {
+        if (Used(position, dequeuePosition_.load(std::memory_order_relaxed)) >= limit) {
+            return false;
+        }
+
+        auto& slot = slots_[position & mask_];
+        const auto sequence = slot.sequence.load(std::memory_order_acquire);
+        const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+
+        if (difference == 0) {
+            if (enqueuePosition_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                slot.datagram = std::move(datagram);
+#ifdef RFT_ENABLE_TRACING
+                slot.enqueued = tracing::IsEnabled() ? tracing::clock::now() : tracing::clock::time_point{};
+#endif
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // The consumer hasn't freed this slot yet
+            return false;
+        } else {
+            position = enqueuePosition_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename Container>
+size_t TransmitRing::TryPopBatch(Container& out, size_t max) {
+    size_t count = 0;
+
+    if (overflowSize_.load(std::memory_order_acquire) > 0) {
+        std::scoped_lock lock(mutex_);
+        while (!overflow_.empty() && count < max) {
+            out.push_back(std::move(overflow_.front()));
+            overflow_.pop_front();
+            ++count;
+        }
+        overflowSize_.store(overflow_.size(), std::memory_order_release);
+    }
+
+    auto position = dequeuePosition_.load(std::memory_order_relaxed);
+    for (; count < max; ++count, ++position) {
+        auto& slot = slots_[position & mask_];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            break;
+        }
+
+#ifdef RFT_ENABLE_TRACING
+        if (slot.enqueued != tracing::clock::time_point{}) {
+            TraceDequeue(slot.datagram, slot.enqueued);
+        }
+#endif
+        out.push_back(std::move(slot.datagram));
+        slot.sequence.store(position + slots_.size(), std::memory_order_release);
+        dequeuePosition_.store(position + 1, std::memory_order_relaxed);
+    }
+
+    if (count > 0) {
+        WakeProducers();
+    }
+
+    return count;
+}
+
+template <typename Container>
+boost::asio::awaitable<size_t> TransmitRing::PopBatch(Container& out, size_t max) {
+    for (;;) {
+        if (const auto count = TryPopBatch(out, max); count > 0) {
+            co_return count;
+        }
+
+        if (IsClosed() && !IsReadable()) {
+            co_return 0;
+        }
+
+        co_await readable_.Wait(mutex_, [this] { return !ParkIfEmpty() || IsClosed(); });
+    }
+}
+
+} // namespace rft
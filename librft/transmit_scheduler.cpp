@@ -0,0 +1,198 @@
+#include "pch.hpp"
+#include "transmit_scheduler.hpp"
+
+#include "logger.hpp"
+#include "tracing.hpp"
+
+namespace rft {
+
+TransmitScheduler::TransmitScheduler(boost::asio::ip::udp::socket& socket, metrics::EndpointMetrics& endpointMetrics, TransmitSchedulerOptions options)
+    : socket_(socket),
+      endpointMetrics_(endpointMetrics),
+      options_(options) {
+    options_.quantumBytes = std::max(options_.quantumBytes, MAX_DATAGRAM_SIZE);
+    options_.batchSize = std::max<size_t>(options_.batchSize, 1);
+    options_.flowQueueLimit = std::max<size_t>(options_.flowQueueLimit, 1);
+}
+
+void TransmitScheduler::AddFlow(U16 id, boost::asio::ip::udp::endpoint destination, unsigned weight, std::shared_ptr<metrics::StreamMetrics> streamMetrics,
+                                TransmitRing& ring) {
+    {
+        std::scoped_lock lock(mutex_);
+
+        auto& flow = flows_[id];
+        flow.destination = std::move(destination);
+        flow.weight = std::max(weight, 1u);
+        flow.metrics = std::move(streamMetrics);
+        flow.ring = &ring;
+        LOG_DEBUG("Transmit scheduler: Added flow {} with weight {}.", id, flow.weight);
+    }
+
+    ring.SetReadableHandler([this, id] { Activate(id); });
+    // The ring might not be empty anymore
+    Activate(id);
+}
+
+void TransmitScheduler::RemoveFlow(U16 id) {
+    std::scoped_lock lock(mutex_);
+
+    if (auto it = flows_.find(id); it != flows_.end()) {
+        if (!it->second.queue.empty()) {
+            LOG_DEBUG("Transmit scheduler: Flow {} was removed with {} datagrams still queued.", id, it->second.queue.size());
+        }
+
+        flows_.erase(it);
+        std::erase(activeFlows_, id);
+    }
+}
+
+void TransmitScheduler::Activate(U16 id) {
+    std::scoped_lock lock(mutex_);
+
+    const auto it = flows_.find(id);
+    if (it == flows_.end() || it->second.active) {
+        return;
+    }
+
+    it->second.active = true;
+    activeFlows_.push_back(id);
+    work_.NotifyAll();
+}
+
+void TransmitScheduler::Stop() {
+    std::scoped_lock lock(mutex_);
+    stopped_ = true;
+    work_.NotifyAll();
+}
+
+bool TransmitScheduler::RefillLocked(Flow& flow) {
+    if (flow.queue.empty()) {
+        flow.ring->TryPopBatch(flow.queue, options_.batchSize);
+    }
+
+    return !flow.queue.empty();
+}
+
+void TransmitScheduler::TakeBatchLocked(std::vector<Transmission>& batch) {
+    while (batch.size() < options_.batchSize && !activeFlows_.empty()) {
+        const auto id = activeFlows_.front();
+        auto& flow = flows_.at(id);
+
+        if (!flow.inRound) {
+            flow.deficit += options_.quantumBytes * flow.weight;
+            flow.inRound = true;
+        }
+
+        while (batch.size() < options_.batchSize && RefillLocked(flow) && flow.queue.front().size() <= flow.deficit) {
+            flow.deficit -= flow.queue.front().size();
+            batch.push_back({id, flow.destination, std::move(flow.queue.front()), flow.metrics});
+            flow.queue.pop_front();
+        }
+
+        // The batch is full, but the flow isn't done with its round yet
+        if (batch.size() >= options_.batchSize && RefillLocked(flow) && flow.queue.front().size() <= flow.deficit) {
+            break;
+        }
+
+        activeFlows_.pop_front();
+        flow.inRound = false;
+
+        if (RefillLocked(flow)) {
+            activeFlows_.push_back(id);
+            continue;
+        }
+
+        // Idle flows don't get to save up
+        flow.deficit = 0;
+        if (flow.ring->ParkIfEmpty()) {
+            // The ring calls Activate() as soon as the stream sends again
+            flow.active = false;
+        } else {
+            activeFlows_.push_back(id);
+        }
+    }
+}
+
+boost::asio::awaitable<void> TransmitScheduler::Throttle(boost::asio::steady_timer& timer, size_t size) {
+    if (options_.egressBytesPerSecond <= 0.0) {
+        co_return;
+    }
+
+    // Allow a burst of one batch
+    const auto burst = static_cast<double>(options_.batchSize * MAX_DATAGRAM_SIZE);
+
+    const auto refill = [this, burst] {
+        const auto now = std::chrono::steady_clock::now();
+        tokens_ = std::min(burst, tokens_ + std::chrono::duration<double>(now - lastRefill_).count() * options_.egressBytesPerSecond);
+        lastRefill_ = now;
+    };
+
+    refill();
+    if (tokens_ < static_cast<double>(size)) {
+        endpointMetrics_.egressThrottled.Add();
+        timer.expires_after(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>((static_cast<double>(size) - tokens_) / options_.egressBytesPerSecond)));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        refill();
+    }
+
+    tokens_ -= static_cast<double>(size);
+}
+
+boost::asio::awaitable<void> TransmitScheduler::Run() {
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+    std::vector<Transmission> batch;
+    batch.reserve(options_.batchSize);
+
+    for (;;) {
+        co_await work_.Wait(mutex_, [this] { return stopped_ || !activeFlows_.empty(); });
+
+        {
+            std::scoped_lock lock(mutex_);
+            if (stopped_) {
+                break;
+            }
+
+            TakeBatchLocked(batch);
+        }
+
+        if (batch.empty()) {
+            continue;
+        }
+        endpointMetrics_.transmitBatches.Add();
+
+        for (auto& transmission : batch) {
+            co_await Throttle(timer, transmission.datagram.size());
+
+            size_t size = 0;
+            try {
+                RFT_TRACE_STAGE(kSocketSend, transmission.id);
+                size = co_await socket_.async_send_to(boost::asio::buffer(transmission.datagram), transmission.destination, boost::asio::use_awaitable);
+            } catch (const boost::system::system_error& e) {
+                // One unreachable client must not take down the others
+                LOG_ERROR("Transmit scheduler: Sending for flow {} failed: {}", transmission.id, e.what());
+                continue;
+            }
+            LOG_TRACE("Stream {}: Sent {} bytes to {}.", transmission.id, size, transmission.destination.address().to_string());
+            if (capture_ != nullptr) {
+                capture_->Record(CaptureDirection::kOutbound, transmission.destination, transmission.datagram);
+            }
+
+            transmission.metrics->datagramsSent.Add();
+            transmission.metrics->bytesSent.Add(size);
+            endpointMetrics_.datagramsSent.Add();
+            endpointMetrics_.bytesSent.Add(size);
+
+            if (size != transmission.datagram.size()) {
+                LOG_ERROR("In stream {} fewer bytes than the message size were sent out. Expected size: {}, actual size: {}.", transmission.id,
+                          transmission.datagram.size(), size);
+            }
+        }
+
+        batch.clear();
+    }
+
+    LOG_INFO("Transmit scheduler stopped.");
+}
+
+} // namespace rft
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include <boost/asio.hpp>
+
+#include "capture.hpp"
+#include "messages.hpp"
+#include "metrics.hpp"
+#include "transmit_ring.hpp"
+#include "wait_queue.hpp"
+
+// The only place that writes stream datagrams to the server's socket. Every stream has its own TransmitRing, and a single loop drains the rings with
+// weighted deficit round robin: every round a flow may send quantum * weight bytes, so flows get a share of the socket that is proportional to their
+// weight, independent of their datagram sizes and of how the executor happens to schedule the streams. An optional token bucket caps the egress rate of
+// all flows together.
+
+namespace rft {
+
+struct TransmitSchedulerOptions {
+    // Bytes a flow of weight 1 may send per round. Never less than one full datagram, so every flow makes progress in every round.
+    size_t quantumBytes = MAX_DATAGRAM_SIZE;
+    // Bytes per second over all flows, 0 means no limit
+    double egressBytesPerSecond = 0.0;
+    // Datagrams taken out of the flows under one lock
+    size_t batchSize = 32;
+    // Capacity of the ring of every flow, i.e. the datagrams a stream may have queued before it has to wait
+    size_t flowQueueLimit = 64;
+
+    // Used by the server to pick the weight of a new stream: downloads of small files are interactive and shouldn't starve behind bulk transfers
+    U64 interactiveFileSize = 1024 * 1024;
+    unsigned interactiveWeight = 4;
+};
+
+class TransmitScheduler {
+public:
+    TransmitScheduler(boost::asio::ip::udp::socket& socket, metrics::EndpointMetrics& endpointMetrics, TransmitSchedulerOptions options = {});
+
+    const TransmitSchedulerOptions& Options() const noexcept {
+        return options_;
+    }
+
+    // Records every datagram that was sent. Has to be set before Run().
+    void SetCaptureWriter(CaptureWriter* capture) noexcept {
+        capture_ = capture;
+    }
+
+    // The ring has to outlive the flow
+    void AddFlow(U16 id, boost::asio::ip::udp::endpoint destination, unsigned weight, std::shared_ptr<metrics::StreamMetrics> streamMetrics, TransmitRing& ring);
+
+    // Drops whatever the flow still has queued
+    void RemoveFlow(U16 id);
+
+    // The drain loop, runs until Stop() is called
+    boost::asio::awaitable<void> Run();
+
+    void Stop();
+
+private:
+    struct Flow {
+        boost::asio::ip::udp::endpoint destination;
+        unsigned weight = 1;
+        TransmitRing* ring = nullptr;
+        // Taken out of the ring, but not sent yet, because the flow ran out of deficit
+        std::deque<std::vector<char>> queue;
+        size_t deficit = 0;
+        // Whether the flow is in activeFlows_
+        bool active = false;
+        // Whether the flow already got its quantum for the current round, a round can span several batches
+        bool inRound = false;
+        std::shared_ptr<metrics::StreamMetrics> metrics;
+    };
+
+    struct Transmission {
+        U16 id;
+        boost::asio::ip::udp::endpoint destination;
+        std::vector<char> datagram;
+        std::shared_ptr<metrics::StreamMetrics> metrics;
+    };
+
+    // Called by a flow's ring when it has something to send again
+    void Activate(U16 id);
+
+    // Returns true if the flow has a datagram ready
+    bool RefillLocked(Flow& flow);
+
+    // Takes up to batchSize datagrams out of the active flows, in deficit round robin order
+    void TakeBatchLocked(std::vector<Transmission>& batch);
+
+    // Waits until the token bucket has room for size bytes
+    boost::asio::awaitable<void> Throttle(boost::asio::steady_timer& timer, size_t size);
+
+    boost::asio::ip::udp::socket& socket_;
+    metrics::EndpointMetrics& endpointMetrics_;
+    TransmitSchedulerOptions options_;
+    CaptureWriter* capture_ = nullptr;
+
+    std::mutex mutex_;
+    std::unordered_map<U16, Flow> flows_;
+    std::deque<U16> activeFlows_;
+    bool stopped_ = false;
+    // The drain loop waits for a flow to become active
+    WaitQueue work_;
+
+    // Only touched by Run()
+    double tokens_ = 0.0;
+    std::chrono::steady_clock::time_point lastRefill_ = std::chrono::steady_clock::now();
+};
+
+} // namespace rft
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "pch.hpp"
+
+#include <atomic>
+#include <mutex>
+
+#include <boost/asio.hpp>
+
+namespace rft {
+
+// Parks coroutines until a condition that is guarded by an external mutex becomes true. Wait() checks the condition and parks under that mutex, and
+// NotifyAll() has to be called with the mutex held after the state the condition depends on has changed, so a notification can never get lost. Parked
+// coroutines are resumed on their own executor, never inline in NotifyAll().
+class WaitQueue {
+public:
+    // Returns right away if ready() holds, otherwise after the next NotifyAll(). Callers have to check their condition again afterwards.
+    template <typename Predicate>
+    boost::asio::awaitable<void> Wait(std::mutex& mutex, Predicate ready) {
+        co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void()>(
+            [this, &mutex, &ready](auto handler) {
+                // std::function needs something copyable
+                auto shared = std::make_shared<decltype(handler)>(std::move(handler));
+                auto resume = [shared] { boost::asio::post(std::move(*shared)); };
+
+                std::unique_lock lock(mutex);
+                if (ready()) {
+                    lock.unlock();
+                    resume();
+                } else {
+                    waiters_.emplace_back(std::move(resume));
+                }
+            },
+            boost::asio::use_awaitable);
+    }
+
+    // Like Wait(), but also returns once timeout has passed. Doesn't depend on cancellation, so it can bound waits on coroutines that don't support it.
+    template <typename Predicate>
+    boost::asio::awaitable<void> WaitFor(std::mutex& mutex, Predicate ready, std::chrono::steady_clock::duration timeout) {
+        co_await boost::asio::async_initiate<decltype(boost::asio::use_awaitable), void()>(
+            [this, &mutex, &ready, timeout](auto handler) {
+                // Whichever comes first, the notification or the timer, resumes the coroutine. The timer only touches the shared state, so it may fire
+                // after the queue and the mutex are gone.
+                using Handler = decltype(handler);
+                struct State {
+                    explicit State(Handler handler)
+                        : handler(std::move(handler)),
+                          timer(boost::asio::get_associated_executor(this->handler)) {
+                    }
+
+                    Handler handler;
+                    boost::asio::steady_timer timer;
+                    std::atomic<bool> resumed{false};
+                };
+                auto state = std::make_shared<State>(std::move(handler));
+                auto resume = [state] {
+                    if (!state->resumed.exchange(true)) {
+                        boost::asio::post(std::move(state->handler));
+                    }
+                };
+
+                {
+                    std::unique_lock lock(mutex);
+                    if (ready()) {
+                        lock.unlock();
+                        resume();
+                        return;
+                    }
+                    waiters_.emplace_back(resume);
+                }
+
+                state->timer.expires_after(timeout);
+                state->timer.async_wait([resume](const boost::system::error_code&) { resume(); });
+            },
+            boost::asio::use_awaitable);
+    }
+
+    void NotifyAll() {
+        auto waiters = std::exchange(waiters_, {});
+        for (auto& waiter : waiters) {
+            waiter();
+        }
+    }
+
+private:
+    std::vector<std::function<void()>> waiters_;
+};
+
+} // namespace rft
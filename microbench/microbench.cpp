@@ -0,0 +1,260 @@
+#include "pch.hpp"
+
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio.hpp>
+#include <hash-library/sha3.h>
+
+#include "../librft/logger.hpp"
+#include "../librft/messages.hpp"
+#include "../librft/framing.hpp"
+#include "../librft/congestion_control.hpp"
+#include "../librft/metrics.hpp"
+#include "../librft/tracing.hpp"
+#include "../librft/transmit_ring.hpp"
+
+namespace {
+
+using namespace rft;
+
+// Messages
+
+void BM_BuildChunkMessage(benchmark::State& state) {
+    std::array<U8, sizeof(ChunkMessage::payload)> payload{};
+    payload.fill(0xAB);
+
+    for (auto _ : state) {
+        auto buffer = framing::SerializeChunkHeader(MessageBase{0, MessageType::kChunk, 0}, {0}, payload.size());
+        std::ranges::copy(payload, framing::ChunkPayload(buffer).begin());
+        benchmark::DoNotOptimize(buffer.data());
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * sizeof(ChunkMessage::payload)));
+}
+BENCHMARK(BM_BuildChunkMessage);
+
+void BM_ParseChunkMessage(benchmark::State& state) {
+    auto buffer = framing::SerializeChunkHeader(MessageBase{42, MessageType::kChunk, 1234}, {0}, sizeof(ChunkMessage::payload));
+    std::array<char, sizeof(ChunkMessage::payload)> destination{};
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(buffer.data());
+        if (const auto chunk = framing::ParseChunk(buffer)) {
+            std::ranges::copy(chunk->payload, destination.begin());
+        }
+        benchmark::DoNotOptimize(destination.data());
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * sizeof(ChunkMessage::payload)));
+}
+BENCHMARK(BM_ParseChunkMessage);
+
+void BM_BuildAckMessage(benchmark::State& state) {
+    U64 ackNumber = 0;
+
+    for (auto _ : state) {
+        auto buffer = framing::Serialize(AckMessage{1, MessageType::kAck, 0, 64, ackNumber++});
+        benchmark::DoNotOptimize(buffer.data());
+    }
+}
+BENCHMARK(BM_BuildAckMessage);
+
+void BM_ParseAckMessage(benchmark::State& state) {
+    const auto buffer = framing::Serialize(AckMessage{1, MessageType::kAck, 0, 64, 12345});
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(buffer.data());
+        const auto ack = framing::Parse<AckMessage>(buffer);
+        benchmark::DoNotOptimize(ack->ackNumber);
+    }
+}
+BENCHMARK(BM_ParseAckMessage);
+
+// Hashing (the pass over the whole file in ServerStream::SendServerHello)
+
+void BM_Sha3(benchmark::State& state) {
+    std::vector<char> buffer(static_cast<size_t>(state.range(0)), 'x');
+
+    for (auto _ : state) {
+        SHA3 sha3;
+        sha3.add(buffer.data(), buffer.size());
+        benchmark::DoNotOptimize(sha3.getHash());
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * buffer.size()));
+}
+BENCHMARK(BM_Sha3)->Arg(sizeof(ChunkMessage::payload))->Arg(64 * 1024)->Arg(10 * 1024 * 1024);
+
+// Congestion control
+
+void BM_CongestionControlSend(benchmark::State& state) {
+    boost::asio::io_context context;
+    CongestionControl::output_queue queue;
+    RenolikeCongestionControl congestionControl(queue);
+    congestionControl.SetStreamId(1);
+    std::vector<std::vector<char>> drained;
+
+    boost::asio::co_spawn(
+        context,
+        [&]() -> boost::asio::awaitable<void> {
+            for (auto _ : state) {
+                co_await congestionControl.Send(framing::SerializeChunkHeader(MessageBase{0, MessageType::kChunk, 0}, {0}, sizeof(ChunkMessage::payload)));
+                queue.TryPopBatch(drained, 1);
+                drained.clear();
+            }
+        },
+        boost::asio::detached);
+
+    context.run();
+}
+BENCHMARK(BM_CongestionControlSend);
+
+void BM_CongestionControlPushMessage(benchmark::State& state) {
+    CongestionControl::output_queue queue;
+    RenolikeCongestionControl congestionControl(queue);
+    congestionControl.SetStreamId(1);
+    std::vector<std::vector<char>> drained;
+
+    U64 sequenceNumber = 0;
+    for (auto _ : state) {
+        auto buffer = framing::SerializeChunkHeader(MessageBase{1, MessageType::kChunk, sequenceNumber}, {0}, sizeof(ChunkMessage::payload));
+        sequenceNumber += buffer.size();
+
+        congestionControl.PushMessage(std::move(buffer));
+        benchmark::DoNotOptimize(congestionControl.TryReceive());
+        // The ACK
+        queue.TryPopBatch(drained, 1);
+        drained.clear();
+    }
+}
+BENCHMARK(BM_CongestionControlPushMessage);
+
+// Handing a datagram from a stream to the sender coroutine through the output queue, the argument is the batch size of the consumer
+void BM_TransmitRingHandoff(benchmark::State& state) {
+    boost::asio::io_context context;
+    TransmitRing ring;
+    const auto batchSize = static_cast<size_t>(state.range(0));
+
+    boost::asio::co_spawn(
+        context,
+        [&]() -> boost::asio::awaitable<void> {
+            for (auto _ : state) {
+                co_await ring.Push(std::vector<char>(sizeof(ChunkMessage)));
+            }
+            ring.Close();
+        },
+        boost::asio::detached);
+
+    boost::asio::co_spawn(
+        context,
+        [&]() -> boost::asio::awaitable<void> {
+            std::vector<std::vector<char>> batch;
+            while (co_await ring.PopBatch(batch, batchSize) > 0) {
+                benchmark::DoNotOptimize(batch.data());
+                batch.clear();
+            }
+        },
+        boost::asio::detached);
+
+    context.run();
+}
+BENCHMARK(BM_TransmitRingHandoff)->Arg(1)->Arg(32);
+
+// Several streams on their own threads pushing into one ring, while a single consumer drains it
+void BM_TransmitRingContended(benchmark::State& state) {
+    static TransmitRing ring(1024);
+    static std::atomic<bool> running{false};
+    static std::thread consumer;
+
+    if (state.thread_index() == 0) {
+        running = true;
+        consumer = std::thread([] {
+            std::vector<std::vector<char>> batch;
+            while (running.load(std::memory_order_relaxed)) {
+                ring.TryPopBatch(batch, 32);
+                batch.clear();
+            }
+        });
+    }
+
+    for (auto _ : state) {
+        ring.PushUrgent(std::vector<char>(sizeof(AckMessage)));
+    }
+
+    if (state.thread_index() == 0) {
+        running = false;
+        consumer.join();
+        std::vector<std::vector<char>> rest;
+        while (ring.TryPopBatch(rest, 1024) > 0) {
+            rest.clear();
+        }
+    }
+}
+BENCHMARK(BM_TransmitRingContended)->Threads(1)->Threads(4);
+
+// Logging
+
+class AsyncLogging : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State&) override {
+        log::StartAsyncLogging({.file = std::filesystem::temp_directory_path() / "rft_microbench.log", .minimumSeverity = kInfo});
+    }
+
+    void TearDown(const benchmark::State&) override {
+        log::StopAsyncLogging();
+    }
+};
+
+// Compiled out in release builds (RFT_LOG_MIN_LEVEL > 0)
+BENCHMARK_F(AsyncLogging, LogTrace)(benchmark::State& state) {
+    int chunk = 0;
+    for (auto _ : state) {
+        LOG_TRACE("Stream {}: Sending chunk {}.", 1, chunk++);
+    }
+}
+
+// Compiled in, but filtered at runtime
+BENCHMARK_F(AsyncLogging, LogDebugFiltered)(benchmark::State& state) {
+    int chunk = 0;
+    for (auto _ : state) {
+        LOG_DEBUG("Stream {}: Sending chunk {}.", 1, chunk++);
+    }
+}
+
+// Formatted and pushed into the ring of this thread
+BENCHMARK_F(AsyncLogging, LogInfo)(benchmark::State& state) {
+    int chunk = 0;
+    for (auto _ : state) {
+        LOG_INFO("Chunk {}: Wrote {} bytes to file.", chunk++, 997);
+    }
+}
+
+// Instrumentation
+
+void BM_MetricsCounter(benchmark::State& state) {
+    static metrics::StreamMetrics streamMetrics;
+
+    for (auto _ : state) {
+        streamMetrics.datagramsSent.Add();
+        streamMetrics.bytesSent.Add(sizeof(ChunkMessage));
+    }
+}
+BENCHMARK(BM_MetricsCounter)->ThreadRange(1, 8);
+
+void BM_LatencyHistogramRecord(benchmark::State& state) {
+    static tracing::LatencyHistogram histogram;
+
+    U64 value = 1;
+    for (auto _ : state) {
+        histogram.Record(value);
+        value = value * 6364136223846793005ull + 1442695040888963407ull;
+        value >>= 40;
+    }
+}
+BENCHMARK(BM_LatencyHistogramRecord)->ThreadRange(1, 8);
+
+} // namespace
+
+BENCHMARK_MAIN();
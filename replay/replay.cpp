@@ -0,0 +1,186 @@
+#include "pch.hpp"
+
+#include <boost/program_options.hpp>
+#include <future>
+#include <iostream>
+
+#include "../librft/capture.hpp"
+#include "../librft/logger.hpp"
+#include "../librft/server.hpp"
+
+// Replays the inbound datagrams of a server capture (server --capture-file) against a fresh server in this process, as fast as it can or with the
+// original timing, and reports how long the server took. Captures of real transfers make reproducible load for performance regressions.
+//
+// The replayed server doesn't see the original clients, so everything it sends goes to a local sink socket that only counts it. It doesn't ask for
+// cookies, and every ClientHello that opened a stream in the capture opens one with the same stream ID again, so the ACKs that follow still find
+// their stream. Hellos that were answered with a HelloRetry or an error, or not at all, are left out.
+
+namespace options = boost::program_options;
+namespace ip = boost::asio::ip;
+
+namespace {
+
+struct ReplayedDatagram {
+    rft::CapturedDatagram captured;
+    // The stream a ClientHello opened in the capture
+    std::optional<rft::Server::StreamId> streamId;
+};
+
+bool IsHelloAnswer(const std::optional<rft::MessageBase>& header) noexcept {
+    return header && (header->messageType == rft::MessageType::kServerHello || header->messageType == rft::MessageType::kHelloRetry ||
+                      header->messageType == rft::MessageType::kError);
+}
+
+// Keeps the inbound datagrams, and of those only the ClientHellos that opened a stream
+std::vector<ReplayedDatagram> SelectInbound(std::vector<rft::CapturedDatagram> records, U64& skippedHellos) {
+    // The server's first answer to the same peer tells what became of a hello. Going backwards, we always know the next answer to every peer, so
+    // captures of hello floods, most of which were never answered, don't take quadratic time.
+    std::vector<std::optional<rft::Server::StreamId>> openedStream(records.size());
+    std::map<ip::udp::endpoint, std::optional<rft::Server::StreamId>> nextAnswer;
+    for (size_t i = records.size(); i-- > 0;) {
+        const auto& record = records[i];
+        const auto header = rft::framing::ParseHeader(record.datagram);
+        if (record.direction == rft::CaptureDirection::kOutbound) {
+            if (IsHelloAnswer(header)) {
+                nextAnswer[record.peer] = header->messageType == rft::MessageType::kServerHello ? std::optional{rft::Server::StreamId{header->streamId}} : std::nullopt;
+            }
+        } else if (header && header->messageType == rft::MessageType::kClientHello) {
+            if (const auto answer = nextAnswer.find(record.peer); answer != nextAnswer.end()) {
+                openedStream[i] = answer->second;
+            }
+        }
+    }
+
+    std::vector<ReplayedDatagram> inbound;
+    for (size_t i = 0; i < records.size(); ++i) {
+        auto& record = records[i];
+        if (record.direction != rft::CaptureDirection::kInbound) {
+            continue;
+        }
+
+        const auto header = rft::framing::ParseHeader(record.datagram);
+        if (!header || header->messageType != rft::MessageType::kClientHello) {
+            inbound.push_back({std::move(record), std::nullopt});
+            continue;
+        }
+
+        if (!openedStream[i]) {
+            ++skippedHellos;
+            continue;
+        }
+        inbound.push_back({std::move(record), openedStream[i]});
+    }
+
+    return inbound;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "Print help message")
+        ("capture", options::value<std::string>()->required(), "Capture written by server --capture-file")
+        ("root", options::value<std::string>(), "Directory with the files the capture requested (default: the server's default root directory)")
+        ("realtime", "Keep the original gaps between the datagrams instead of replaying as fast as possible")
+        ("speed", options::value<double>()->default_value(1.0), "With --realtime, replay this many times faster than the original")
+        ("threads", options::value<unsigned>()->default_value(4), "Number of I/O threads")
+        ("drain-ms", options::value<unsigned>()->default_value(1000), "How long to keep counting what the server sends after the last datagram")
+        ("label", options::value<std::string>()->default_value(""), "Free-form label copied to the output, e.g. a commit hash")
+        ("log-level", options::value<std::string>()->default_value("warning"), "Minimum log level (trace, debug, info, warning, error, fatal)");
+
+    options::variables_map map;
+    options::store(options::parse_command_line(argc, argv, desc), map);
+
+    if (map.count("help") > 0) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+    options::notify(map);
+
+    const auto severity = rft::log::ParseSeverity(map["log-level"].as<std::string>());
+    if (!severity) {
+        std::cout << "Unknown log level " << map["log-level"].as<std::string>() << "\n";
+        return 1;
+    }
+    rft::log::StartAsyncLogging({.minimumSeverity = *severity});
+
+    const auto capturePath = map["capture"].as<std::string>();
+    U64 records = 0;
+    U64 skippedHellos = 0;
+    std::vector<ReplayedDatagram> inbound;
+    {
+        auto captured = rft::CaptureReader(capturePath).ReadAll();
+        records = captured.size();
+        inbound = SelectInbound(std::move(captured), skippedHellos);
+    }
+
+    const bool realtime = map.count("realtime") > 0;
+    const auto speed = std::max(map["speed"].as<double>(), 1e-3);
+    const std::filesystem::path root = map.count("root") > 0 ? std::filesystem::path{map["root"].as<std::string>()} : rft::Server::DefaultRootDirectory();
+
+    boost::asio::thread_pool ioContext(map["threads"].as<unsigned>());
+
+    // Stands in for all the original clients
+    ip::udp::socket sink(ioContext, ip::udp::endpoint{ip::make_address("127.0.0.1"), 0});
+    const auto sinkEndpoint = sink.local_endpoint();
+    std::atomic<U64> sinkDatagrams = 0;
+    std::atomic<U64> sinkBytes = 0;
+    boost::asio::co_spawn(
+        ioContext,
+        [&sink, &sinkDatagrams, &sinkBytes]() -> boost::asio::awaitable<void> {
+            std::vector<char> buffer(rft::MAX_DATAGRAM_SIZE);
+            ip::udp::endpoint sender;
+            for (;;) {
+                const auto size = co_await sink.async_receive_from(boost::asio::buffer(buffer), sender, boost::asio::use_awaitable);
+                sinkDatagrams.fetch_add(1, std::memory_order_relaxed);
+                sinkBytes.fetch_add(size, std::memory_order_relaxed);
+            }
+        },
+        boost::asio::detached);
+
+    rft::HandshakeOptions handshakeOptions;
+    handshakeOptions.requireCookie = false;
+    handshakeOptions.hellosPerSecond = 1e9;
+    handshakeOptions.helloBurst = 1e9;
+    rft::Server server(ioContext.get_executor(), 0, root, {}, handshakeOptions);
+    server.Start();
+
+    std::promise<void> finished;
+    const auto wallStart = std::chrono::steady_clock::now();
+    boost::asio::co_spawn(
+        ioContext,
+        [&]() -> boost::asio::awaitable<void> {
+            boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+            const auto firstTimestamp = inbound.empty() ? std::chrono::nanoseconds{0} : inbound.front().captured.timestamp;
+
+            for (auto& datagram : inbound) {
+                if (realtime) {
+                    const auto offset = std::chrono::duration<double, std::nano>(datagram.captured.timestamp - firstTimestamp) / speed;
+                    timer.expires_at(wallStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset));
+                    co_await timer.async_wait(boost::asio::use_awaitable);
+                }
+                co_await server.Dispatch(std::move(datagram.captured.datagram), sinkEndpoint, datagram.streamId);
+            }
+        },
+        [&finished](std::exception_ptr) { finished.set_value(); });
+
+    finished.get_future().wait();
+    const auto wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{map["drain-ms"].as<unsigned>()});
+    server.Stop();
+    ioContext.stop();
+    ioContext.join();
+
+    const auto& endpoint = server.Metrics().Endpoint();
+    std::cout << std::format(
+        R"({{"label":"{}","capture":"{}","records":{},"replayed":{},"skippedHellos":{},"realtime":{},"wallSeconds":{:.6f},"datagramsPerSecond":{:.1f},)"
+        R"("streamsOpened":{},"datagramsSent":{},"bytesSent":{},"sinkDatagrams":{},"sinkBytes":{}}})",
+        map["label"].as<std::string>(), capturePath, records, inbound.size(), skippedHellos, realtime, wallSeconds,
+        wallSeconds > 0 ? static_cast<double>(inbound.size()) / wallSeconds : 0.0, endpoint.streamsOpened.Load(), endpoint.datagramsSent.Load(),
+        endpoint.bytesSent.Load(), sinkDatagrams.load(), sinkBytes.load())
+              << "\n";
+
+    rft::log::StopAsyncLogging();
+}
@@ -1,6 +1,7 @@
 #include "../librft/server.hpp"
 
 #include <boost/program_options.hpp>
+#include <fstream>
 #include <iostream>
 #include <filesystem>
 #include "pch.hpp"
@@ -11,7 +12,39 @@ std::vector<std::string> files; // currently available files
 
 int main(int argc, char** argv) {
     options::options_description desc("Allowed options");
-    desc.add_options()("help", "Print help message")("version", "Print version");
+    desc.add_options()("help", "Print help message")("version", "Print version")
+        ("log-file", options::value<std::string>(), "Write the log to this file instead of the console")
+        ("log-level", options::value<std::string>()->default_value("info"), "Minimum log level (trace, debug, info, warning, error, fatal)")
+        ("sync-log", "Log synchronously on the calling thread instead of using the background logging thread")
+        ("metrics-file", options::value<std::string>(), "Append a JSON metrics snapshot to this file periodically (- for stdout)")
+        ("metrics-interval", options::value<int>()->default_value(5000), "Interval between two metrics snapshots in milliseconds")
+        ("cache-size", options::value<size_t>()->default_value(256), "Memory budget of the file cache in MiB")
+        ("cache-block-size", options::value<size_t>()->default_value(1024), "Size of the blocks the file cache reads and keeps in KiB")
+        ("cache-shards", options::value<size_t>()->default_value(16), "Number of independently locked LRU shards of the file cache")
+        ("small-file-threshold", options::value<size_t>()->default_value(16), "Files up to this many KiB are sent in one burst right behind the ServerHello")
+        ("no-cookies", "Commit a stream for every client hello, without the stateless cookie round trip first")
+        ("hello-rate", options::value<double>()->default_value(20.0), "Client hellos per second that a single source address may send")
+        ("hello-burst", options::value<double>()->default_value(40.0), "Client hellos that a single source address may send in a burst")
+        ("hash-first", "Hash the whole file before sending the ServerHello, instead of sending the digest in the FinMessage")
+        ("no-zero-ranges", "Send all-zero chunks like any other chunk, instead of as zero ranges")
+        ("no-encryption", "Send chunks in clear text, even if the client asks for encryption")
+        ("require-encryption", "Only accept clients that ask for encryption")
+        ("psk-file", options::value<std::string>(), "Mix the contents of this file into the key of encrypted streams, clients need the same")
+        ("capture-file", options::value<std::string>(), "Write every datagram received and sent to this file, for rft_replay")
+        ("multicast-file", options::value<std::string>(), "Also send this file of the root directory to a multicast group, once for all receivers")
+        ("multicast-group", options::value<std::string>()->default_value("239.255.70.84"), "Multicast group address")
+        ("multicast-port", options::value<unsigned short>()->default_value(5052), "Multicast group port")
+        ("multicast-interface", options::value<std::string>(), "Address of the interface to multicast from (e.g. 127.0.0.1 to stay on this host)")
+        ("multicast-rate-mbps", options::value<double>()->default_value(100.0), "Multicast sending rate in Mbit/s, there is no congestion control")
+        ("multicast-ttl", options::value<unsigned>()->default_value(1), "Hops multicast datagrams may take")
+        ("max-ack-every", options::value<unsigned>()->default_value(16), "Clients may ACK at most every n chunks")
+        ("max-ack-delay-us", options::value<U32>()->default_value(25000), "Clients may hold back ACKs for at most this long")
+        ("idle-timeout", options::value<unsigned>()->default_value(15), "Abort streams whose client didn't send anything for this many seconds")
+        ("linger-ms", options::value<unsigned>()->default_value(5000), "How long a stream stays around after its last chunk in milliseconds")
+        ("egress-mbps", options::value<double>()->default_value(0.0), "Cap for the data rate of all streams together in Mbit/s (0 = no cap)")
+        ("interactive-weight", options::value<unsigned>()->default_value(4), "Scheduling weight of streams for files up to 1 MiB, relative to larger files")
+        ("trace-file", options::value<std::string>(), "Record per-stage latencies and write a sampled Chrome trace to this file on exit (needs RFT_ENABLE_TRACING)")
+        ("trace-sample", options::value<unsigned>()->default_value(64), "Keep every n-th stage as a trace event");
 
     options::variables_map map;
     options::store(options::parse_command_line(argc, argv, desc), map);
@@ -22,10 +55,104 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    const auto severity = rft::log::ParseSeverity(map["log-level"].as<std::string>());
+    if (!severity) {
+        std::cout << "Unknown log level " << map["log-level"].as<std::string>() << "\n";
+        return 1;
+    }
+    rft::log::SetMinimumSeverity(*severity);
+
+    if (map.count("sync-log") == 0) {
+        rft::log::AsyncLoggingOptions logOptions;
+        if (map.count("log-file") > 0) {
+            logOptions.file = map["log-file"].as<std::string>();
+        }
+        logOptions.minimumSeverity = *severity;
+
+        rft::log::StartAsyncLogging(logOptions);
+    }
+
+    if (map.count("trace-file") > 0) {
+        if (!rft::tracing::COMPILED_IN) {
+            std::cout << "Tracing is not available, rebuild with -DRFT_ENABLE_TRACING=ON.\n";
+            return 1;
+        }
+        rft::tracing::Enable({.sampleEvery = map["trace-sample"].as<unsigned>()});
+    }
+
+    // Checked before anything starts, so a typo doesn't silently leave us without metrics
+    std::ofstream metricsFile;
+    std::string metricsPath;
+    const auto metricsInterval = std::chrono::milliseconds{map["metrics-interval"].as<int>()};
+    if (map.count("metrics-file") > 0) {
+        metricsPath = map["metrics-file"].as<std::string>();
+        if (metricsPath != "-") {
+            metricsFile.open(metricsPath, std::ios::out | std::ios::app);
+            if (!metricsFile) {
+                std::cout << "Can't open the metrics file " << metricsPath << "\n";
+                return 1;
+            }
+        }
+
+        if (metricsInterval <= std::chrono::milliseconds::zero()) {
+            std::cout << "The metrics interval has to be positive, not " << metricsInterval.count() << "ms\n";
+            return 1;
+        }
+    }
+
     boost::asio::thread_pool ioContext;
-    rft::Server s(ioContext.get_executor(), 5051);
+    rft::FileCacheOptions fileCacheOptions{
+        .memoryBudgetBytes = map["cache-size"].as<size_t>() * 1024 * 1024,
+        .blockSize = map["cache-block-size"].as<size_t>() * 1024,
+        .shards = map["cache-shards"].as<size_t>(),
+        .smallFileThreshold = map["small-file-threshold"].as<size_t>() * 1024,
+    };
+    rft::HandshakeOptions handshakeOptions{
+        .requireCookie = map.count("no-cookies") == 0,
+        .hellosPerSecond = map["hello-rate"].as<double>(),
+        .helloBurst = map["hello-burst"].as<double>(),
+        .ackFrequencyLimit = {static_cast<U8>(std::clamp(map["max-ack-every"].as<unsigned>(), 1u, 255u)), map["max-ack-delay-us"].as<U32>()},
+        .digestInFin = map.count("hash-first") == 0,
+        .allowZeroRanges = map.count("no-zero-ranges") == 0,
+        .allowEncryption = map.count("no-encryption") == 0,
+        .requireEncryption = map.count("require-encryption") > 0,
+    };
+    if (map.count("psk-file") > 0) {
+        std::ifstream pskFile(map["psk-file"].as<std::string>(), std::ios::binary);
+        handshakeOptions.preSharedKey.assign(std::istreambuf_iterator<char>(pskFile), {});
+    }
+    rft::TransmitSchedulerOptions transmitOptions;
+    transmitOptions.egressBytesPerSecond = map["egress-mbps"].as<double>() * 1e6 / 8.0;
+    transmitOptions.interactiveWeight = map["interactive-weight"].as<unsigned>();
+    rft::StreamLifetimeOptions lifetimeOptions;
+    lifetimeOptions.idleTimeout = std::chrono::seconds{map["idle-timeout"].as<unsigned>()};
+    lifetimeOptions.linger = std::chrono::milliseconds{map["linger-ms"].as<unsigned>()};
+    rft::Server s(ioContext.get_executor(), 5051, rft::Server::DefaultRootDirectory(), fileCacheOptions, handshakeOptions, transmitOptions, lifetimeOptions);
+    if (map.count("capture-file") > 0) {
+        s.StartCapture(map["capture-file"].as<std::string>());
+    }
+
+    boost::asio::signal_set signals(ioContext, SIGINT, SIGTERM);
+    signals.async_wait([&ioContext](const boost::system::error_code&, int) { ioContext.stop(); });
+
     boost::asio::co_spawn(ioContext, s.Run(), boost::asio::detached);
 
+    if (map.count("multicast-file") > 0) {
+        rft::MulticastOptions multicastOptions;
+        multicastOptions.group = {boost::asio::ip::make_address(map["multicast-group"].as<std::string>()), map["multicast-port"].as<unsigned short>()};
+        if (map.count("multicast-interface") > 0) {
+            multicastOptions.interfaceAddress = boost::asio::ip::make_address(map["multicast-interface"].as<std::string>());
+        }
+        multicastOptions.bytesPerSecond = map["multicast-rate-mbps"].as<double>() * 1e6 / 8.0;
+        multicastOptions.ttl = static_cast<U8>(std::clamp(map["multicast-ttl"].as<unsigned>(), 1u, 255u));
+        boost::asio::co_spawn(ioContext, s.Multicast(map["multicast-file"].as<std::string>(), multicastOptions), boost::asio::detached);
+    }
+
+    if (map.count("metrics-file") > 0) {
+        auto& metricsOutput = metricsPath == "-" ? std::cout : metricsFile;
+        boost::asio::co_spawn(ioContext, rft::metrics::ReportPeriodically(s.Metrics(), metricsOutput, metricsInterval), boost::asio::detached);
+    }
+
     std::cout << "________________________________\n"
               << "\\______   \\_   _____/\\__    ___/\n"
               << "|       _/|    __)    |    |\n"
@@ -35,13 +162,12 @@ int main(int argc, char** argv) {
               << "\nRFT server reference implementation. \n(c) 2022 Alexander Maslew, Frederic Schoenberger\n\n";
 
 
-    std::string path = getenv("USERPROFILE");
-    path += "\\RFT";
+    const auto path = rft::Server::DefaultRootDirectory();
     //auto dirIter = std::filesystem::directory_iterator(path);
     int fileCount = 0;
     for (const auto& entry : std::filesystem::directory_iterator(path)) fileCount++;
 
-    if (fileCount == 0) std::cout << "Please put files into the " << path << " folder!\n";
+    if (fileCount == 0) std::cout << "Please put files into the " << path.string() << " folder!\n";
 
     std::cout << "Currently serving the following " << fileCount << " files:\n";
     for (const auto& entry : std::filesystem::directory_iterator(path)) {
@@ -51,5 +177,13 @@ int main(int argc, char** argv) {
 
     ioContext.join();
 
+    if (map.count("trace-file") > 0) {
+        rft::tracing::Disable();
+        rft::tracing::WriteChromeTrace(map["trace-file"].as<std::string>());
+        std::cout << rft::tracing::HistogramReport() << "\n";
+    }
+
+    rft::log::StopAsyncLogging();
+
     std::cout << "Goodbye from server.\n";
 }
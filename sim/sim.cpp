@@ -0,0 +1,121 @@
+#include "pch.hpp"
+
+#include <boost/program_options.hpp>
+#include <iostream>
+
+#include "../librft/logger.hpp"
+#include "../librft/simulation.hpp"
+
+namespace options = boost::program_options;
+namespace simulation = rft::simulation;
+
+namespace {
+
+// Every congestion control algorithm that can be evaluated
+const std::map<std::string, std::function<simulation::SimulationResult(const simulation::Scenario&)>> ALGORITHMS{
+    {"reno", simulation::Simulate<rft::RenolikeCongestionControl>},
+};
+
+simulation::Duration Milliseconds(double milliseconds) {
+    return std::chrono::duration_cast<simulation::Duration>(std::chrono::duration<double, std::milli>(milliseconds));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "Print help message")
+        ("algorithm", options::value<std::string>()->default_value("reno"), "Congestion control algorithm to simulate")
+        ("flows", options::value<unsigned>()->default_value(1), "Number of concurrent flows sharing the link")
+        ("bytes", options::value<U64>()->default_value(100 * 1024 * 1024), "Bytes to transfer per flow")
+        ("bandwidth", options::value<double>()->default_value(100.0), "Link bandwidth in Mbit/s (both directions)")
+        ("rtt", options::value<double>()->default_value(100.0), "Round trip time in milliseconds")
+        ("jitter", options::value<double>()->default_value(0.0), "One-way jitter in milliseconds")
+        ("loss", options::value<double>()->default_value(0.0), "Loss probability per datagram (both directions)")
+        ("reorder", options::value<double>()->default_value(0.0), "Reordering probability per datagram")
+        ("reorder-delay", options::value<double>()->default_value(5.0), "Additional delay of reordered datagrams in milliseconds")
+        ("duplicate", options::value<double>()->default_value(0.0), "Duplication probability per datagram")
+        ("queue", options::value<size_t>()->default_value(256 * 1024), "Link queue limit in bytes")
+        ("time-limit", options::value<double>()->default_value(600.0), "Stop after this many virtual seconds")
+        ("sample-interval", options::value<double>()->default_value(100.0), "Throughput sample interval in virtual milliseconds")
+        ("seed", options::value<U64>()->default_value(1), "Seed for the random number generator")
+        ("ack-every", options::value<unsigned>()->default_value(1), "Receivers ACK every n chunks")
+        ("ack-delay-us", options::value<U32>()->default_value(0), "Receivers hold back ACKs for at most this long (virtual time), 0 ACKs right away")
+        ("require-completion", "Fail unless every flow transferred all its bytes within the time limit")
+        ("min-goodput", options::value<double>()->default_value(0.0), "Fail if the goodput of all flows together is below this many Mbit/s")
+        ("min-fairness", options::value<double>()->default_value(0.0), "Fail if Jain's fairness index over the flows is below this");
+
+    options::variables_map map;
+    options::store(options::parse_command_line(argc, argv, desc), map);
+    options::notify(map);
+
+    if (map.count("help") > 0) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    const auto algorithm = ALGORITHMS.find(map["algorithm"].as<std::string>());
+    if (algorithm == ALGORITHMS.end()) {
+        std::cout << "Unknown algorithm " << map["algorithm"].as<std::string>() << "\n";
+        return 1;
+    }
+
+    // The congestion control logs every out of order datagram, which would dominate the run time
+    rft::log::StartAsyncLogging({.minimumSeverity = rft::kError});
+
+    simulation::LinkParameters link;
+    link.bandwidthBitsPerSecond = map["bandwidth"].as<double>() * 1e6;
+    link.delay = Milliseconds(map["rtt"].as<double>() / 2);
+    link.jitter = Milliseconds(map["jitter"].as<double>());
+    link.lossRate = map["loss"].as<double>();
+    link.reorderRate = map["reorder"].as<double>();
+    link.reorderDelay = Milliseconds(map["reorder-delay"].as<double>());
+    link.duplicateRate = map["duplicate"].as<double>();
+    link.queueLimitBytes = map["queue"].as<size_t>();
+
+    simulation::Scenario scenario;
+    scenario.forward = link;
+    scenario.reverse = link;
+    scenario.flows = map["flows"].as<unsigned>();
+    scenario.bytesPerFlow = map["bytes"].as<U64>();
+    scenario.timeLimit = Milliseconds(map["time-limit"].as<double>() * 1000);
+    scenario.sampleInterval = Milliseconds(map["sample-interval"].as<double>());
+    scenario.seed = map["seed"].as<U64>();
+    if (map["ack-every"].as<unsigned>() > 1) {
+        scenario.ackFrequency = rft::AckFrequency{static_cast<U8>(std::min(map["ack-every"].as<unsigned>(), 255u)), map["ack-delay-us"].as<U32>()};
+    }
+
+    const auto result = algorithm->second(scenario);
+    std::cout << result.ToJson(algorithm->first) << "\n";
+
+    rft::log::StopAsyncLogging();
+
+    // With thresholds, a run is a regression test: the same seed always gives the same result, so any failure is a change in behavior
+    std::vector<std::string> failures;
+    if (map.count("require-completion") > 0) {
+        for (const auto& flow : result.flows) {
+            if (!flow.completionTime) {
+                failures.push_back(std::format("flow {} delivered only {} of {} bytes", flow.streamId, flow.bytesDelivered, scenario.bytesPerFlow));
+            }
+        }
+    }
+
+    U64 bytesDelivered = 0;
+    for (const auto& flow : result.flows) {
+        bytesDelivered += flow.bytesDelivered;
+    }
+    const auto seconds = std::chrono::duration<double>(result.virtualTime).count();
+    const auto goodputMbps = seconds > 0 ? static_cast<double>(bytesDelivered) * 8.0 / seconds / 1e6 : 0.0;
+    if (goodputMbps < map["min-goodput"].as<double>()) {
+        failures.push_back(std::format("the goodput of {:.3f} Mbit/s is below {:.3f} Mbit/s", goodputMbps, map["min-goodput"].as<double>()));
+    }
+    if (result.fairness < map["min-fairness"].as<double>()) {
+        failures.push_back(std::format("the fairness of {:.4f} is below {:.4f}", result.fairness, map["min-fairness"].as<double>()));
+    }
+
+    for (const auto& failure : failures) {
+        std::cerr << "FAILED: " << failure << "\n";
+    }
+    return failures.empty() ? 0 : 2;
+}